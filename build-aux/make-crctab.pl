@@ -17,6 +17,30 @@
 #
 
 use Text::Wrap;
+
+# CRC table, the usual one.
+@T = map {
+  $c = $_<<24;
+  for (1..8) { $c = ($c<<1) & 0xFFFFFFFF ^ 0x04C11DB7 & -($c>>31); }
+  $c
+} 0..255;
+
+# Update CRC $c with byte $b.
+sub step { my ($c,$b) = @_; ($c<<8) & 0xFFFFFFFF ^ $T[($c>>24) ^ $b] }
+
+# CRC of 2^k copies of byte d, starting from zero CRC.
+for $k (0..7) { for $d (0..255) {
+  $c = 0; $c = step($c,$d) for 1..(1<<$k); $R[$k][$d] = $c;
+} }
+
+# CRC $c updated with 2^k zero bytes is linear in $c, so it's computed
+# byte by byte, using 4 tables per k, one for each byte of $c.
+for $k (0..7) { for $j (0..3) { for $b (0..255) {
+  $c = $b<<(24-($j<<3)); $c = step($c,0) for 1..(1<<$k); $Z[$k][$j][$b] = $c;
+} } }
+
+sub table { my $i = shift; wrap $i,$i,map { sprintf "0x%08lX,",$_ } @_ }
+
 open F, ">src/crctab.c" or die;
 printf F q(/* This file was generated automatically by make-crctab.pl.
    For comments refer to the generator script -- make-crctab.pl. */
@@ -27,8 +51,15 @@ printf F q(/* This file was generated automatically by make-crctab.pl.
 uint32_t crc_table[256] = {
 %s
 };
-), wrap '  ','  ',map {
-  $c = $_<<24;
-  for (1..8) { $c = ($c<<1) & 0xFFFFFFFF ^ 0x04C11DB7 & -($c>>31); }
-  sprintf "0x%08lX,",$c
-} 0..255
+
+uint32_t crc_run_table[8][256] = {
+%s
+};
+
+uint32_t crc_zero_table[8][4][256] = {
+%s
+};
+), wrap('  ','  ',map { sprintf "0x%08lX,",$_ } @T),
+  join("\n", map { "  {\n".table('    ',@{$R[$_]})."\n  }," } 0..7),
+  join("\n", map { $k = $_; "  {\n".join("\n", map {
+    "    {\n".table('      ',@{$Z[$k][$_]})."\n    }," } 0..3)."\n  }," } 0..7);
@@ -71,8 +71,12 @@ print F;
 
 __END__
 Usage:
-1. PROG [-n WTHRS] [-k|-c|-t] [-d|-z] [-1 .. -9] [-f] [-v] [-S] {FILE}
-2. PROG -h|-V
+1. PROG [-n WTHRS] [-k|-c|-t] [-d|-z] [-1 .. -9] [-f] [-v] [-S]
+   [--bwt=ENGINE] [--flush-interval=MS] [--index] {FILE}
+2. PROG --build-index {FILE}
+3. PROG [-n WTHRS] [-t] --range=OFFSET:LENGTH|--from-offset=OFFSET FILE
+   {FILE}
+4. PROG -h|-V
 
 Recognized PROG names:
 
@@ -135,14 +139,46 @@ Reduce memory usage at cost of performance.
 
 @-u, --sequential
 Perform splitting input blocks sequentially. This may improve compression ratio
-and decrease CPU usage, but will degrade scalability.
+and decrease CPU usage. Only finding block boundaries is done sequentially, so
+scalability is degraded only slightly.
+
+@--bwt=ENGINE
+Select the block sorting engine used for compression. ENGINE is one of
+`divsufsort' (the default), `sais' (linear time induced sorting, slower on
+average but not susceptible to highly repetitive input) or `auto' (choose per
+block, with the same output as `divsufsort').
+
+@--flush-interval=MS
+When compressing, end a block early if it was not filled within MS
+milliseconds of reading its first byte. This bounds the delay of compressed
+output when input is slow. 0 (the default) disables flushing.
+
+@--index
+When compressing FILE operands, also write a block index for each compressed
+file to a file named like it with `.idx' appended. The index allows
+extracting parts of the file without decompressing all of it.
+
+@--build-index
+Build block indexes for existing bzip2 files. Each FILE is decompressed,
+discarding output, and its index is written to FILE with `.idx' appended.
+Without FILE operands the index of stdin is written to stdout.
+
+@--range=OFFSET:LENGTH
+Decompress LENGTH bytes of data starting at OFFSET from each FILE to stdout,
+using the index written by `--index' or `--build-index'. Only blocks
+covering the range are read and decompressed.
+
+@--from-offset=OFFSET
+Decompress each FILE to stdout starting from the first block found after
+byte OFFSET of compressed data. No index is needed. Stream CRC of the first
+stream can't be verified, which is warned about.
 
 @-v, --verbose
 Log each (de)compression start to stderr. Display compression ratio and space
 savings. Display progress information if stderr is connected to a terminal.
 
 @-S
-Print condition variable statistics to stderr.
+Print internal statistics to stderr.
 
 @-q, --quiet, --repetitive-fast, --repetitive-best, --exponential
 Accepted for compatibility, otherwise ignored.
@@ -30,9 +30,17 @@ src/parse.c
 src/signals.h
 src/main.c
 src/divbwt.c
+src/sais.c
+src/library.c
+src/bzlib.c
 src/decode.h
 src/process.h
 src/main.h
+src/lbzip2.h
+src/bzlib.h
+src/index.c
+src/index.h
+src/prefix.h
 ) if !@ARGV;  # The user knows better.
 
 sub msg { print "$f: @_\n"; ++$cnt }
@@ -0,0 +1,1706 @@
+/*-
+  bzlib.c -- libbz2 compatible library
+
+  Copyright (C) 2012, 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include <pthread.h>            /* pthread_create() */
+#include <stdio.h>              /* fread() */
+#include <string.h>             /* memcpy() */
+#include <unistd.h>             /* sysconf() */
+
+#include "xalloc.h"             /* xmalloc() */
+#include "decode.h"             /* retrieve() */
+#include "encode.h"             /* collect() */
+
+#include "bzlib.h"
+
+
+/*
+  This library implements the interface of libbz2 on top of lbzip2 encoder
+  and decoder, so that programs linked with libbz2 can (de)compress in
+  parallel without being modified.
+
+  Input passed to BZ2_bzCompress() is collected into blocks by the calling
+  thread.  Full blocks are encoded by a pool of worker threads and written
+  out in order.  Likewise BZ2_bzDecompress() parses and retrieves blocks in
+  the calling thread, while workers do the inverse BWT and emit output.
+  Workers are started only when a stream has more than one block in flight,
+  so single-block streams are processed entirely by the caller, much like
+  libbz2 does.
+
+  bz_stream semantics are kept: all input is consumed unless output buffer
+  is full, and a decompressor never consumes data past the end of stream.
+  To achieve the latter, input is consumed into a word-aligned buffer, and
+  words not loaded into bit buffer are given back when processing must stop
+  because of full output buffer.  Words loaded by the retriever never extend
+  past the end of stream, as every block is followed by at least 80 bits of
+  stream metadata.  The last word of stream may be incomplete, so stream
+  trailer is parsed speculatively with that word padded with zeros.  End of
+  stream is not consumed until all output has been delivered, because many
+  callers stop calling BZ2_bzDecompress() once they run out of input.
+
+  Memory is allocated with malloc(), and failure to allocate it is reported
+  as BZ_MEM_ERROR.  bzalloc and bzfree members of bz_stream are ignored: most
+  memory is allocated and released by worker threads, and allocators given
+  by libbz2 users can't be assumed to be thread-safe.
+*/
+
+
+#define xlock(m)      ((void)(pthread_mutex_lock(m)      && (abort(), 0)))
+#define xunlock(m)    ((void)(pthread_mutex_unlock(m)    && (abort(), 0)))
+#define xwait(c,m)    ((void)(pthread_cond_wait(c,m)     && (abort(), 0)))
+#define xsignal(c)    ((void)(pthread_cond_signal(c)     && (abort(), 0)))
+#define xbroadcast(c) ((void)(pthread_cond_broadcast(c)  && (abort(), 0)))
+#define xjoin(t)      ((void)(pthread_join(t, NULL)      && (abort(), 0)))
+
+/* Status of a decompressed block whose output could not be allocated. */
+#define ERR_NOMEM -1
+
+/* Size of input buffer of decompressor, in 32-bit words. */
+#define IBUF_WORDS 16384u
+
+
+/* The decoder calls xmalloc() only in parts of it which this library doesn't
+   use.  xmalloc() and xalloc_die() are defined here rather than taken from
+   gnulib, so that the library is built from this directory alone. */
+void
+xalloc_die(void)
+{
+  abort();
+}
+
+
+void *
+xmalloc(size_t n)
+{
+  void *p = malloc(n);
+
+  if (p == NULL && n != 0)
+    xalloc_die();
+  return p;
+}
+
+
+static void
+add_total(unsigned int *lo32, unsigned int *hi32, int64_t n)
+{
+  uint64_t total = ((uint64_t)*hi32 << 32 | *lo32) + n;
+
+  *lo32 = (uint32_t)total;
+  *hi32 = (uint32_t)(total >> 32);
+}
+
+
+/* Consume n bytes of input, or give them back if n is negative. */
+static void
+advance_in(bz_stream *strm, int64_t n)
+{
+  strm->next_in += n;
+  strm->avail_in -= n;
+  add_total(&strm->total_in_lo32, &strm->total_in_hi32, n);
+}
+
+
+/* Write as much of n bytes at buf as fits in output buffer.  Return the
+   number of bytes written. */
+static size_t
+put_out(bz_stream *strm, const void *buf, size_t n)
+{
+  n = min(n, strm->avail_out);
+  memcpy(strm->next_out, buf, n);
+  strm->next_out += n;
+  strm->avail_out -= n;
+  add_total(&strm->total_out_lo32, &strm->total_out_hi32, n);
+
+  return n;
+}
+
+
+/*
+  WORKER POOL
+
+  Each stream has its own list of blocks in stream order.  Workers take the
+  first block nobody works on.  The calling thread waits only for the oldest
+  block, and does its work itself if no worker has taken it yet.
+*/
+
+struct job {
+  struct job *next;
+  bool claimed;                 /* being or already processed */
+  bool done;
+};
+
+struct pool {
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;     /* signalled when a job is added */
+  pthread_cond_t done_cond;     /* signalled when a job is done */
+  void (*run)(struct job *);
+  struct job *head;             /* oldest job */
+  struct job *tail;
+  unsigned num_jobs;
+  unsigned max_jobs;            /* limit of jobs in flight */
+  pthread_t *thread;
+  unsigned num_thread;
+  unsigned max_thread;
+  bool shutdown;
+};
+
+
+static void *
+pool_worker(void *arg)
+{
+  struct pool *p = arg;
+  struct job *j;
+
+  xlock(&p->mutex);
+  for (;;) {
+    for (j = p->head; j != NULL && j->claimed; j = j->next)
+      ;
+    if (j == NULL) {
+      if (p->shutdown)
+        break;
+      xwait(&p->work_cond, &p->mutex);
+      continue;
+    }
+
+    j->claimed = true;
+    xunlock(&p->mutex);
+    p->run(j);
+    xlock(&p->mutex);
+    j->done = true;
+    xbroadcast(&p->done_cond);
+  }
+  xunlock(&p->mutex);
+
+  return NULL;
+}
+
+
+static bool
+pool_init(struct pool *p, void (*run)(struct job *))
+{
+  long num_online = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  num_online = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+  p->max_thread = num_online > 1 ? min(num_online, 256) : 1;
+  p->max_jobs = 2 * p->max_thread;
+  p->thread = malloc(p->max_thread * sizeof(pthread_t));
+  if (p->thread == NULL)
+    return false;
+
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->work_cond, NULL);
+  pthread_cond_init(&p->done_cond, NULL);
+  p->run = run;
+  p->head = NULL;
+  p->tail = NULL;
+  p->num_jobs = 0;
+  p->num_thread = 0;
+  p->shutdown = false;
+
+  return true;
+}
+
+
+/* Stop all workers.  Jobs not started yet are abandoned.  Jobs are left in
+   the list for the caller to release. */
+static void
+pool_uninit(struct pool *p)
+{
+  struct job *j;
+  unsigned i;
+
+  xlock(&p->mutex);
+  for (j = p->head; j != NULL; j = j->next)
+    j->claimed = true;
+  p->shutdown = true;
+  xbroadcast(&p->work_cond);
+  xunlock(&p->mutex);
+
+  for (i = 0; i < p->num_thread; i++)
+    xjoin(p->thread[i]);
+
+  pthread_cond_destroy(&p->done_cond);
+  pthread_cond_destroy(&p->work_cond);
+  pthread_mutex_destroy(&p->mutex);
+  free(p->thread);
+}
+
+
+static void
+pool_submit(struct pool *p, struct job *j)
+{
+  j->next = NULL;
+  j->claimed = false;
+  j->done = false;
+
+  xlock(&p->mutex);
+  if (p->tail != NULL)
+    p->tail->next = j;
+  else
+    p->head = j;
+  p->tail = j;
+  p->num_jobs++;
+
+  /* If thread creation fails, jobs are done by fewer workers or by the
+     calling thread. */
+  if (p->num_jobs > 1 && p->num_thread < p->max_thread &&
+      pthread_create(&p->thread[p->num_thread], NULL, pool_worker, p) == 0)
+    p->num_thread++;
+
+  xsignal(&p->work_cond);
+  xunlock(&p->mutex);
+}
+
+
+static bool
+pool_head_done(struct pool *p)
+{
+  bool done;
+
+  xlock(&p->mutex);
+  done = (p->head != NULL && p->head->done);
+  xunlock(&p->mutex);
+
+  return done;
+}
+
+
+/* Wait until the oldest job is done. */
+static void
+pool_wait(struct pool *p)
+{
+  struct job *j;
+
+  xlock(&p->mutex);
+  j = p->head;
+  assert(j != NULL);
+  while (!j->done) {
+    if (!j->claimed) {
+      j->claimed = true;
+      xunlock(&p->mutex);
+      p->run(j);
+      xlock(&p->mutex);
+      j->done = true;
+    }
+    else {
+      xwait(&p->done_cond, &p->mutex);
+    }
+  }
+  xunlock(&p->mutex);
+}
+
+
+/* Remove the oldest job, which must be done, from the list. */
+static struct job *
+pool_shift(struct pool *p)
+{
+  struct job *j;
+
+  xlock(&p->mutex);
+  j = p->head;
+  assert(j != NULL && j->done);
+  p->head = j->next;
+  if (p->head == NULL)
+    p->tail = NULL;
+  p->num_jobs--;
+  xunlock(&p->mutex);
+
+  return j;
+}
+
+
+/*
+  COMPRESSION
+*/
+
+enum { C_RUNNING, C_FLUSHING, C_FINISHING, C_IDLE, C_ERROR };
+
+struct cjob {
+  struct job job;
+  struct encoder_state *enc;
+  size_t collected;             /* number of input bytes collected */
+  uint32_t crc;
+  size_t size;                  /* size of compressed block */
+  const uint8_t *out;           /* compressed block */
+};
+
+struct cstate {
+  bz_stream *strm;
+  struct pool pool;
+  int mode;
+  unsigned bs100k;
+  unsigned avail_in_expect;     /* input left to flush or finish */
+  struct cjob *cur;             /* block being collected */
+  size_t out_pos;               /* compressed bytes of oldest block written */
+  uint32_t combined_crc;
+  bool trailer_done;
+  uint8_t meta[TRAILER_SIZE];   /* stream header or trailer */
+  unsigned meta_pos;
+  unsigned meta_len;
+};
+
+
+static void
+compress_job(struct job *j)
+{
+  struct cjob *cj = (struct cjob *)j;
+  bool sort_fallback;
+
+  /* encode() returns 0 if it runs out of memory. */
+  cj->size = encode(cj->enc, &cj->crc, &sort_fallback);
+  cj->out = cj->size > 0 ? transmit(cj->enc, NULL) : NULL;
+}
+
+
+static void
+free_cjob(struct cjob *cj)
+{
+  free(cj->enc);
+  free(cj);
+}
+
+
+int
+BZ2_bzCompressInit(bz_stream *strm, int blockSize100k, int verbosity,
+                   int workFactor)
+{
+  struct cstate *c;
+
+  if (strm == NULL || blockSize100k < 1 || blockSize100k > 9 ||
+      verbosity < 0 || verbosity > 4 || workFactor < 0 || workFactor > 250)
+    return BZ_PARAM_ERROR;
+
+  c = malloc(sizeof(struct cstate));
+  if (c == NULL)
+    return BZ_MEM_ERROR;
+  if (!pool_init(&c->pool, compress_job)) {
+    free(c);
+    return BZ_MEM_ERROR;
+  }
+
+  c->strm = strm;
+  c->mode = C_RUNNING;
+  c->bs100k = blockSize100k;
+  c->avail_in_expect = 0;
+  c->cur = NULL;
+  c->out_pos = 0;
+  c->combined_crc = 0;
+  c->trailer_done = false;
+  c->meta[0] = 0x42;
+  c->meta[1] = 0x5A;
+  c->meta[2] = 0x68;
+  c->meta[3] = 0x30 + blockSize100k;
+  c->meta_pos = 0;
+  c->meta_len = HEADER_SIZE;
+
+  strm->state = c;
+  strm->total_in_lo32 = 0;
+  strm->total_in_hi32 = 0;
+  strm->total_out_lo32 = 0;
+  strm->total_out_hi32 = 0;
+
+  return BZ_OK;
+}
+
+
+/* Write out stream metadata and compressed blocks that are ready, in stream
+   order.  Return true iff anything was written.  If a block could not be
+   compressed, enter C_ERROR mode. */
+static bool
+write_blocks(struct cstate *c)
+{
+  bz_stream *strm = c->strm;
+  size_t n;
+  bool progress = false;
+
+  for (;;) {
+    if (c->meta_pos < c->meta_len) {
+      n = put_out(strm, c->meta + c->meta_pos, c->meta_len - c->meta_pos);
+      c->meta_pos += n;
+      progress |= (n > 0);
+      if (c->meta_pos < c->meta_len)
+        break;
+    }
+
+    if (c->pool.num_jobs == 0 || !pool_head_done(&c->pool))
+      break;
+
+    {
+      struct cjob *cj = (struct cjob *)c->pool.head;
+
+      if (cj->out == NULL) {
+        c->mode = C_ERROR;
+        break;
+      }
+
+      n = put_out(strm, cj->out + c->out_pos, cj->size - c->out_pos);
+      c->out_pos += n;
+      progress |= (n > 0);
+      if (c->out_pos < cj->size)
+        break;
+
+      c->combined_crc = combine_crc(c->combined_crc, cj->crc);
+      c->out_pos = 0;
+      free_cjob((struct cjob *)pool_shift(&c->pool));
+    }
+  }
+
+  return progress;
+}
+
+
+static void
+write_trailer(struct cstate *c)
+{
+  c->meta[0] = 0x17;
+  c->meta[1] = 0x72;
+  c->meta[2] = 0x45;
+  c->meta[3] = 0x38;
+  c->meta[4] = 0x50;
+  c->meta[5] = 0x90;
+  c->meta[6] = c->combined_crc >> 24;
+  c->meta[7] = (c->combined_crc >> 16) & 0xFF;
+  c->meta[8] = (c->combined_crc >> 8) & 0xFF;
+  c->meta[9] = c->combined_crc & 0xFF;
+  c->meta_pos = 0;
+  c->meta_len = TRAILER_SIZE;
+  c->trailer_done = true;
+}
+
+
+/* Submit the block being collected, unless it is empty. */
+static void
+end_block(struct cstate *c)
+{
+  if (c->cur->collected > 0)
+    pool_submit(&c->pool, &c->cur->job);
+  else
+    free_cjob(c->cur);
+  c->cur = NULL;
+}
+
+
+/* Compress as much as possible.  If flush is true, all pending input is
+   compressed and written out.  Returns BZ_OK if any progress was made,
+   BZ_PARAM_ERROR if not or BZ_MEM_ERROR. */
+static int
+compress_step(struct cstate *c, bool flush)
+{
+  bz_stream *strm = c->strm;
+  bool progress = false;
+
+  for (;;) {
+    progress |= write_blocks(c);
+    if (c->mode == C_ERROR)
+      return BZ_MEM_ERROR;
+
+    if (strm->avail_in > 0) {
+      size_t avail, consumed;
+      int full;
+
+      if (c->cur == NULL) {
+        unsigned long mbs = c->bs100k * 100000ul;
+
+        if (c->pool.num_jobs >= c->pool.max_jobs) {
+          if (strm->avail_out == 0)
+            break;
+          pool_wait(&c->pool);
+          continue;
+        }
+
+        c->cur = malloc(sizeof(struct cjob));
+        if (c->cur == NULL)
+          return BZ_MEM_ERROR;
+        c->cur->enc = malloc(encoder_alloc_size(mbs));
+        if (c->cur->enc == NULL) {
+          free(c->cur);
+          c->cur = NULL;
+          return BZ_MEM_ERROR;
+        }
+        encoder_init(c->cur->enc, mbs, CLUSTER_FACTOR, BWT_DIVSUFSORT);
+        c->cur->collected = 0;
+      }
+
+      avail = strm->avail_in;
+      full = collect(c->cur->enc, (const uint8_t *)strm->next_in, &avail);
+      consumed = strm->avail_in - avail;
+      c->cur->collected += consumed;
+      advance_in(strm, consumed);
+      if (full)
+        end_block(c);
+      else
+        assert(avail == 0);
+
+      if (c->mode != C_RUNNING)
+        c->avail_in_expect -= consumed;
+      progress |= (consumed > 0);
+      continue;
+    }
+
+    if (!flush)
+      break;
+
+    if (c->cur != NULL) {
+      end_block(c);
+      continue;
+    }
+
+    if (c->pool.num_jobs > 0) {
+      if (strm->avail_out == 0)
+        break;
+      pool_wait(&c->pool);
+      continue;
+    }
+
+    if (c->mode == C_FINISHING && !c->trailer_done) {
+      write_trailer(c);
+      continue;
+    }
+
+    break;
+  }
+
+  return progress ? BZ_OK : BZ_PARAM_ERROR;
+}
+
+
+int
+BZ2_bzCompress(bz_stream *strm, int action)
+{
+  struct cstate *c;
+  int rv;
+
+  if (strm == NULL || strm->state == NULL)
+    return BZ_PARAM_ERROR;
+  c = strm->state;
+  if (c->strm != strm)
+    return BZ_PARAM_ERROR;
+
+  switch (c->mode) {
+  case C_RUNNING:
+    if (action == BZ_RUN) {
+      rv = compress_step(c, false);
+      return rv == BZ_OK ? BZ_RUN_OK : rv;
+    }
+    if (action != BZ_FLUSH && action != BZ_FINISH)
+      return BZ_PARAM_ERROR;
+    c->avail_in_expect = strm->avail_in;
+    c->mode = (action == BZ_FLUSH ? C_FLUSHING : C_FINISHING);
+    break;
+
+  case C_FLUSHING:
+    if (action != BZ_FLUSH)
+      return BZ_SEQUENCE_ERROR;
+    break;
+
+  case C_FINISHING:
+    if (action != BZ_FINISH)
+      return BZ_SEQUENCE_ERROR;
+    break;
+
+  case C_ERROR:
+    return BZ_MEM_ERROR;
+
+  default:
+    return BZ_SEQUENCE_ERROR;
+  }
+
+  if (c->avail_in_expect != strm->avail_in)
+    return BZ_SEQUENCE_ERROR;
+
+  rv = compress_step(c, true);
+  if (rv == BZ_MEM_ERROR)
+    return rv;
+
+  if (c->avail_in_expect > 0 || c->pool.num_jobs > 0 ||
+      c->meta_pos < c->meta_len ||
+      (c->mode == C_FINISHING && !c->trailer_done))
+    return c->mode == C_FLUSHING ? BZ_FLUSH_OK : BZ_FINISH_OK;
+
+  if (c->mode == C_FLUSHING) {
+    c->mode = C_RUNNING;
+    return BZ_RUN_OK;
+  }
+
+  c->mode = C_IDLE;
+  return BZ_STREAM_END;
+}
+
+
+int
+BZ2_bzCompressEnd(bz_stream *strm)
+{
+  struct cstate *c;
+
+  if (strm == NULL || strm->state == NULL)
+    return BZ_PARAM_ERROR;
+  c = strm->state;
+  if (c->strm != strm)
+    return BZ_PARAM_ERROR;
+
+  pool_uninit(&c->pool);
+  while (c->pool.head != NULL) {
+    struct cjob *cj = (struct cjob *)c->pool.head;
+
+    c->pool.head = cj->job.next;
+    free_cjob(cj);
+  }
+  if (c->cur != NULL)
+    free_cjob(c->cur);
+  free(c);
+  strm->state = NULL;
+
+  return BZ_OK;
+}
+
+
+/*
+  DECOMPRESSION
+*/
+
+enum { D_MAGIC, D_PARSE, D_RETRIEVE, D_END, D_ERROR };
+
+struct djob {
+  struct job job;
+  struct decoder_state *ds;
+  uint32_t expect_crc;
+  int status;
+  uint8_t *out;                 /* decompressed block */
+  size_t size;
+};
+
+struct dstate {
+  bz_stream *strm;
+  struct pool pool;
+  int mode;
+  int error;                    /* error returned in D_ERROR mode */
+  unsigned bs100k;
+  uint8_t magic[HEADER_SIZE];
+  unsigned magic_len;
+  struct parser_state ps;
+  struct djob *cur;             /* block being retrieved */
+  bool starved;                 /* retriever needs more input words */
+  size_t out_pos;               /* bytes of oldest block written */
+
+  /* Detached input bit stream. */
+  size_t ipos;                  /* next word to load */
+  size_t ibytes;                /* number of bytes in ibuf */
+  unsigned live;
+  uint64_t buff;
+  uint32_t ibuf[IBUF_WORDS];
+};
+
+
+static void
+decompress_job(struct job *j)
+{
+  struct djob *dj = (struct djob *)j;
+  size_t cap, left;
+  uint8_t *out;
+  int rv;
+
+  decode(dj->ds);
+
+  /* Run-length decoding usually expands data only a little, but can expand
+     it more than fifty times. */
+  cap = dj->ds->block_size + dj->ds->block_size / 4 + 64;
+  dj->out = malloc(cap);
+  dj->size = 0;
+  rv = ERR_NOMEM;
+  while (dj->out != NULL) {
+    left = cap - dj->size;
+    rv = emit(dj->ds, dj->out + dj->size, &left);
+    dj->size = cap - left;
+    if (rv != MORE)
+      break;
+    cap *= 2;
+    out = realloc(dj->out, cap);
+    if (out == NULL) {
+      rv = ERR_NOMEM;
+      break;
+    }
+    dj->out = out;
+  }
+
+  if (rv == OK && dj->ds->crc != dj->expect_crc)
+    rv = ERR_BLKCRC;
+  dj->status = rv;
+  free(dj->ds);
+  dj->ds = NULL;
+}
+
+
+static void
+free_djob(struct djob *dj)
+{
+  free(dj->ds);
+  free(dj->out);
+  free(dj);
+}
+
+
+int
+BZ2_bzDecompressInit(bz_stream *strm, int verbosity, int small)
+{
+  struct dstate *d;
+
+  if (strm == NULL || (small != 0 && small != 1) ||
+      verbosity < 0 || verbosity > 4)
+    return BZ_PARAM_ERROR;
+
+  d = malloc(sizeof(struct dstate));
+  if (d == NULL)
+    return BZ_MEM_ERROR;
+  if (!pool_init(&d->pool, decompress_job)) {
+    free(d);
+    return BZ_MEM_ERROR;
+  }
+
+  d->strm = strm;
+  d->mode = D_MAGIC;
+  d->error = BZ_OK;
+  d->magic_len = 0;
+  d->cur = NULL;
+  d->starved = false;
+  d->out_pos = 0;
+  d->ipos = 0;
+  d->ibytes = 0;
+  d->live = 0;
+  d->buff = 0;
+
+  strm->state = d;
+  strm->total_in_lo32 = 0;
+  strm->total_in_hi32 = 0;
+  strm->total_out_lo32 = 0;
+  strm->total_out_hi32 = 0;
+
+  return BZ_OK;
+}
+
+
+/* Write out decompressed blocks that are ready, in stream order.  Returns
+   BZ_OK or an error code if a bad block was found. */
+static int
+write_output(struct dstate *d)
+{
+  bz_stream *strm = d->strm;
+
+  while (d->pool.num_jobs > 0 && pool_head_done(&d->pool)) {
+    struct djob *dj = (struct djob *)d->pool.head;
+
+    if (dj->status != OK)
+      return dj->status == ERR_NOMEM ? BZ_MEM_ERROR : BZ_DATA_ERROR;
+
+    d->out_pos += put_out(strm, dj->out + d->out_pos, dj->size - d->out_pos);
+    if (d->out_pos < dj->size)
+      break;
+
+    d->out_pos = 0;
+    free_djob((struct djob *)pool_shift(&d->pool));
+  }
+
+  return BZ_OK;
+}
+
+
+/* Move input into input buffer.  Return the number of bytes moved. */
+static size_t
+fill_input(struct dstate *d)
+{
+  bz_stream *strm = d->strm;
+  size_t n;
+
+  if (d->ipos > 0) {
+    memmove(d->ibuf, d->ibuf + d->ipos, d->ibytes - 4 * d->ipos);
+    d->ibytes -= 4 * d->ipos;
+    d->ipos = 0;
+  }
+
+  n = min(strm->avail_in, sizeof(d->ibuf) - d->ibytes);
+  memcpy((char *)d->ibuf + d->ibytes, strm->next_in, n);
+  d->ibytes += n;
+  advance_in(strm, n);
+
+  return n;
+}
+
+
+/* Give back input bytes which were not loaded into bit buffer, but only
+   those which were consumed in the current call. */
+static void
+unfill_input(struct dstate *d, size_t filled)
+{
+  size_t keep = max(4 * d->ipos, d->ibytes - min(filled, d->ibytes));
+
+  advance_in(d->strm, -(int64_t)(d->ibytes - keep));
+  d->ibytes = keep;
+}
+
+
+static struct bitstream
+attach(struct dstate *d)
+{
+  struct bitstream bs;
+
+  bs.live = d->live;
+  bs.buff = d->buff;
+  bs.block = NULL;
+  bs.data = d->ibuf + d->ipos;
+  bs.limit = d->ibuf + d->ibytes / 4;
+  bs.eof = false;
+
+  return bs;
+}
+
+
+static void
+detach(struct dstate *d, const struct bitstream *bs)
+{
+  d->live = bs->live;
+  d->buff = bs->buff;
+  d->ipos = bs->data - d->ibuf;
+}
+
+
+/* End of stream was reached after bits_used bits of input buffer.  Give
+   back all input past the end of stream. */
+static void
+end_stream(struct dstate *d, uint64_t bits_used, size_t filled)
+{
+  size_t used = (bits_used + 7) / 8;
+
+  assert(used <= d->ibytes);
+  assert(d->ibytes - used <= filled);
+  advance_in(d->strm, -(int64_t)(d->ibytes - used));
+  d->ibytes = 0;
+  d->ipos = 0;
+  d->mode = D_END;
+}
+
+
+/* Try parsing the end of stream with the incomplete last word of input
+   padded with zeros, starting from given parser state and bit buffer.  If
+   the stream ends, or is found to be corrupt, before the padding, store the
+   number of bits of input buffer used by the stream in *end and return
+   FINISH or the error code.  Otherwise return MORE. */
+static int
+parse_tail(const struct dstate *d, struct parser_state *ps,
+           const struct bitstream *bs, uint64_t *end)
+{
+  struct parser_state ps2 = *ps;
+  struct bitstream bs2;
+  struct header hd;
+  unsigned garbage;
+  uint32_t word;
+  size_t pos = bs->data - d->ibuf;
+  int rv;
+
+  if (d->ibytes % 4 == 0 || pos != d->ibytes / 4)
+    return MORE;
+
+  word = 0;
+  memcpy(&word, d->ibuf + pos, d->ibytes % 4);
+  bs2.live = bs->live;
+  bs2.buff = bs->buff;
+  bs2.block = NULL;
+  bs2.data = &word;
+  bs2.limit = &word + 1;
+  bs2.eof = true;
+
+  /* A block header found in the last word can't be retrieved yet. */
+  rv = parse(&ps2, &hd, &bs2, &garbage);
+  if (rv == OK || rv == MORE)
+    return MORE;
+  *end = 32 * (pos + (bs2.data - &word)) - bs2.live;
+  if (*end > 8 * d->ibytes)
+    return MORE;
+
+  if (rv == FINISH)
+    *ps = ps2;
+  return rv;
+}
+
+
+static int
+decompress_fail(struct dstate *d, int error)
+{
+  d->mode = D_ERROR;
+  d->error = error;
+  return error;
+}
+
+
+int
+BZ2_bzDecompress(bz_stream *strm)
+{
+  struct dstate *d;
+  struct parser_state ps;
+  struct bitstream bs;
+  struct header hd;
+  unsigned garbage;
+  uint64_t end;
+  size_t filled;
+  int rv;
+
+  if (strm == NULL || strm->state == NULL)
+    return BZ_PARAM_ERROR;
+  d = strm->state;
+  if (d->strm != strm)
+    return BZ_PARAM_ERROR;
+
+  filled = 0;
+
+  for (;;) {
+    rv = write_output(d);
+    if (rv != BZ_OK)
+      return decompress_fail(d, rv);
+
+    switch (d->mode) {
+    case D_MAGIC:
+      while (d->magic_len < HEADER_SIZE && strm->avail_in > 0) {
+        d->magic[d->magic_len++] = *strm->next_in;
+        advance_in(strm, 1);
+      }
+      if (d->magic_len < HEADER_SIZE)
+        return BZ_OK;
+      if (d->magic[0] != 0x42 || d->magic[1] != 0x5A ||
+          d->magic[2] != 0x68 || d->magic[3] < 0x31 || d->magic[3] > 0x39)
+        return decompress_fail(d, BZ_DATA_ERROR_MAGIC);
+      d->bs100k = d->magic[3] - 0x30;
+      parser_init(&d->ps, d->bs100k, 1);
+      d->mode = D_PARSE;
+      continue;
+
+    case D_PARSE:
+      /* Don't start new blocks when too many are in flight or output buffer
+         is full.  In the latter case unloaded input is given back, so that
+         the caller sees some input left as long as there is output pending,
+         just like with libbz2. */
+      if (d->pool.num_jobs > 0 && (strm->avail_out == 0 ||
+                                   d->pool.num_jobs >= d->pool.max_jobs)) {
+        if (strm->avail_out == 0) {
+          unfill_input(d, filled);
+          return BZ_OK;
+        }
+        pool_wait(&d->pool);
+        continue;
+      }
+
+      ps = d->ps;
+      bs = attach(d);
+      rv = parse(&ps, &hd, &bs, &garbage);
+      end = 32 * (bs.data - d->ibuf) - bs.live;
+      if (rv == MORE)
+        rv = parse_tail(d, &ps, &bs, &end);
+
+      if (rv == FINISH) {
+        /* End of stream is consumed only after all output was delivered. */
+        if (d->pool.num_jobs > 0) {
+          if (strm->avail_out == 0) {
+            unfill_input(d, filled);
+            return BZ_OK;
+          }
+          pool_wait(&d->pool);
+          continue;
+        }
+        d->ps = ps;
+        end_stream(d, end, filled);
+        return BZ_STREAM_END;
+      }
+
+      d->ps = ps;
+      detach(d, &bs);
+
+      if (rv == OK) {
+        d->cur = malloc(sizeof(struct djob));
+        if (d->cur != NULL) {
+          d->cur->ds = malloc(decoder_alloc_size());
+          d->cur->out = NULL;
+          if (d->cur->ds == NULL) {
+            free(d->cur);
+            d->cur = NULL;
+          }
+        }
+        if (d->cur == NULL)
+          return decompress_fail(d, BZ_MEM_ERROR);
+        decoder_init(d->cur->ds);
+        d->cur->expect_crc = hd.crc;
+        d->starved = false;
+        d->mode = D_RETRIEVE;
+        continue;
+      }
+      if (rv != MORE)
+        return decompress_fail(d, BZ_DATA_ERROR);
+      break;
+
+    case D_RETRIEVE:
+      /* Retriever can't be resumed without new input. */
+      if (d->starved && d->ipos == d->ibytes / 4)
+        break;
+      bs = attach(d);
+      rv = retrieve(d->cur->ds, &bs);
+      detach(d, &bs);
+
+      if (rv == OK) {
+        if (d->cur->ds->block_size > d->bs100k * 100000u)
+          return decompress_fail(d, BZ_DATA_ERROR);
+        pool_submit(&d->pool, &d->cur->job);
+        d->cur = NULL;
+        d->mode = D_PARSE;
+        continue;
+      }
+      if (rv != MORE)
+        return decompress_fail(d, BZ_DATA_ERROR);
+      d->starved = true;
+      break;
+
+    case D_END:
+      return BZ_STREAM_END;
+
+    default:
+      return d->error;
+    }
+
+    /* More input is needed to continue parsing or retrieving. */
+    if (strm->avail_in > 0) {
+      filled += fill_input(d);
+      continue;
+    }
+
+    /* All input was consumed, so deliver all output that can be made
+       before returning. */
+    if (strm->avail_out == 0)
+      unfill_input(d, filled);
+    if (d->pool.num_jobs == 0 || strm->avail_out == 0)
+      return BZ_OK;
+    pool_wait(&d->pool);
+  }
+}
+
+
+int
+BZ2_bzDecompressEnd(bz_stream *strm)
+{
+  struct dstate *d;
+
+  if (strm == NULL || strm->state == NULL)
+    return BZ_PARAM_ERROR;
+  d = strm->state;
+  if (d->strm != strm)
+    return BZ_PARAM_ERROR;
+
+  pool_uninit(&d->pool);
+  while (d->pool.head != NULL) {
+    struct djob *dj = (struct djob *)d->pool.head;
+
+    d->pool.head = dj->job.next;
+    free_djob(dj);
+  }
+  if (d->cur != NULL)
+    free_djob(d->cur);
+  free(d);
+  strm->state = NULL;
+
+  return BZ_OK;
+}
+
+
+/*
+  UTILITY FUNCTIONS
+*/
+
+int
+BZ2_bzBuffToBuffCompress(char *dest, unsigned int *destLen, char *source,
+                         unsigned int sourceLen, int blockSize100k,
+                         int verbosity, int workFactor)
+{
+  bz_stream strm;
+  int rv;
+
+  if (dest == NULL || destLen == NULL || source == NULL)
+    return BZ_PARAM_ERROR;
+
+  strm.bzalloc = NULL;
+  strm.bzfree = NULL;
+  strm.opaque = NULL;
+  rv = BZ2_bzCompressInit(&strm, blockSize100k, verbosity, workFactor);
+  if (rv != BZ_OK)
+    return rv;
+
+  strm.next_in = source;
+  strm.next_out = dest;
+  strm.avail_in = sourceLen;
+  strm.avail_out = *destLen;
+
+  rv = BZ2_bzCompress(&strm, BZ_FINISH);
+  if (rv == BZ_FINISH_OK)
+    rv = BZ_OUTBUFF_FULL;
+  else if (rv == BZ_STREAM_END)
+    rv = BZ_OK;
+  if (rv == BZ_OK)
+    *destLen -= strm.avail_out;
+
+  BZ2_bzCompressEnd(&strm);
+  return rv;
+}
+
+
+int
+BZ2_bzBuffToBuffDecompress(char *dest, unsigned int *destLen, char *source,
+                           unsigned int sourceLen, int small, int verbosity)
+{
+  bz_stream strm;
+  int rv;
+
+  if (dest == NULL || destLen == NULL || source == NULL)
+    return BZ_PARAM_ERROR;
+
+  strm.bzalloc = NULL;
+  strm.bzfree = NULL;
+  strm.opaque = NULL;
+  rv = BZ2_bzDecompressInit(&strm, verbosity, small);
+  if (rv != BZ_OK)
+    return rv;
+
+  strm.next_in = source;
+  strm.next_out = dest;
+  strm.avail_in = sourceLen;
+  strm.avail_out = *destLen;
+
+  rv = BZ2_bzDecompress(&strm);
+  if (rv == BZ_OK)
+    rv = strm.avail_out > 0 ? BZ_UNEXPECTED_EOF : BZ_OUTBUFF_FULL;
+  else if (rv == BZ_STREAM_END)
+    rv = BZ_OK;
+  if (rv == BZ_OK)
+    *destLen -= strm.avail_out;
+
+  BZ2_bzDecompressEnd(&strm);
+  return rv;
+}
+
+
+const char *
+BZ2_bzlibVersion(void)
+{
+  return "1.0.6, lbzip2 " PACKAGE_VERSION;
+}
+
+
+/*
+  STDIO INTERFACE
+*/
+
+struct bzfile {
+  FILE *handle;
+  char buf[BZ_MAX_UNUSED];
+  int buf_len;
+  bool writing;
+  bz_stream strm;
+  int last_err;
+  bool init_ok;
+};
+
+#define SET_ERR(b,e)                            \
+  do {                                          \
+    if (bzerror != NULL)                        \
+      *bzerror = (e);                           \
+    if ((b) != NULL)                            \
+      (b)->last_err = (e);                      \
+  } while (0)
+
+
+BZFILE *
+BZ2_bzWriteOpen(int *bzerror, FILE *f, int blockSize100k, int verbosity,
+                int workFactor)
+{
+  struct bzfile *bzf = NULL;
+  int rv;
+
+  SET_ERR(bzf, BZ_OK);
+
+  if (f == NULL || blockSize100k < 1 || blockSize100k > 9 ||
+      workFactor < 0 || workFactor > 250 || verbosity < 0 || verbosity > 4) {
+    SET_ERR(bzf, BZ_PARAM_ERROR);
+    return NULL;
+  }
+  if (ferror(f)) {
+    SET_ERR(bzf, BZ_IO_ERROR);
+    return NULL;
+  }
+
+  bzf = malloc(sizeof(struct bzfile));
+  if (bzf == NULL) {
+    SET_ERR(bzf, BZ_MEM_ERROR);
+    return NULL;
+  }
+
+  bzf->handle = f;
+  bzf->buf_len = 0;
+  bzf->writing = true;
+  bzf->init_ok = false;
+  bzf->strm.bzalloc = NULL;
+  bzf->strm.bzfree = NULL;
+  bzf->strm.opaque = NULL;
+
+  rv = BZ2_bzCompressInit(&bzf->strm, blockSize100k, verbosity, workFactor);
+  if (rv != BZ_OK) {
+    SET_ERR(bzf, rv);
+    free(bzf);
+    return NULL;
+  }
+
+  bzf->strm.avail_in = 0;
+  bzf->init_ok = true;
+  SET_ERR(bzf, BZ_OK);
+  return bzf;
+}
+
+
+void
+BZ2_bzWrite(int *bzerror, BZFILE *b, void *buf, int len)
+{
+  struct bzfile *bzf = b;
+  size_t n;
+  int rv;
+
+  SET_ERR(bzf, BZ_OK);
+  if (bzf == NULL || buf == NULL || len < 0) {
+    SET_ERR(bzf, BZ_PARAM_ERROR);
+    return;
+  }
+  if (!bzf->writing) {
+    SET_ERR(bzf, BZ_SEQUENCE_ERROR);
+    return;
+  }
+  if (ferror(bzf->handle)) {
+    SET_ERR(bzf, BZ_IO_ERROR);
+    return;
+  }
+  if (len == 0)
+    return;
+
+  bzf->strm.avail_in = len;
+  bzf->strm.next_in = buf;
+
+  for (;;) {
+    bzf->strm.avail_out = BZ_MAX_UNUSED;
+    bzf->strm.next_out = bzf->buf;
+    rv = BZ2_bzCompress(&bzf->strm, BZ_RUN);
+    if (rv != BZ_RUN_OK) {
+      SET_ERR(bzf, rv);
+      return;
+    }
+
+    n = BZ_MAX_UNUSED - bzf->strm.avail_out;
+    if (n > 0 && (fwrite(bzf->buf, 1, n, bzf->handle) != n ||
+                  ferror(bzf->handle))) {
+      SET_ERR(bzf, BZ_IO_ERROR);
+      return;
+    }
+
+    if (bzf->strm.avail_in == 0)
+      return;
+  }
+}
+
+
+void
+BZ2_bzWriteClose64(int *bzerror, BZFILE *b, int abandon,
+                   unsigned int *nbytes_in_lo32,
+                   unsigned int *nbytes_in_hi32,
+                   unsigned int *nbytes_out_lo32,
+                   unsigned int *nbytes_out_hi32)
+{
+  struct bzfile *bzf = b;
+  size_t n;
+  int rv;
+
+  if (bzf == NULL) {
+    SET_ERR(bzf, BZ_OK);
+    return;
+  }
+  if (!bzf->writing) {
+    SET_ERR(bzf, BZ_SEQUENCE_ERROR);
+    return;
+  }
+  if (ferror(bzf->handle)) {
+    SET_ERR(bzf, BZ_IO_ERROR);
+    return;
+  }
+
+  if (nbytes_in_lo32 != NULL)
+    *nbytes_in_lo32 = 0;
+  if (nbytes_in_hi32 != NULL)
+    *nbytes_in_hi32 = 0;
+  if (nbytes_out_lo32 != NULL)
+    *nbytes_out_lo32 = 0;
+  if (nbytes_out_hi32 != NULL)
+    *nbytes_out_hi32 = 0;
+
+  if (!abandon && bzf->last_err == BZ_OK) {
+    do {
+      bzf->strm.avail_out = BZ_MAX_UNUSED;
+      bzf->strm.next_out = bzf->buf;
+      rv = BZ2_bzCompress(&bzf->strm, BZ_FINISH);
+      if (rv != BZ_FINISH_OK && rv != BZ_STREAM_END) {
+        SET_ERR(bzf, rv);
+        return;
+      }
+
+      n = BZ_MAX_UNUSED - bzf->strm.avail_out;
+      if (n > 0 && (fwrite(bzf->buf, 1, n, bzf->handle) != n ||
+                    ferror(bzf->handle))) {
+        SET_ERR(bzf, BZ_IO_ERROR);
+        return;
+      }
+    }
+    while (rv != BZ_STREAM_END);
+  }
+
+  if (!abandon && !ferror(bzf->handle)) {
+    fflush(bzf->handle);
+    if (ferror(bzf->handle)) {
+      SET_ERR(bzf, BZ_IO_ERROR);
+      return;
+    }
+  }
+
+  if (nbytes_in_lo32 != NULL)
+    *nbytes_in_lo32 = bzf->strm.total_in_lo32;
+  if (nbytes_in_hi32 != NULL)
+    *nbytes_in_hi32 = bzf->strm.total_in_hi32;
+  if (nbytes_out_lo32 != NULL)
+    *nbytes_out_lo32 = bzf->strm.total_out_lo32;
+  if (nbytes_out_hi32 != NULL)
+    *nbytes_out_hi32 = bzf->strm.total_out_hi32;
+
+  SET_ERR(bzf, BZ_OK);
+  BZ2_bzCompressEnd(&bzf->strm);
+  free(bzf);
+}
+
+
+void
+BZ2_bzWriteClose(int *bzerror, BZFILE *b, int abandon,
+                 unsigned int *nbytes_in, unsigned int *nbytes_out)
+{
+  BZ2_bzWriteClose64(bzerror, b, abandon, nbytes_in, NULL, nbytes_out, NULL);
+}
+
+
+BZFILE *
+BZ2_bzReadOpen(int *bzerror, FILE *f, int verbosity, int small,
+               void *unused, int nUnused)
+{
+  struct bzfile *bzf = NULL;
+  int rv;
+
+  SET_ERR(bzf, BZ_OK);
+
+  if (f == NULL || (small != 0 && small != 1) ||
+      verbosity < 0 || verbosity > 4 ||
+      (unused == NULL && nUnused != 0) ||
+      (unused != NULL && (nUnused < 0 || nUnused > BZ_MAX_UNUSED))) {
+    SET_ERR(bzf, BZ_PARAM_ERROR);
+    return NULL;
+  }
+  if (ferror(f)) {
+    SET_ERR(bzf, BZ_IO_ERROR);
+    return NULL;
+  }
+
+  bzf = malloc(sizeof(struct bzfile));
+  if (bzf == NULL) {
+    SET_ERR(bzf, BZ_MEM_ERROR);
+    return NULL;
+  }
+
+  SET_ERR(bzf, BZ_OK);
+  bzf->handle = f;
+  bzf->buf_len = 0;
+  bzf->writing = false;
+  bzf->init_ok = false;
+  bzf->strm.bzalloc = NULL;
+  bzf->strm.bzfree = NULL;
+  bzf->strm.opaque = NULL;
+
+  if (nUnused > 0) {
+    memcpy(bzf->buf, unused, nUnused);
+    bzf->buf_len = nUnused;
+  }
+
+  rv = BZ2_bzDecompressInit(&bzf->strm, verbosity, small);
+  if (rv != BZ_OK) {
+    SET_ERR(bzf, rv);
+    free(bzf);
+    return NULL;
+  }
+
+  bzf->strm.avail_in = bzf->buf_len;
+  bzf->strm.next_in = bzf->buf;
+  bzf->init_ok = true;
+  return bzf;
+}
+
+
+void
+BZ2_bzReadClose(int *bzerror, BZFILE *b)
+{
+  struct bzfile *bzf = b;
+
+  SET_ERR(bzf, BZ_OK);
+  if (bzf == NULL)
+    return;
+  if (bzf->writing) {
+    SET_ERR(bzf, BZ_SEQUENCE_ERROR);
+    return;
+  }
+
+  if (bzf->init_ok)
+    BZ2_bzDecompressEnd(&bzf->strm);
+  free(bzf);
+}
+
+
+int
+BZ2_bzRead(int *bzerror, BZFILE *b, void *buf, int len)
+{
+  struct bzfile *bzf = b;
+  size_t n;
+  int rv;
+
+  SET_ERR(bzf, BZ_OK);
+  if (bzf == NULL || buf == NULL || len < 0) {
+    SET_ERR(bzf, BZ_PARAM_ERROR);
+    return 0;
+  }
+  if (bzf->writing) {
+    SET_ERR(bzf, BZ_SEQUENCE_ERROR);
+    return 0;
+  }
+  if (len == 0)
+    return 0;
+
+  bzf->strm.avail_out = len;
+  bzf->strm.next_out = buf;
+
+  for (;;) {
+    if (ferror(bzf->handle)) {
+      SET_ERR(bzf, BZ_IO_ERROR);
+      return 0;
+    }
+
+    if (bzf->strm.avail_in == 0 && !feof(bzf->handle)) {
+      n = fread(bzf->buf, 1, BZ_MAX_UNUSED, bzf->handle);
+      if (ferror(bzf->handle)) {
+        SET_ERR(bzf, BZ_IO_ERROR);
+        return 0;
+      }
+      bzf->buf_len = n;
+      bzf->strm.avail_in = n;
+      bzf->strm.next_in = bzf->buf;
+    }
+
+    rv = BZ2_bzDecompress(&bzf->strm);
+    if (rv != BZ_OK && rv != BZ_STREAM_END) {
+      SET_ERR(bzf, rv);
+      return 0;
+    }
+
+    if (rv == BZ_OK && feof(bzf->handle) && bzf->strm.avail_in == 0 &&
+        bzf->strm.avail_out > 0) {
+      SET_ERR(bzf, BZ_UNEXPECTED_EOF);
+      return 0;
+    }
+
+    if (rv == BZ_STREAM_END) {
+      SET_ERR(bzf, BZ_STREAM_END);
+      return len - bzf->strm.avail_out;
+    }
+    if (bzf->strm.avail_out == 0)
+      return len;
+  }
+}
+
+
+void
+BZ2_bzReadGetUnused(int *bzerror, BZFILE *b, void **unused, int *nUnused)
+{
+  struct bzfile *bzf = b;
+
+  if (bzf == NULL || unused == NULL || nUnused == NULL) {
+    SET_ERR(bzf, BZ_PARAM_ERROR);
+    return;
+  }
+  if (bzf->last_err != BZ_STREAM_END) {
+    SET_ERR(bzf, BZ_SEQUENCE_ERROR);
+    return;
+  }
+
+  SET_ERR(bzf, BZ_OK);
+  *nUnused = bzf->strm.avail_in;
+  *unused = bzf->strm.next_in;
+}
+
+
+/* Open a file for compression or decompression, as with fopen() or
+   fdopen(), depending on whether path is NULL. */
+static BZFILE *
+bzopen_or_bzdopen(const char *path, int fd, const char *mode)
+{
+  int bzerr;
+  char mode2[3] = "rb";
+  bool writing = false;
+  int bs100k = 9;
+  int small = 0;
+  FILE *fp;
+  BZFILE *bzf;
+
+  if (mode == NULL)
+    return NULL;
+
+  for (; *mode != '\0'; mode++) {
+    if (*mode == 'r')
+      writing = false;
+    else if (*mode == 'w')
+      writing = true;
+    else if (*mode == 's')
+      small = 1;
+    else if (*mode >= '1' && *mode <= '9')
+      bs100k = *mode - '0';
+  }
+  mode2[0] = writing ? 'w' : 'r';
+
+  if (path == NULL) {
+    fp = fdopen(fd, mode2);
+  }
+  else if (*path == '\0') {
+    fp = writing ? stdout : stdin;
+  }
+  else {
+    fp = fopen(path, mode2);
+  }
+  if (fp == NULL)
+    return NULL;
+
+  if (writing)
+    bzf = BZ2_bzWriteOpen(&bzerr, fp, bs100k, 0, 0);
+  else
+    bzf = BZ2_bzReadOpen(&bzerr, fp, 0, small, NULL, 0);
+
+  if (bzf == NULL && fp != stdin && fp != stdout)
+    fclose(fp);
+
+  return bzf;
+}
+
+
+BZFILE *
+BZ2_bzopen(const char *path, const char *mode)
+{
+  return path != NULL ? bzopen_or_bzdopen(path, -1, mode) : NULL;
+}
+
+
+BZFILE *
+BZ2_bzdopen(int fd, const char *mode)
+{
+  return bzopen_or_bzdopen(NULL, fd, mode);
+}
+
+
+int
+BZ2_bzread(BZFILE *b, void *buf, int len)
+{
+  struct bzfile *bzf = b;
+  int bzerr, n;
+
+  if (bzf->last_err == BZ_STREAM_END)
+    return 0;
+
+  n = BZ2_bzRead(&bzerr, b, buf, len);
+  return bzerr == BZ_OK || bzerr == BZ_STREAM_END ? n : -1;
+}
+
+
+int
+BZ2_bzwrite(BZFILE *b, void *buf, int len)
+{
+  int bzerr;
+
+  BZ2_bzWrite(&bzerr, b, buf, len);
+  return bzerr == BZ_OK ? len : -1;
+}
+
+
+int
+BZ2_bzflush(BZFILE *b)
+{
+  (void)b;
+  return 0;
+}
+
+
+void
+BZ2_bzclose(BZFILE *b)
+{
+  struct bzfile *bzf = b;
+  int bzerr;
+  FILE *fp;
+
+  if (bzf == NULL)
+    return;
+
+  fp = bzf->handle;
+  if (bzf->writing) {
+    BZ2_bzWriteClose(&bzerr, b, 0, NULL, NULL);
+    if (bzerr != BZ_OK)
+      BZ2_bzWriteClose(NULL, b, 1, NULL, NULL);
+  }
+  else {
+    BZ2_bzReadClose(&bzerr, b);
+  }
+
+  if (fp != stdin && fp != stdout)
+    fclose(fp);
+}
+
+
+const char *
+BZ2_bzerror(BZFILE *b, int *errnum)
+{
+  static const char *const table[] = {
+    "OK", "SEQUENCE_ERROR", "PARAM_ERROR", "MEM_ERROR", "DATA_ERROR",
+    "DATA_ERROR_MAGIC", "IO_ERROR", "UNEXPECTED_EOF", "OUTBUFF_FULL",
+    "CONFIG_ERROR",
+  };
+  int err = ((struct bzfile *)b)->last_err;
+
+  if (err > 0)
+    err = 0;
+  *errnum = err;
+  return table[-err];
+}
@@ -0,0 +1,135 @@
+/*-
+  bzlib.h -- libbz2 compatible interface
+
+  Copyright (C) 2012, 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Declarations below must stay binary compatible with bzlib.h of bzip2 1.0,
+  as the library built from bzlib.c is meant to replace libbz2.so.1.0 in
+  existing programs.
+*/
+
+#ifndef _BZLIB_H
+#define _BZLIB_H
+
+#include <stdio.h>              /* FILE */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define BZ_RUN               0
+#define BZ_FLUSH             1
+#define BZ_FINISH            2
+
+#define BZ_OK                0
+#define BZ_RUN_OK            1
+#define BZ_FLUSH_OK          2
+#define BZ_FINISH_OK         3
+#define BZ_STREAM_END        4
+#define BZ_SEQUENCE_ERROR    (-1)
+#define BZ_PARAM_ERROR       (-2)
+#define BZ_MEM_ERROR         (-3)
+#define BZ_DATA_ERROR        (-4)
+#define BZ_DATA_ERROR_MAGIC  (-5)
+#define BZ_IO_ERROR          (-6)
+#define BZ_UNEXPECTED_EOF    (-7)
+#define BZ_OUTBUFF_FULL      (-8)
+#define BZ_CONFIG_ERROR      (-9)
+
+#define BZ_MAX_UNUSED        5000
+
+
+typedef struct {
+  char *next_in;
+  unsigned int avail_in;
+  unsigned int total_in_lo32;
+  unsigned int total_in_hi32;
+
+  char *next_out;
+  unsigned int avail_out;
+  unsigned int total_out_lo32;
+  unsigned int total_out_hi32;
+
+  void *state;
+
+  void *(*bzalloc)(void *, int, int);
+  void (*bzfree)(void *, void *);
+  void *opaque;
+} bz_stream;
+
+typedef void BZFILE;
+
+
+#define BZ_API __attribute__((visibility("default")))
+
+/* Low-level stream interface. */
+BZ_API int BZ2_bzCompressInit(bz_stream *strm, int blockSize100k,
+                              int verbosity, int workFactor);
+BZ_API int BZ2_bzCompress(bz_stream *strm, int action);
+BZ_API int BZ2_bzCompressEnd(bz_stream *strm);
+BZ_API int BZ2_bzDecompressInit(bz_stream *strm, int verbosity, int small);
+BZ_API int BZ2_bzDecompress(bz_stream *strm);
+BZ_API int BZ2_bzDecompressEnd(bz_stream *strm);
+
+/* High-level stdio interface. */
+BZ_API BZFILE *BZ2_bzReadOpen(int *bzerror, FILE *f, int verbosity,
+                              int small, void *unused, int nUnused);
+BZ_API void BZ2_bzReadClose(int *bzerror, BZFILE *b);
+BZ_API void BZ2_bzReadGetUnused(int *bzerror, BZFILE *b, void **unused,
+                                int *nUnused);
+BZ_API int BZ2_bzRead(int *bzerror, BZFILE *b, void *buf, int len);
+BZ_API BZFILE *BZ2_bzWriteOpen(int *bzerror, FILE *f, int blockSize100k,
+                               int verbosity, int workFactor);
+BZ_API void BZ2_bzWrite(int *bzerror, BZFILE *b, void *buf, int len);
+BZ_API void BZ2_bzWriteClose(int *bzerror, BZFILE *b, int abandon,
+                             unsigned int *nbytes_in,
+                             unsigned int *nbytes_out);
+BZ_API void BZ2_bzWriteClose64(int *bzerror, BZFILE *b, int abandon,
+                               unsigned int *nbytes_in_lo32,
+                               unsigned int *nbytes_in_hi32,
+                               unsigned int *nbytes_out_lo32,
+                               unsigned int *nbytes_out_hi32);
+
+/* Utility functions. */
+BZ_API int BZ2_bzBuffToBuffCompress(char *dest, unsigned int *destLen,
+                                    char *source, unsigned int sourceLen,
+                                    int blockSize100k, int verbosity,
+                                    int workFactor);
+BZ_API int BZ2_bzBuffToBuffDecompress(char *dest, unsigned int *destLen,
+                                      char *source, unsigned int sourceLen,
+                                      int small, int verbosity);
+
+/* zlib-like interface. */
+BZ_API const char *BZ2_bzlibVersion(void);
+BZ_API BZFILE *BZ2_bzopen(const char *path, const char *mode);
+BZ_API BZFILE *BZ2_bzdopen(int fd, const char *mode);
+BZ_API int BZ2_bzread(BZFILE *b, void *buf, int len);
+BZ_API int BZ2_bzwrite(BZFILE *b, void *buf, int len);
+BZ_API int BZ2_bzflush(BZFILE *b);
+BZ_API void BZ2_bzclose(BZFILE *b);
+BZ_API const char *BZ2_bzerror(BZFILE *b, int *errnum);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BZLIB_H */
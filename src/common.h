@@ -118,3 +118,27 @@ void __gcov_flush(void);
 #else
 #define gcov_flush()
 #endif
+
+
+#ifdef LBZIP2_LIBRARY
+#include "prefix.h"
+
+/*
+  In the library all memory allocated by the engine is tracked, so that blocks
+  still held by the engine when a call fails can be released.  Allocation
+  functions are redirected to library.c, which uses the real ones.
+*/
+#include "xalloc.h"
+
+void *track_malloc(size_t size);
+void *track_xnrealloc(void *ptr, size_t n, size_t size);
+void *track_x2nrealloc(void *ptr, size_t *pn, size_t size);
+void track_free(void *ptr);
+
+#define malloc(n)            track_malloc(n)
+#define free(p)              track_free(p)
+#define xmalloc(n)           track_xnrealloc(NULL, 1u, n)
+#define xnmalloc(n, s)       track_xnrealloc(NULL, n, s)
+#define xnrealloc(p, n, s)   track_xnrealloc(p, n, s)
+#define x2nrealloc(p, pn, s) track_x2nrealloc(p, pn, s)
+#endif
@@ -22,13 +22,21 @@
 
 #include "common.h"
 
-#include "main.h"               /* bs100k */
+#include "main.h"               /* bs100k, bwt_engine, print_cctrs */
 #include "encode.h"             /* encode() */
 #include "process.h"            /* struct process */
+#include "index.h"              /* index_add() */
 
 /* transmit threshold */
 #define TRANSM_THRESH 2
 
+/* maximal input block size, in multiples of the maximal work block size */
+#define MAX_GRANUL_FACTOR 8
+
+/* number and size of samples initial RLE ratio is estimated from */
+#define GRANUL_SAMPLES 16u
+#define GRANUL_SAMPLE_SIZE 4096u
+
 
 struct in_blk {
   struct position pos;
@@ -38,6 +46,19 @@ struct in_blk {
 
   const char unsigned *next;
   size_t left;
+
+  unsigned refs;                /* number of segments referencing buffer,
+                                   plus one while in coll_q or scanned */
+  unsigned slots;               /* number of input slots buffer takes */
+  bool flush;                   /* end work block with this input block */
+};
+
+
+/* Part of input block which makes up a work block in ultra mode. */
+struct segment {
+  struct in_blk *iblk;
+  const char unsigned *next;
+  size_t size;
 };
 
 
@@ -50,17 +71,28 @@ struct work_blk {
   size_t size;
   uint32_t crc;
   size_t weight;
+  bool sort_fallback;
+
+  struct segment *seg;          /* input segments not collected yet */
+  unsigned num_seg;
 };
 
 
 static struct pqueue(struct in_blk *) coll_q;
+static struct pqueue(struct work_blk *) fill_q;
 static struct pqueue(struct work_blk *) trans_q;
 static struct pqueue(struct work_blk *) reord_q;
 static struct position order;
 static uintmax_t next_id;       /* next free input block sequence number */
 static uint32_t combined_crc;
-static bool collect_token = true;
+static uintmax_t num_blocks;    /* number of blocks compressed */
+static uintmax_t num_fallbacks; /* number of blocks divbwt() gave up on */
+static bool collect_token;
 static struct work_blk *unfinished_work;
+static struct scan_state scanner;
+static size_t base_granul;      /* input block size giving one work block */
+static uintmax_t in_offs;       /* uncompressed bytes reordered so far */
+static uintmax_t out_offs;      /* compressed bytes reordered so far */
 
 
 static bool
@@ -87,7 +119,7 @@ do_collect(void)
 
   /* Allocate an encoder with given block size and default parameters. */
   wblk->enc = xmalloc(encoder_alloc_size(bs100k * 100000u));
-  encoder_init(wblk->enc, bs100k * 100000u, CLUSTER_FACTOR);
+  encoder_init(wblk->enc, bs100k * 100000u, CLUSTER_FACTOR, bwt_engine);
 
   /* Collect as much data as we can. */
   wblk->weight = iblk->left;
@@ -105,20 +137,36 @@ do_collect(void)
   else {
     ++wblk->next.major;
     wblk->next.minor = 0;
-    source_release_buffer(iblk->buffer);
+    source_release_slots(iblk->buffer, iblk->slots);
     free(iblk);
   }
 
   /* Do the hard work. */
-  wblk->size = encode(wblk->enc, &wblk->crc);
+  wblk->size = encode(wblk->enc, &wblk->crc, &wblk->sort_fallback);
+  if (wblk->size == 0)
+    xalloc_die();
 
   sched_lock();
   enqueue(trans_q, wblk);
 }
 
 
+/*
+  In ultra mode block boundaries depend on how much input previous blocks
+  consumed, so they must be found sequentially.  Instead of collecting blocks
+  one by one, the scan task only finds where each block ends, which is much
+  faster, and records input segments making up the block.  The segments are
+  then collected by collect_seq tasks, running in parallel, which produce
+  exactly the same blocks as sequential collecting would.
+
+  Buffers of input blocks are shared between consecutive work blocks, hence
+  reference counting.  Segments hold input slots until they are collected,
+  so if a single work block spans too many input blocks the scan task
+  collects them itself and continues collecting that work block directly,
+  as the reader would otherwise run out of input slots.
+*/
 static bool
-can_collect_seq(void)
+can_scan(void)
 {
   return ultra && collect_token &&
     (!empty(coll_q) || (eof && unfinished_work != NULL)) &&
@@ -127,11 +175,45 @@ can_collect_seq(void)
 
 
 static void
-do_collect_seq(void)
+collect_segments(struct work_blk *wblk)
+{
+  unsigned i;
+  size_t left;
+  struct in_blk *iblk;
+
+  if (wblk->enc == NULL) {
+    wblk->enc = xmalloc(encoder_alloc_size(bs100k * 100000u));
+    encoder_init(wblk->enc, bs100k * 100000u, CLUSTER_FACTOR, bwt_engine);
+  }
+
+  for (i = 0; i < wblk->num_seg; i++) {
+    left = wblk->seg[i].size;
+    collect(wblk->enc, wblk->seg[i].next, &left);
+    assert(left == 0u);
+  }
+
+  sched_lock();
+  for (i = 0; i < wblk->num_seg; i++) {
+    iblk = wblk->seg[i].iblk;
+    if (--iblk->refs == 0u) {
+      source_release_slots(iblk->buffer, iblk->slots);
+      free(iblk);
+    }
+  }
+  sched_unlock();
+
+  wblk->num_seg = 0;
+}
+
+
+static void
+do_scan(void)
 {
   struct in_blk *iblk;
   struct work_blk *wblk;
+  struct segment *seg;
   bool done = true;
+  size_t size;
 
   wblk = unfinished_work;
   unfinished_work = NULL;
@@ -145,40 +227,60 @@ do_collect_seq(void)
   collect_token = false;
   sched_unlock();
 
-  /* Allocate an encoder with given block size and default parameters. */
   if (wblk == NULL) {
     wblk = XMALLOC(struct work_blk);
     wblk->pos = iblk->pos;
     wblk->next = iblk->pos;
-    wblk->enc = xmalloc(encoder_alloc_size(bs100k * 100000u));
-    encoder_init(wblk->enc, bs100k * 100000u, CLUSTER_FACTOR);
+    wblk->enc = NULL;
     wblk->weight = 0;
+    wblk->seg = XNMALLOC(total_in_slots, struct segment);
+    wblk->num_seg = 0;
+    scan_init(&scanner, bs100k * 100000u);
   }
 
-  /* Collect as much data as we can. */
+  /* Find out how much of the input block belongs to this work block. */
+  seg = NULL;
   if (iblk != NULL) {
-    wblk->size = iblk->left;
-    done = collect(wblk->enc, iblk->next, &iblk->left);
-    wblk->size -= iblk->left;
-    wblk->weight += wblk->size;
-    iblk->next += wblk->size;
+    size = iblk->left;
+    if (wblk->enc == NULL) {
+      done = scan_block(&scanner, iblk->next, &iblk->left);
+      seg = &wblk->seg[wblk->num_seg++];
+      seg->iblk = iblk;
+      seg->next = iblk->next;
+      seg->size = size - iblk->left;
+    }
+    else {
+      done = collect(wblk->enc, iblk->next, &iblk->left);
+    }
+    size -= iblk->left;
+    wblk->weight += size;
+    iblk->next += size;
+    if (0u == iblk->left && iblk->flush)
+      done = true;
 
+    sched_lock();
+    if (seg != NULL)
+      ++iblk->refs;
     if (0u < iblk->left) {
       ++wblk->next.minor;
       ++iblk->pos.minor;
-      sched_lock();
       enqueue(coll_q, iblk);
-      sched_unlock();
     }
     else {
       ++wblk->next.major;
       wblk->next.minor = 0;
-      source_release_buffer(iblk->buffer);
-      free(iblk);
+      if (--iblk->refs == 0u) {
+        source_release_slots(iblk->buffer, iblk->slots);
+        free(iblk);
+      }
     }
+    sched_unlock();
   }
 
   if (!done) {
+    if (wblk->num_seg + 1u >= total_in_slots)
+      collect_segments(wblk);
+
     sched_lock();
     collect_token = true;
     unfinished_work = wblk;
@@ -187,10 +289,32 @@ do_collect_seq(void)
 
   sched_lock();
   collect_token = true;
+  enqueue(fill_q, wblk);
+}
+
+
+static bool
+can_collect_seq(void)
+{
+  return !empty(fill_q);
+}
+
+
+static void
+do_collect_seq(void)
+{
+  struct work_blk *wblk;
+
+  wblk = dequeue(fill_q);
   sched_unlock();
 
+  collect_segments(wblk);
+  free(wblk->seg);
+
   /* Do the hard work. */
-  wblk->size = encode(wblk->enc, &wblk->crc);
+  wblk->size = encode(wblk->enc, &wblk->crc, &wblk->sort_fallback);
+  if (wblk->size == 0)
+    xalloc_die();
 
   sched_lock();
   enqueue(trans_q, wblk);
@@ -242,8 +366,17 @@ do_reorder(void)
   wblk = dequeue(reord_q);
   order = wblk->next;
 
+  /* Blocks are byte-aligned, so their offsets are easy to track.  Block
+     headers store CRCs inverted and so does the index. */
+  if (make_index)
+    index_add(8u * (HEADER_SIZE + out_offs), in_offs, ~wblk->crc, bs100k);
+  in_offs += wblk->weight;
+  out_offs += wblk->size;
+
   sink_write_buffer(wblk->buffer, wblk->size, wblk->weight);
   combined_crc = combine_crc(combined_crc, wblk->crc);
+  num_blocks++;
+  num_fallbacks += wblk->sort_fallback;
 
   free(wblk);
 }
@@ -257,17 +390,79 @@ can_terminate(void)
 }
 
 
+/*
+  Outside of ultra mode each input block is collected into its own work
+  blocks.  Initial RLE can shrink input several times, and then work blocks
+  are much smaller than they could be, which hurts both compression ratio and
+  speed.  Therefore size of the next input block is chosen so that, if it
+  compresses with initial RLE as well as the last one did, it fills a single
+  work block.  Some margin is left, as exceeding the block size even by a bit
+  would produce an additional tiny block.  Input block sizes depend only on
+  input data, so output is still deterministic.
+
+  The RLE ratio is estimated from a few samples of the block, so that the
+  reader thread, which calls this, is not slowed down.  A larger input block
+  takes as many input slots as the blocks it replaces, so memory used for
+  input doesn't grow, except that with fewer slots than MAX_GRANUL_FACTOR it
+  takes all of them.
+*/
+static void
+adapt_granularity(const uint8_t *buffer, size_t size)
+{
+  struct scan_state s;
+  uint64_t rle_size, sampled, granul;
+  size_t step, len, left;
+  unsigned i, n;
+
+  /* Small blocks are scanned whole. */
+  n = GRANUL_SAMPLES;
+  len = GRANUL_SAMPLE_SIZE;
+  if (size <= (size_t)n * len) {
+    n = 1u;
+    len = size;
+  }
+  step = (n > 1u ? (size - len) / (n - 1u) : 0u);
+
+  rle_size = 0;
+  sampled = 0;
+  for (i = 0u; i < n; i++) {
+    left = len;
+    while (left > 0u) {
+      scan_init(&s, base_granul);
+      scan_block(&s, buffer + i * step + (len - left), &left);
+      rle_size += s.nblock + (s.run >= 4u);
+    }
+    sampled += len;
+  }
+
+  granul = (uint64_t)base_granul * sampled / rle_size / 16u * 15u;
+  in_granul = min(max(granul, base_granul),
+                  (uint64_t)MAX_GRANUL_FACTOR * base_granul);
+  in_weight = min((in_granul + base_granul - 1u) / base_granul,
+                  total_in_slots);
+}
+
+
 static void
 on_input_avail(void *buffer, size_t size)
 {
   struct in_blk *iblk = XMALLOC(struct in_blk);
 
+  /* The reader returns short blocks only at end of input or when it was
+     told to flush. */
+  iblk->flush = (size < in_granul);
+  iblk->slots = in_weight;
+
+  if (!ultra)
+    adapt_granularity(buffer, size);
+
   iblk->pos.major = next_id++;
   iblk->pos.minor = 0u;
   iblk->buffer = buffer;
   iblk->size = size;
   iblk->next = buffer;
   iblk->left = size;
+  iblk->refs = 1;
 
   sched_lock();
   enqueue(coll_q, iblk);
@@ -324,15 +519,24 @@ static void
 init(void)
 {
   pqueue_init(coll_q, in_slots);
+  pqueue_init(fill_q, work_units);
   pqueue_init(trans_q, work_units);
   pqueue_init(reord_q, out_slots);
 
   next_id = 0;
   order.major = 0;
   order.minor = 0;
+  collect_token = true;
+  unfinished_work = NULL;
 
   assert(1 <= bs100k && bs100k <= 9);
+  base_granul = in_granul;
   combined_crc = 0;
+  num_blocks = 0;
+  num_fallbacks = 0;
+  in_offs = 0;
+  out_offs = 0;
+  index_reset();
 
   write_header();
 }
@@ -343,16 +547,22 @@ uninit(void)
 {
   write_trailer();
 
+  if (print_cctrs)
+    info("%ju of %ju block(s) sorted with fallback algorithm", num_fallbacks,
+         num_blocks);
+
   pqueue_uninit(coll_q);
+  pqueue_uninit(fill_q);
   pqueue_uninit(trans_q);
   pqueue_uninit(reord_q);
 }
 
 
 static const struct task task_list[] = {
-  { "collect_seq", can_collect_seq, do_collect_seq },
+  { "scan",        can_scan,        do_scan        },
   { "reorder",     can_reorder,     do_reorder     },
   { "transmit",    can_transmit,    do_transmit    },
+  { "collect_seq", can_collect_seq, do_collect_seq },
   { "collect",     can_collect,     do_collect     },
   { NULL,          NULL,            NULL           },
 };
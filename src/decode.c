@@ -22,6 +22,11 @@
 #include "common.h"
 #include <arpa/inet.h>          /* ntohl() */
 #include <string.h>             /* memcpy() */
+#ifdef __SSE2__
+#include <emmintrin.h>          /* _mm_slli_si128() */
+#endif
+
+#include "xalloc.h"             /* xmalloc() */
 
 #include "decode.h"
 
@@ -38,11 +43,14 @@
    to make longer tables.
 
    This result of this trade are in the constant HUFF_START_WIDTH below.
-   HUFF_START_WIDTH is the number of bits the first level table can decode
-   in one step.  Subsequent tables always decode one bit at time. The current
-   value of HUFF_START_WIDTH was determined with a series of benchmarks.
-   The optimum value may differ though from machine to machine, and possibly
-   even between compilers.  Your mileage may vary.
+   HUFF_START_WIDTH is the largest number of bits the first level table can
+   decode in one step.  Trees whose codes are all shorter get a table just
+   wide enough for the longest code, so that small tables don't take more
+   cache than necessary.  Subsequent tables always decode one bit at time.
+   The current value of HUFF_START_WIDTH was determined with a series of
+   benchmarks; 11 and 12 bits were not found to be faster.  The optimum
+   value may differ though from machine to machine, and possibly even
+   between compilers.  Your mileage may vary.
 */
 #define HUFF_START_WIDTH 10
 
@@ -81,15 +89,16 @@
 /* Structure used for quick decoding of prefix codes. */
 struct tree {
   uint16_t start[1 << HUFF_START_WIDTH];
+  unsigned width;                       /* width of start[] in bits */
   uint64_t base[MAX_CODE_LENGTH + 2];   /* 2 sentinels (first and last pos) */
   unsigned count[MAX_CODE_LENGTH + 1];  /* 1 sentinel (first pos) */
   uint16_t perm[MAX_ALPHA_SIZE];
 };
-/* start[] - decoding start point.  `k = start[c] & 0x1F' is code
-   length.  If k <= HUFF_START_WIDTH then `s = start[c] >> 5' is the
-   immediate symbol value.  If k > HUFF_START_WIDTH then s is
-   undefined, but code starting with c is guaranteed to be at least k
-   bits long.
+/* start[] - decoding start point, indexed by the first `width' bits
+   of input.  `k = start[c] & 0x1F' is code length.  If k <= width then
+   `s = start[c] >> 5' is the immediate symbol value.  If k > width then
+   s is undefined, but code starting with c is guaranteed to be at least
+   k bits long.
 
    base[] - base codes.  For k in 1..20, base[k] is either the first
    code of length k or it is equal to base[k+1] if there are no codes
@@ -107,11 +116,6 @@ struct tree {
 */
 
 
-#define ROW_WIDTH 16u
-#define SLIDE_LENGTH 8192u
-#define NUM_ROWS (256u / ROW_WIDTH)
-#define CMAP_BASE (SLIDE_LENGTH - 256)
-
 struct retriever_internal_state {
   unsigned state;               /* current state of retriever FSA */
   uint8_t selector[MAX_SELECTORS];  /* coding tree selectors */
@@ -128,8 +132,8 @@ struct retriever_internal_state {
   unsigned t;                   /* current tree number */
   unsigned g;                   /* current group number */
 
-  uint8_t *imtf_row[NUM_ROWS];
-  uint8_t imtf_slide[SLIDE_LENGTH];
+  uint8_t imtf[256];             /* inverse MTF list */
+  uint32_t ftab[4][256];        /* partial frequency tables */
   unsigned runChar;
   unsigned run;
   unsigned shift;
@@ -176,15 +180,14 @@ enum {
    code longer than 10 bits is quite small (usually < 0.2).
 
    lbzip2 utilises this fact by implementing a hybrid algorithm for
-   prefix decoding.  For codes of length <= 10 lbzip2 maintains a LUT
+   prefix decoding.  For codes of length <= W lbzip2 maintains a LUT
    (look-up table) that maps codes directly to corresponding symbol
-   values.  Codes longer than 10 bits are not mapped by the LUT are
+   values.  Codes longer than W bits are not mapped by the LUT are
    decoded using cannonical prefix decoding algorithm.
 
-   The above value of 10 bits was determined using a series of
-   benchmarks.  It's not hardcoded but instead it is defined as a
-   constant HUFF_START_WIDTH (see the comment above).  If on some
-   system a different value works better, it can be adjusted freely.
+   W is the length of the longest code, but no more than HUFF_START_WIDTH.
+   If on some system a different limit works better, it can be adjusted
+   freely.
 */
 static void
 make_tree(struct retriever_internal_state *rs)
@@ -195,6 +198,7 @@ make_tree(struct retriever_internal_state *rs)
   uint64_t *B;                  /* left-justified base */
   uint16_t *P;                  /* symbols sorted by code length */
   uint16_t *S;                  /* lookup table */
+  unsigned W;                   /* lookup table width */
 
   unsigned k;                   /* current code length */
   unsigned s;                   /* current symbol */
@@ -233,6 +237,14 @@ make_tree(struct retriever_internal_state *rs)
     return;
   }
 
+  /* Choose lookup table width: the longest code length, but no more than
+     HUFF_START_WIDTH. */
+  W = MAX_CODE_LENGTH;
+  while (W > MIN_CODE_LENGTH && C[W] == 0)
+    W--;
+  W = min(W, HUFF_START_WIDTH);
+  rs->tree[rs->t].width = W;
+
   /* Create left-justified base table. */
   sofar = 0;
   for (k = MIN_CODE_LENGTH; k <= MAX_CODE_LENGTH; k++) {
@@ -274,8 +286,8 @@ make_tree(struct retriever_internal_state *rs)
 
   /* Create first, complete start entries. */
   code = 0;
-  inc = 1 << (HUFF_START_WIDTH - 1);
-  for (k = 1; k <= HUFF_START_WIDTH; k++) {
+  inc = 1u << (W - 1);
+  for (k = 1; k <= W; k++) {
     for (s = C[k - 1]; s < C[k]; s++) {
       uint16_t x = (P[s] << 5) | k;
       v = code;
@@ -287,14 +299,14 @@ make_tree(struct retriever_internal_state *rs)
   }
 
   /* Fill remaining, incomplete start entries. */
-  assert(k == HUFF_START_WIDTH + 1);
-  sofar = (uint64_t)code << (64 - HUFF_START_WIDTH);
-  while (code < (1 << HUFF_START_WIDTH)) {
+  assert(k == W + 1);
+  sofar = (uint64_t)code << (64 - W);
+  while (code < (1u << W)) {
     while (sofar >= B[k + 1])
       k++;
     S[code] = k;
     code++;
-    sofar += (uint64_t)1 << (64 - HUFF_START_WIDTH);
+    sofar += (uint64_t)1 << (64 - W);
   }
   assert(sofar == 0);
 
@@ -310,6 +322,85 @@ make_tree(struct retriever_internal_state *rs)
 }
 
 
+/* Blocks compressed by the same encoder from similar data often come
+   with identical code lengths, which yield identical decoding tables.
+   Recently built tables are kept in a small cache, indexed by hash of
+   code lengths.  The cache is not shared -- a caller of retrieve() can
+   attach one to the decoder state (see expand.c), in which case trees
+   found in the cache are copied from it instead of being built. */
+#define TREE_CACHE_SIZE 8
+
+struct cached_tree {
+  uint32_t hash;                /* hash of code lengths */
+  unsigned alpha_size;          /* alphabet size, or 0 if unused */
+  uint8_t code_len[MAX_ALPHA_SIZE];
+  struct tree tree;
+};
+
+struct tree_cache {
+  unsigned next;                /* entry to be replaced next */
+  struct cached_tree entry[TREE_CACHE_SIZE];
+};
+
+
+/* Copy the part of decoding tables used by retrieve(). */
+static void
+copy_tree(struct tree *dst, const struct tree *src, unsigned n)
+{
+  dst->width = src->width;
+  memcpy(dst->start, src->start, sizeof(src->start[0]) << src->width);
+  memcpy(dst->base, src->base, sizeof(src->base));
+  memcpy(dst->count, src->count, sizeof(src->count));
+  memcpy(dst->perm, src->perm, n * sizeof(src->perm[0]));
+}
+
+
+/* Build decoding tables of current tree, or fetch them from cache. */
+static void
+get_tree(struct decoder_state *ds, struct retriever_internal_state *rs)
+{
+  struct tree_cache *tc = ds->tree_cache;
+  struct cached_tree *ct;
+  unsigned n = rs->alpha_size;
+  uint32_t h;
+  unsigned i;
+
+  ds->num_trees++;
+  if (tc == NULL) {
+    make_tree(rs);
+    return;
+  }
+
+  /* FNV-1a hash of code lengths. */
+  h = 2166136261u;
+  for (i = 0; i < n; i++)
+    h = (h ^ rs->code_len[i]) * 16777619u;
+
+  for (i = 0; i < TREE_CACHE_SIZE; i++) {
+    ct = &tc->entry[i];
+    if (ct->hash == h && ct->alpha_size == n &&
+        memcmp(ct->code_len, rs->code_len, n) == 0) {
+      copy_tree(&rs->tree[rs->t], &ct->tree, n);
+      rs->mtf[rs->t] = rs->t;
+      ds->cached_trees++;
+      return;
+    }
+  }
+
+  make_tree(rs);
+
+  /* Cache only valid trees. */
+  if (rs->mtf[rs->t] == rs->t) {
+    ct = &tc->entry[tc->next];
+    tc->next = (tc->next + 1) % TREE_CACHE_SIZE;
+    ct->hash = h;
+    ct->alpha_size = n;
+    memcpy(ct->code_len, rs->code_len, n);
+    copy_tree(&ct->tree, &rs->tree[rs->t], n);
+  }
+}
+
+
 /* The following is a lookup table for determining the position
    of the first zero bit (starting at the most significant bit)
    in a 6-bit integer.
@@ -405,14 +496,48 @@ static const uint8_t R[64] = {
     }                                                           \
   }
 
-/* Same as NEED(), but assumes that there is at least one 32-bit word
-   of input available.  */
-#define NEED_FAST()                                             \
+/* Load 64 bits of input starting at byte pointer p, which need not be
+   aligned.  */
+static uint64_t
+load64(const uint8_t *p)
+{
+  uint32_t hi, lo;
+
+  memcpy(&hi, p, 4);
+  memcpy(&lo, p + 4, 4);
+  return ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+}
+
+/* Bit reader used when decoding whole groups, where input is known to
+   last.  Input is read from byte pointer p instead of next.  Refilling
+   is done without branches: bit buffer v is topped up with a single
+   64-bit load and then holds from 56 to 63 bits, as only whole bytes
+   are counted.  Bits of v past the w live ones are then either zero or
+   equal to the following input bits, so ORing the next load over them is
+   harmless.  The least significant bit is always cleared, so that v is
+   never UINT64_MAX (see NEED).  */
+#define REFILL_FAST()                                           \
+  (v |= (load64(p) >> w) & ~(uint64_t)1,                        \
+   p += (63u - w) >> 3,                                         \
+   w |= 56u, (void)0)
+
+/* Go back from the byte-oriented bit reader to word pointer next.  If p
+   is not word-aligned, either the bytes of the last partial word are
+   given back, or the rest of that word is taken.  Bits past the live
+   ones are cleared, as other readers expect.  */
+#define LEAVE_FAST()                                            \
   {                                                             \
-    if (w < 32u) {                                              \
-      v |= (uint64_t)ntohl (*next) << (64u - (w += 32u));       \
+    unsigned r = (p - (const uint8_t *)next) % 4u;              \
+                                                                \
+    next += (p - (const uint8_t *)next) / 4u;                   \
+    if (8u * r <= w)                                            \
+      w -= 8u * r;                                              \
+    else {                                                      \
+      v |= (load64(p) >> w) & ~(uint64_t)1;                     \
+      w += 32u - 8u * r;                                        \
       next++;                                                   \
     }                                                           \
+    v &= ~(UINT64_MAX >> w);                                    \
   }
 
 /* Return k most significant bits of bit buffer v.  */
@@ -425,94 +550,135 @@ static const uint8_t R[64] = {
 #define TAKE(x,k) ((x) = PEEK(k), DUMP(k))
 
 
-/* Implementation of Sliding Lists algorithm for doing Inverse
-   Move-To-Front (IMTF) transformation in O(n) space and amortized
-   O(sqrt(n)) time.  The naive IMTF algorithm does the same in both
-   O(n) space and time.
-
-   IMTF could be done in O(log(n)) time using algorithms based on
-   (quite) complex data structures such as self-balancing binary
-   search trees, but these algorithms have quite big constant factor
-   which makes them impractical for MTF of 256 items.
+/* Inverse Move-To-Front (IMTF) transformation.  The list of 256 bytes
+   is kept in a flat array.  Fetching the byte at index n and moving it
+   to the front shifts the first n bytes of the list up by one position,
+   which is done 16 bytes at a time with SSE2, or 8 bytes at a time
+   otherwise.  Text usually has small indices, so a single vector is
+   touched most of the time, but even the largest indices cost only 16
+   vector operations.  The list is never rebuilt.
 */
+#ifdef __SSE2__
+
 static uint8_t
-mtf_one(uint8_t **imtf_row, uint8_t *imtf_slide, uint8_t c)
+mtf_one(uint8_t *imtf, unsigned n)
 {
-  uint8_t *pp;
-
-  /* We expect the index to be small, so we have a special case for that. */
-  if (likely(c < ROW_WIDTH)) {
-    unsigned nn = c;
-
-    pp = imtf_row[0];
-    c = pp[nn];
-
-    /* Forgive me the ugliness of this code, but mtf_one() is executed
-       frequently and needs to be fast.  An equivalent (simpler and slower)
-       version is given in #else clause.
-     */
-#if ROW_WIDTH == 16
-    switch (nn) {
-    default:
-      abort();
-#define R(n) case n: pp[n] = pp[n-1]
-      R(15); R(14); R(13); R(12); R(11); R(10); R(9);
-      R(8); R(7); R(6); R(5); R(4); R(3); R(2); R(1);
-#undef R
-    }
-#else
-    while (nn > 0) {
-      pp[nn] = pp[nn - 1];
-      nn--;
-    }
-#endif
+  __m128i *q = (__m128i *)imtf;
+  unsigned k = n / 16u;
+  unsigned c = imtf[n];
+  __m128i x, y, p, keep;
+
+  /* Bytes past index n in the vector containing it are left intact. */
+  keep = _mm_cmpgt_epi8(_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+                                      10, 11, 12, 13, 14, 15),
+                        _mm_set1_epi8(n % 16u));
+  x = _mm_loadu_si128(q + k);
+
+  while (k > 0) {
+    p = _mm_loadu_si128(q + k - 1);
+    y = _mm_or_si128(_mm_slli_si128(x, 1), _mm_srli_si128(p, 15));
+    _mm_storeu_si128(q + k, _mm_or_si128(_mm_and_si128(keep, x),
+                                         _mm_andnot_si128(keep, y)));
+    keep = _mm_setzero_si128();
+    x = p;
+    k--;
   }
-  else {  /* A general case for indices >= ROW_WIDTH. */
-
-    /* If the sliding list already reached the bottom of memory pool
-       allocated for it, we need to rebuild it. */
-    if (unlikely(imtf_row[0] == imtf_slide)) {
-      uint8_t *kk = imtf_slide + SLIDE_LENGTH;
-      uint8_t **rr = imtf_row + NUM_ROWS;
 
-      while (rr > imtf_row) {
-        uint8_t *bg = *--rr;
-        uint8_t *bb = bg + ROW_WIDTH;
-
-        assert(bg >= imtf_slide && bb <= imtf_slide + SLIDE_LENGTH);
+  y = _mm_or_si128(_mm_slli_si128(x, 1), _mm_cvtsi32_si128(c));
+  _mm_storeu_si128(q, _mm_or_si128(_mm_and_si128(keep, x),
+                                   _mm_andnot_si128(keep, y)));
+  return c;
+}
 
-        while (bb > bg)
-          *--kk = *--bb;
-        *rr = kk;
-      }
-    }
+#else /* !__SSE2__ */
 
-    {
-      uint8_t **lno = imtf_row + c / ROW_WIDTH;
-      uint8_t *bb = *lno;
+/* Load 8 list bytes as a word, so that the first byte is the least
+   significant one. */
+static uint64_t
+imtf_load(const uint8_t *p)
+{
+  uint64_t x;
 
-      pp = bb + c % ROW_WIDTH;
-      c = *pp;
+#if !defined(WORDS_BIGENDIAN)
+  memcpy(&x, p, 8);
+#elif GNUC_VERSION >= 40300
+  memcpy(&x, p, 8);
+  x = __builtin_bswap64(x);
+#else
+  unsigned k;
 
-      while (pp > bb) {
-        uint8_t *tt = pp--;
+  for (x = 0, k = 8; k-- > 0;)
+    x = (x << 8) | p[k];
+#endif
+  return x;
+}
 
-        *tt = *pp;
-      }
+static void
+imtf_store(uint8_t *p, uint64_t x)
+{
+#if !defined(WORDS_BIGENDIAN)
+  memcpy(p, &x, 8);
+#elif GNUC_VERSION >= 40300
+  x = __builtin_bswap64(x);
+  memcpy(p, &x, 8);
+#else
+  unsigned k;
 
-      while (lno > imtf_row) {
-        uint8_t **lno1 = lno;
+  for (k = 0; k < 8; k++, x >>= 8)
+    p[k] = x & 0xFF;
+#endif
+}
 
-        pp = --(*--lno);
-        **lno1 = pp[ROW_WIDTH];
-      }
-    }
+static uint8_t
+mtf_one(uint8_t *imtf, unsigned n)
+{
+  unsigned k = n / 8u;
+  unsigned c = imtf[n];
+  uint64_t x, p, keep;
+
+  keep = (UINT64_MAX << 8 * (n % 8u)) << 8;
+  x = imtf_load(imtf + 8 * k);
+
+  while (k > 0) {
+    p = imtf_load(imtf + 8 * (k - 1));
+    imtf_store(imtf + 8 * k, (x & keep) | (((x << 8) | (p >> 56)) & ~keep));
+    keep = 0;
+    x = p;
+    k--;
   }
 
-  *pp = c;
+  imtf_store(imtf, (x & keep) | (((x << 8) | c) & ~keep));
   return c;
 }
 
+#endif /* !__SSE2__ */
+
+
+/* Number of tt[] entries past MAX_BLOCK_SIZE which may be clobbered by
+   put_run().  It is a multiple of 2 to keep internal state aligned. */
+#define TT_SLACK 4u
+
+/* Store a run of n copies of c at tt, 4 entries at a time (which
+   compilers turn into a single vector store), and return pointer past
+   the run.  Most runs are short and take a single iteration.  Up to 3
+   entries past the run are clobbered, which is harmless as they are
+   either past the block end or overwritten by the following runs. */
+static uint32_t *
+put_run(uint32_t *tt, uint32_t c, unsigned n)
+{
+  uint32_t *end = tt + n;
+
+  do {
+    tt[0] = c;
+    tt[1] = c;
+    tt[2] = c;
+    tt[3] = c;
+    tt += 4;
+  } while (tt < end);
+
+  return end;
+}
+
 
 int
 retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
@@ -540,7 +706,7 @@ retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
         NEED(S_BITMAP_SMALL);
       }
       do {
-        rs->imtf_slide[CMAP_BASE + rs->alpha_size] = rs->j++;
+        rs->imtf[rs->alpha_size] = rs->j++;
         rs->alpha_size += rs->small >> 15;
         rs->small <<= 1;
       }
@@ -595,23 +761,21 @@ retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
         NEED(S_DELTA_TAG);
       }
 
-      make_tree(rs);
+      get_tree(ds, rs);
     }
 
-    /* Initialize IMTF decoding structure. */
-    {
-      unsigned i;
-
-      for (i = 0; i < NUM_ROWS; i++)
-        rs->imtf_row[i] = rs->imtf_slide + CMAP_BASE + i * ROW_WIDTH;
-    }
-
-    rs->runChar = rs->imtf_row[0][0];
+    /* The IMTF list was initialized with the symbol map above. */
+    rs->runChar = rs->imtf[0];
     rs->run = 0;
     rs->shift = 0;
 
-    /* Initialize IBWT frequency table. */
-    memset(ds->ftab, 0, sizeof(ds->ftab));
+    /* Initialize IBWT frequency tables.  Runs are counted in one of 4
+       tables, depending on index of the ending code within its group.
+       Runs of the same character often follow closely, and with a
+       single table their counts would be incremented in a dependent
+       chain through memory.  The tables are summed at the end. */
+    memset(rs->ftab, 0, sizeof(rs->ftab));
+    ds->half = 0;
 
     /* Retrieve block MTF values.
 
@@ -632,6 +796,16 @@ retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
     for (rs->g = 0; rs->g < rs->num_selectors; rs->g++) {
       unsigned s, x, k, i;
 
+      /* Remember frequencies of the first half of the block, see
+         decode().  At group boundary ftab[] counts exactly the
+         characters stored in tt[] so far. */
+      if (unlikely(ds->half == 0 && tt - ds->tt >= MAX_BLOCK_SIZE / 2)) {
+        ds->half = tt - ds->tt;
+        for (i = 0; i < 256; i++)
+          ds->half_ftab[i] = (rs->ftab[0][i] + rs->ftab[1][i] +
+                              rs->ftab[2][i] + rs->ftab[3][i]);
+      }
+
       /* Select the tree coding this group. */
       i = rs->selector[rs->g];
       rs->t = rs->mtf[i];
@@ -650,39 +824,47 @@ retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
          asking for more input.
 
          There are two code paths.  The first one is executed when
-         there is at least 1024 bits of input available (i.e. 32
-         words, 32 bits each).  In this case we can apply several
-         optimizations, most notably we are allowed to keep state in
-         local variables and we can use NEED_FAST() - faster version
-         of NEED().  The second code path is executed when there is
-         not enough input to for fast decoding.
+         there is at least 1152 bits of input available (i.e. 36
+         words, 32 bits each), which covers the group plus up to 63
+         bits buffered ahead and the 64-bit load made at that point.
+         In this case we can apply several optimizations, most notably
+         we are allowed to keep state in local variables and we can
+         use REFILL_FAST() instead of NEED().  The second code path is
+         executed when there is not enough input to for fast decoding.
       */
-      if (likely((limit - next) >= 32)) {
+      if (likely((limit - next) >= 36)) {
+        const uint8_t *p = (const uint8_t *)next;
         struct tree *T = &rs->tree[rs->t];
+        unsigned W = T->width;
         unsigned j;
         unsigned run = rs->run;
         unsigned runChar = rs->runChar;
         unsigned shift = rs->shift;
+        unsigned slow = 0;
 
         for (j = 0; j < GROUP_SIZE; j++) {
-          NEED_FAST();
-          x = T->start[PEEK(HUFF_START_WIDTH)];
+          REFILL_FAST();
+          x = T->start[PEEK(W)];
           k = x & 0x1F;
 
-          if (likely(k <= HUFF_START_WIDTH)) {
+          if (likely(k <= W)) {
             s = x >> 5;
           }
           else {
             while (v >= T->base[k + 1])
               k++;
             s = T->perm[T->count[k] + ((v - T->base[k]) >> (64 - k))];
+            slow++;
           }
 
           DUMP(k);
 
           if (unlikely(IS_EOB(s))) {
+            LEAVE_FAST();
+            ds->slow_codes += slow;
             rs->run = run;
             rs->runChar = runChar;
+            rs->j = j;
             goto eob;
           }
 
@@ -695,16 +877,16 @@ retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
             return ERR_OVERFLOW;
           }
 
-          ds->ftab[runChar] += run;
-          while (run-- > 0) {
-            *tt++ = runChar;
-          }
+          rs->ftab[j & 3][runChar] += run;
+          tt = put_run(tt, runChar, run);
 
-          runChar = mtf_one(rs->imtf_row, rs->imtf_slide, s);
+          runChar = mtf_one(rs->imtf, s);
           shift = 0;
           run = 1;
         }
 
+        LEAVE_FAST();
+        ds->slow_codes += slow;
         rs->run = run;
         rs->runChar = runChar;
         rs->shift = shift;
@@ -716,19 +898,20 @@ retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
 
           NEED(S_PREFIX);
           T = &rs->tree[rs->t];
-          x = T->start[PEEK(HUFF_START_WIDTH)];
+          x = T->start[PEEK(T->width)];
           k = x & 0x1F;
 
-          if (likely(k <= HUFF_START_WIDTH)) {
+          if (likely(k <= T->width)) {
             /* Use look-up table in average case. */
             s = x >> 5;
           }
           else {
-            /* Code length exceeds HUFF_START_WIDTH, use canonical
-               prefix decoding algorithm instead of look-up table.  */
+            /* Code length exceeds table width, use canonical prefix
+               decoding algorithm instead of look-up table.  */
             while (v >= T->base[k + 1])
               k++;
             s = T->perm[T->count[k] + ((v - T->base[k]) >> (64 - k))];
+            ds->slow_codes++;
           }
 
           DUMP(k);
@@ -738,12 +921,14 @@ retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
             if (unlikely(rs->run > (size_t)(tt_limit - tt)))
               return ERR_OVERFLOW;
 
-            ds->ftab[rs->runChar] += rs->run;
-            while (rs->run--) {
-              *tt++ = rs->runChar;
-            }
+            rs->ftab[0][rs->runChar] += rs->run;
+            tt = put_run(tt, rs->runChar, rs->run);
+            for (i = 0; i < 256; i++)
+              ds->ftab[i] = (rs->ftab[0][i] + rs->ftab[1][i] +
+                             rs->ftab[2][i] + rs->ftab[3][i]);
 
             SAVE();
+            ds->num_codes = rs->g * GROUP_SIZE + rs->j + 1;
 
             /* Sanity-check the BWT primary index. */
             if (ds->block_size == 0)
@@ -775,12 +960,10 @@ retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
           }
 
           /* Dump the run. */
-          ds->ftab[rs->runChar] += rs->run;
-          while (rs->run-- > 0) {
-            *tt++ = rs->runChar;
-          }
+          rs->ftab[rs->j & 3][rs->runChar] += rs->run;
+          tt = put_run(tt, rs->runChar, rs->run);
 
-          rs->runChar = mtf_one(rs->imtf_row, rs->imtf_slide, s);
+          rs->runChar = mtf_one(rs->imtf, s);
           rs->shift = 0;
           rs->run = 1;
         }
@@ -795,6 +978,117 @@ retrieve(struct decoder_state *restrict ds, struct bitstream *bs)
 }
 
 
+/* Make sure that bs holds at least 32 bits.  Return false if there is
+   no more input available. */
+static bool
+check_fill(struct bitstream *bs)
+{
+  if (bs->live < 32u) {
+    if (bs->data == bs->limit)
+      return false;
+    bs->buff |= (uint64_t)ntohl(*bs->data++) << (32u - bs->live);
+    bs->live += 32u;
+  }
+  return true;
+}
+
+#define CHECK_PEEK(k) (bs.buff >> (64u - (k)))
+#define CHECK_DUMP(k) (bs.buff <<= (k), bs.live -= (k), (void)0)
+#define CHECK_TAKE(x,k) ((x) = CHECK_PEEK(k), CHECK_DUMP(k))
+
+/* Check whether block starting at bs (just after block CRC) could be
+   retrieved successfully, without retrieving it.  Block header and
+   coding tables are read and validated the same way retrieve() does:
+   BWT index must be below max_size, bitmap must not be empty, numbers
+   of trees and selectors must be in range and code lengths must be
+   well-formed.  The tree used by the first group must also be complete
+   (retrieve() fails only on trees which are used).
+
+   Return false if retrieve() would certainly fail, or true otherwise,
+   including the case when input ends before tables do.  bs is passed
+   by value and isn't consumed.
+*/
+bool
+retrieve_check(struct bitstream bs, unsigned max_size)
+{
+  unsigned bwt_idx, big, small, alpha_size, num_trees, num_selectors;
+  unsigned first_tree, i, j, k, t, len;
+  uint32_t kraft;
+
+  if (!check_fill(&bs))
+    return true;
+  CHECK_DUMP(1u);
+  CHECK_TAKE(bwt_idx, 24u);
+  if (bwt_idx >= max_size)
+    return false;
+
+  if (!check_fill(&bs))
+    return true;
+  CHECK_TAKE(big, 16u);
+  alpha_size = 0u;
+  for (i = 0u; i < 16u; i++, big <<= 1) {
+    if (big & 0x8000u) {
+      if (!check_fill(&bs))
+        return true;
+      CHECK_TAKE(small, 16u);
+      for (; small != 0u; small &= small - 1u)
+        alpha_size++;
+    }
+  }
+  if (alpha_size == 0u)
+    return false;
+  alpha_size += 2u;
+
+  if (!check_fill(&bs))
+    return true;
+  CHECK_TAKE(num_trees, 3u);
+  if (num_trees < MIN_TREES || num_trees > MAX_TREES)
+    return false;
+  CHECK_TAKE(num_selectors, 15u);
+  if (num_selectors == 0u)
+    return false;
+
+  first_tree = 0u;
+  for (i = 0u; i < num_selectors; i++) {
+    if (!check_fill(&bs))
+      return true;
+    k = table[CHECK_PEEK(6u)];
+    if (k > num_trees)
+      return false;
+    if (i == 0u)
+      first_tree = k - 1u;
+    CHECK_DUMP(k);
+  }
+
+  for (t = 0u; t < num_trees; t++) {
+    if (!check_fill(&bs))
+      return true;
+    CHECK_TAKE(len, 5u);
+    kraft = 0u;
+    j = 0u;
+    while (j < alpha_size) {
+      if (!check_fill(&bs))
+        return true;
+      k = CHECK_PEEK(6u);
+      len += R[k];
+      if (len < 3u + MIN_CODE_LENGTH || len > 3u + MAX_CODE_LENGTH)
+        return false;
+      len -= 3u;
+      k = L[k];
+      if (k != 6u) {
+        kraft += (uint32_t)1 << (MAX_CODE_LENGTH - len);
+        j++;
+      }
+      CHECK_DUMP(k);
+    }
+    if (t == first_tree && kraft != (uint32_t)1 << MAX_CODE_LENGTH)
+      return false;
+  }
+
+  return true;
+}
+
+
 /*== IBWT / IMTF ==*/
 
 /* Block size threshold above which block randomization has any effect.
@@ -848,16 +1142,22 @@ static const uint16_t rand_table[512] = {
 void
 decode(struct decoder_state *ds)
 {
-  uint32_t i, j, k;
+  uint32_t i, j, k, h;
   uint32_t cum;
-  uint8_t uc;
+  uint32_t ftab2[256];
+  uint8_t uc, uc2;
 
   uint32_t *tt = ds->tt;
 
-  /* Transform counts into indices (cumulative counts). */
+  /* Transform counts into indices (cumulative counts).  If the block
+     was split in halves by retrieve(), ftab2[] gets indices where
+     characters of the second half go. */
+  h = ds->half;
   cum = 0;
-  for (i = 0; i < 256; i++)
+  for (i = 0; i < 256; i++) {
     ds->ftab[i] = (cum += ds->ftab[i]) - ds->ftab[i];
+    ftab2[i] = ds->ftab[i] + (h ? ds->half_ftab[i] : 0);
+  }
   assert(cum == ds->block_size);
 
 
@@ -873,10 +1173,33 @@ decode(struct decoder_state *ds)
      (eg. ABABAB - the string AB is repeated k=3 times) then this algorithm
      will construct k independent (not connected), isomorphic lists.
    */
-  for (i = 0u; i < ds->block_size; i++) {
-    uc = tt[i];
-    tt[ds->ftab[uc]] += (i << 8);
-    ds->ftab[uc]++;
+  /* Within a bucket nodes are linked in order, which makes this loop a
+     chain of dependent increments of ftab[] whenever the same character
+     repeats (and in BWT output it does, a lot).  Both halves of the
+     block are linked at the same time using separate indices, giving
+     two independent chains. */
+  if (h > 0 && 2 * h <= ds->block_size) {
+    for (i = 0u; i < h; i++) {
+      uc = tt[i];
+      uc2 = tt[h + i];
+      tt[ds->ftab[uc]] += (i << 8);
+      ds->ftab[uc]++;
+      tt[ftab2[uc2]] += ((h + i) << 8);
+      ftab2[uc2]++;
+    }
+    for (i = 2 * h; i < ds->block_size; i++) {
+      uc = tt[i];
+      tt[ftab2[uc]] += (i << 8);
+      ftab2[uc]++;
+    }
+    memcpy(ds->ftab, ftab2, sizeof(ftab2));
+  }
+  else {
+    for (i = 0u; i < ds->block_size; i++) {
+      uc = tt[i];
+      tt[ds->ftab[uc]] += (i << 8);
+      ds->ftab[uc]++;
+    }
   }
   assert(ds->ftab[255] == ds->block_size);
 
@@ -918,15 +1241,217 @@ decode(struct decoder_state *ds)
       tt[i] = ((i + 1) << 8) + (tt[i] & 0xFF);
   }
 
+  ds->linear = ds->rand;
   ds->rle_state = 0;
   ds->rle_crc = -1;
-  ds->rle_index = ds->rand ? 0 : ds->tt[ds->bwt_idx];
+  ds->rle_index = ds->linear ? 0 : ds->tt[ds->bwt_idx];
   ds->rle_avail = ds->block_size;
   ds->rle_prev = 0;
   ds->rle_char = 0;
 }
 
 
+/* Walking the IBWT list is strictly serial, which leaves other threads
+   idle if there are only a few blocks to decode.  In that case the list
+   can be split into segments walked in parallel.  Some nodes of the list
+   are sampled and marked, always including the node at primary index.
+   Each segment starts at a sampled node and ends just before the next
+   sampled node on the list, which is not known until the segment is
+   walked.  Walks can be done in any order and from any thread, as they
+   only read tt[].  When all of them are done, decode_join() chains the
+   segments together and writes them back to tt[] as a linear list,
+   which emit() then reads sequentially.
+
+   Nodes of the list use bits 0-27, so bit 31 is free to mark samples.
+   If the block consists of a string repeated several times, the list
+   has several cycles.  Segments started on cycles other than the one
+   of primary index are walked, but never used.
+*/
+#define SEG_MARK 0x80000000u
+
+/* Segments are at least this long on average.  Shorter walks don't pay
+   off the cost of scheduling them. */
+#define SEG_MIN_SIZE 65536u
+
+struct ibwt_seg {
+  uint32_t start;               /* sampled node the segment starts at */
+  unsigned next;                /* segment following this one */
+  size_t size;                  /* number of characters */
+  size_t max_size;              /* allocated size of buf */
+  uint8_t *buf;                 /* characters of the segment */
+};
+
+
+/* Prepare block decoded by decode() to be walked in up to k segments.
+   Return the number of segments, which is zero if the block is too small
+   to be split or if tt[] already is a linear list.  In that case the
+   block can be emitted right away.  Otherwise decode_segment() must be
+   called for each segment, and then decode_join().
+*/
+unsigned
+decode_split(struct decoder_state *ds, unsigned k)
+{
+  uint32_t n = ds->block_size;
+  unsigned i;
+
+  k = min(k, n / SEG_MIN_SIZE);
+  if (ds->linear || k < 2)
+    return 0;
+
+  ds->segs = XNMALLOC(k, struct ibwt_seg);
+  ds->num_segs = k;
+
+  for (i = 0; i < k; i++) {
+    struct ibwt_seg *sg = &ds->segs[i];
+
+    sg->start = (ds->bwt_idx + (uint64_t)i * n / k) % n;
+    sg->size = 0;
+    sg->max_size = 0;
+    sg->buf = NULL;
+    ds->tt[sg->start] |= SEG_MARK;
+  }
+
+  return k;
+}
+
+
+/* Walk segment i of a block split with decode_split(). */
+void
+decode_segment(struct decoder_state *ds, unsigned i)
+{
+  struct ibwt_seg *sg = &ds->segs[i];
+  const uint32_t *tt = ds->tt;
+  uint32_t j, p;
+
+  sg->max_size = ds->block_size / ds->num_segs;
+  sg->buf = xmalloc(sg->max_size);
+
+  p = tt[sg->start];
+  do {
+    j = (p >> 8) & 0xFFFFF;
+    p = tt[j];
+    if (unlikely(sg->size == sg->max_size))
+      sg->buf = x2nrealloc(sg->buf, &sg->max_size, 1);
+    sg->buf[sg->size++] = p & 0xFF;
+  }
+  while (!(p & SEG_MARK));
+
+  /* Segments are few, so a linear search is fine. */
+  for (i = 0; ds->segs[i].start != j; i++)
+    assert(i + 1 < ds->num_segs);
+  sg->next = i;
+}
+
+
+/* Chain segments walked by decode_segment() into a linear list. */
+void
+decode_join(struct decoder_state *ds)
+{
+  uint32_t *tt = ds->tt;
+  uint32_t i, j;
+  unsigned s;
+
+  /* Segment 0 starts at primary index.  If the list has several cycles,
+     going through its segments repeats the cycle until the block is
+     filled, just like walking the list would. */
+  i = 0;
+  s = 0;
+  while (i < ds->block_size) {
+    struct ibwt_seg *sg = &ds->segs[s];
+    uint32_t m = min(sg->size, ds->block_size - i);
+
+    for (j = 0; j < m; j++, i++)
+      tt[i] = ((i + 1) << 8) + sg->buf[j];
+    s = sg->next;
+  }
+
+  for (s = 0; s < ds->num_segs; s++)
+    free(ds->segs[s].buf);
+  free(ds->segs);
+  ds->segs = NULL;
+  ds->num_segs = 0;
+
+  ds->linear = true;
+  ds->rle_index = 0;
+}
+
+
+/* Walk IBWT lists of k blocks in lockstep, leaving each tt[] as a
+   linear list.  Each step of a walk depends on the load made by the
+   previous one.  Steps of different blocks don't, so walking several
+   blocks at once keeps more loads in flight.  Characters are collected
+   in a temporary buffer for each block, as tt[] can't be overwritten
+   before its walk is done.
+*/
+void
+decode_walk(struct decoder_state **ds, unsigned k)
+{
+  uint8_t *buf[MAX_WALKS];
+  uint32_t p[MAX_WALKS];
+  uint32_t i, n;
+  unsigned d;
+
+  assert(k <= MAX_WALKS);
+
+  n = UINT32_MAX;
+  for (d = 0; d < k; d++) {
+    assert(!ds[d]->linear);
+    buf[d] = xmalloc(ds[d]->block_size);
+    p[d] = ds[d]->rle_index;
+    n = min(n, ds[d]->block_size);
+  }
+
+  for (i = 0; i < n; i++) {
+    for (d = 0; d < k; d++) {
+      p[d] = ds[d]->tt[p[d] >> 8];
+      buf[d][i] = p[d] & 0xFF;
+    }
+  }
+
+  for (d = 0; d < k; d++) {
+    uint32_t *tt = ds[d]->tt;
+
+    for (i = n; i < ds[d]->block_size; i++) {
+      p[d] = tt[p[d] >> 8];
+      buf[d][i] = p[d] & 0xFF;
+    }
+
+    for (i = 0; i < ds[d]->block_size; i++)
+      tt[i] = ((i + 1) << 8) + buf[d][i];
+
+    free(buf[d]);
+    ds[d]->linear = true;
+    ds[d]->rle_index = 0;
+  }
+}
+
+
+/* Update CRC checksum s with n copies of byte d.  The run is split into
+   parts of length 2^k.  Feeding such part to the CRC means passing s
+   through 2^k zero bytes (which is linear in s and done one byte of s
+   at time with crc_zero_table) and adding CRC of the part itself (taken
+   from crc_run_table).
+*/
+static uint32_t
+crc_run(uint32_t s, uint8_t d, unsigned n)
+{
+  unsigned k;
+
+  assert(n < 256);
+
+  for (k = 0; n != 0; k++, n >>= 1) {
+    if (n & 1)
+      s = (crc_zero_table[k][0][s >> 24] ^
+           crc_zero_table[k][1][(s >> 16) & 0xFF] ^
+           crc_zero_table[k][2][(s >> 8) & 0xFF] ^
+           crc_zero_table[k][3][s & 0xFF] ^
+           crc_run_table[k][d]);
+  }
+
+  return s;
+}
+
+
 #define M1 0xFFFFFFFFu
 
 
@@ -1006,14 +1531,16 @@ emit(struct decoder_state *ds, void *buf, size_t *buf_sz)
   case 4:
     if (unlikely(m < c)) {
       c -= m;
-      while (m--)
-        s = (s << 8) ^ crc_table[(s >> 24) ^ (*b++ = d)];
+      memset(b, d, m);
+      s = crc_run(s, d, m);
+      m = M1;
       ds->rle_state = 4;
       break;
     }
     m -= c;
-    while (c--)
-      s = (s << 8) ^ crc_table[(s >> 24) ^ (*b++ = d)];
+    memset(b, d, c);
+    b += c;
+    s = crc_run(s, d, c);
   case 0:
     if (unlikely(!a--))
       break;
@@ -1096,14 +1623,16 @@ emit(struct decoder_state *ds, void *buf, size_t *buf_sz)
         return ERR_RUNLEN;
       if (m < (c = p = t[p >> 8])) {
         c -= m;
-        while (m--)
-          s = (s << 8) ^ crc_table[(s >> 24) ^ (*b++ = d)];
+        memset(b, d, m);
+        s = crc_run(s, d, m);
+        m = M1;
         ds->rle_state = 4;
         break;
       }
       m -= c;
-      while (c--)
-        s = (s << 8) ^ crc_table[(s >> 24) ^ (*b++ = d)];
+      memset(b, d, c);
+      b += c;
+      s = crc_run(s, d, c);
       if (unlikely(!a--))
         break;
       c = p = t[p >> 8];
@@ -1140,7 +1669,7 @@ size_t
 decoder_alloc_size(void)
 {
   return (sizeof(struct decoder_state) +
-          MAX_BLOCK_SIZE * sizeof(uint32_t) +
+          (MAX_BLOCK_SIZE + TT_SLACK) * sizeof(uint32_t) +
           sizeof(struct retriever_internal_state));
 }
 
@@ -1148,7 +1677,32 @@ decoder_alloc_size(void)
 void
 decoder_init(struct decoder_state *ds)
 {
-  ds->internal_state = (void *)(ds->tt + MAX_BLOCK_SIZE);
+  ds->internal_state = (void *)(ds->tt + MAX_BLOCK_SIZE + TT_SLACK);
   ds->internal_state->state = S_INIT;
   ds->block_size = 0;
+  ds->num_codes = 0;
+  ds->slow_codes = 0;
+  ds->num_segs = 0;
+  ds->segs = NULL;
+  ds->num_trees = 0;
+  ds->cached_trees = 0;
+  ds->tree_cache = NULL;
+}
+
+
+size_t
+tree_cache_alloc_size(void)
+{
+  return sizeof(struct tree_cache);
+}
+
+
+void
+tree_cache_init(struct tree_cache *tc)
+{
+  unsigned i;
+
+  tc->next = 0;
+  for (i = 0; i < TREE_CACHE_SIZE; i++)
+    tc->entry[i].alpha_size = 0;
 }
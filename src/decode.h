@@ -31,10 +31,13 @@ struct parser_state {
   uint32_t stored_crc;
   uint32_t computed_crc;
   int stream_mode;
+  unsigned skip;                /* bits to skip before next header */
+  bool partial;                 /* current stream was entered midway */
 };
 
 
 struct in_blk;
+struct tree_cache;
 
 struct bitstream {
   unsigned live;
@@ -54,6 +57,13 @@ struct decoder_state {
   unsigned block_size;          /* compressed block size */
   uint32_t crc;                 /* expected block CRC */
   uint32_t ftab[256];           /* frequency table used in counting sort */
+  uint32_t half;                /* size of first half of tt[], or 0 */
+  uint32_t half_ftab[256];      /* frequency table of first half of tt[] */
+  uint32_t num_codes;           /* prefix codes decoded */
+  uint32_t slow_codes;          /* codes too long for lookup tables */
+  uint32_t num_trees;           /* prefix trees used */
+  uint32_t cached_trees;        /* prefix trees found in cache */
+  struct tree_cache *tree_cache;  /* cache of prefix trees, or NULL */
 
   int rle_state;                /* FSA state */
   uint32_t rle_crc;             /* CRC checksum */
@@ -62,21 +72,38 @@ struct decoder_state {
   uint8_t rle_char;             /* current character */
   uint8_t rle_prev;             /* prevoius character */
 
+  bool linear;                  /* tt[] is a linear list */
+  unsigned num_segs;            /* IBWT segments, see decode_split() */
+  struct ibwt_seg *segs;
+
   uint32_t tt[0];
 };
 
 
+/* Maximal number of blocks walked in lockstep by decode_walk(). */
+#define MAX_WALKS 4u
+
 struct source;
 
 extern uint32_t crc_table[256];
+extern uint32_t crc_run_table[8][256];
+extern uint32_t crc_zero_table[8][4][256];
 
 void parser_init(struct parser_state *ps, int bs100k, int stream_mode);
+void parser_resume(struct parser_state *ps, unsigned skip);
 int parse(struct parser_state *ps, struct header *hd, struct bitstream *bs,
           unsigned *garbage);
 int scan(struct bitstream *bs, unsigned skip);
 
 size_t decoder_alloc_size(void);
 void decoder_init(struct decoder_state *ds);
+size_t tree_cache_alloc_size(void);
+void tree_cache_init(struct tree_cache *tc);
 int retrieve(struct decoder_state *ds, struct bitstream *bs);
+bool retrieve_check(struct bitstream bs, unsigned max_size);
 void decode(struct decoder_state *ds);
+unsigned decode_split(struct decoder_state *ds, unsigned k);
+void decode_segment(struct decoder_state *ds, unsigned i);
+void decode_join(struct decoder_state *ds);
+void decode_walk(struct decoder_state **ds, unsigned k);
 int emit(struct decoder_state *ds, void *buf, size_t *buf_sz);
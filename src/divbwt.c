@@ -24,12 +24,15 @@
 
 #include "encode.h"
 
-#include <string.h>             /* memset() */
+#include <setjmp.h>             /* setjmp() */
+#include <string.h>             /* memcpy(), memset() */
 
 
 /*- Settings -*/
 #define SS_INSERTIONSORT_THRESHOLD 8
 #define SS_BLOCKSIZE 1024
+#define SS_RADIX_KEYBITS 16
+#define SS_RADIX_THRESHOLD 4096
 #define ALPHABET_SIZE 256
 
 
@@ -149,6 +152,35 @@ getidx(saidx_t *pa) {
   return (0 <= a) ? a : ~a;
 }
 
+/*---- work budget ----*/
+
+/*
+  Sorting time depends on lengths of common prefixes of suffixes, and on some
+  highly repetitive blocks it can be orders of magnitude longer than average.
+  To bound it, the work done by substring sort and tandem repeat sort
+  (characters compared and elements partitioned) is charged against a budget
+  proportional to block size.  When the budget is exhausted sorting is
+  abandoned and divbwt() reports failure, so that the caller can use an
+  algorithm with guaranteed running time instead.
+*/
+typedef struct _workbudget_t workbudget_t;
+struct _workbudget_t {
+  int64_t remain;
+  jmp_buf overrun;
+};
+
+/* Budget per character of the block. */
+#ifndef WORK_BUDGET_FACTOR
+#define WORK_BUDGET_FACTOR 64
+#endif
+
+static INLINE
+void
+workbudget_charge(workbudget_t *work, saidx_t size) {
+  if((work->remain -= size) < 0) { longjmp(work->overrun, 1); }
+}
+
+
 /*---- sssort ----*/
 
 /*- Private Functions -*/
@@ -210,20 +242,64 @@ ss_isqrt(saidx_t x) {
 
 /*---------------------------------------------------------------------------*/
 
+/* Loads 8 characters as a big-endian word, so that the first character is
+   the most significant byte. */
+static INLINE
+uint64_t
+ss_load(const sauchar_t *U) {
+  uint64_t x;
+#if defined(WORDS_BIGENDIAN) || GNUC_VERSION >= 40300
+  memcpy(&x, U, sizeof(x));
+# ifndef WORDS_BIGENDIAN
+  x = __builtin_bswap64(x);
+# endif
+#else
+  int k;
+  for(x = 0, k = 0; k < 8; ++k) { x = (x << 8) | U[k]; }
+#endif
+  return x;
+}
+
+/* Returns the length of the common prefix of two strings, not exceeding len.
+   Up to 7 characters past the end of either string are read, but they do not
+   affect the result. */
+static INLINE
+saidx_t
+ss_lcp(const sauchar_t *U1, const sauchar_t *U2, saidx_t len) {
+  uint64_t x;
+  saidx_t i;
+
+  for(i = 0; i < len; i += 8) {
+    if((x = ss_load(U1 + i) ^ ss_load(U2 + i)) != 0) {
+#if GNUC_VERSION >= 30406
+      i += __builtin_clzll(x) >> 3;
+#else
+      for(; (x >> 56) == 0; x <<= 8) { ++i; }
+#endif
+      break;
+    }
+  }
+
+  return MIN(i, len);
+}
+
 /* Compares two suffixes. */
 static INLINE
 saint_t
 ss_compare(const sauchar_t *T,
            const saidx_t *p1, const saidx_t *p2,
-           saidx_t depth) {
+           saidx_t depth, workbudget_t *work) {
   const sauchar_t *U1, *U2, *U1n, *U2n;
-
-  for(U1 = T + depth + *p1,
-      U2 = T + depth + *p2,
-      U1n = T + *(p1 + 1) + 2,
-      U2n = T + *(p2 + 1) + 2;
-      (U1 < U1n) && (U2 < U2n) && (*U1 == *U2);
-      ++U1, ++U2) {
+  saidx_t k;
+
+  U1 = T + depth + *p1;
+  U2 = T + depth + *p2;
+  U1n = T + *(p1 + 1) + 2;
+  U2n = T + *(p2 + 1) + 2;
+  if((U1 < U1n) && (U2 < U2n)) {
+    k = ss_lcp(U1, U2, MIN(U1n - U1, U2n - U2));
+    workbudget_charge(work, k);
+    U1 += k, U2 += k;
   }
 
   return U1 < U1n ?
@@ -235,23 +311,28 @@ static INLINE
 saint_t
 ss_compare_last(const sauchar_t *T, const saidx_t *PA,
                 const saidx_t *p1, const saidx_t *p2,
-                saidx_t depth, saidx_t size) {
+                saidx_t depth, saidx_t size, workbudget_t *work) {
   const sauchar_t *U1, *U2, *U1n, *U2n;
-
-  for(U1 = T + depth + *p1,
-      U2 = T + depth + *p2,
-      U1n = T + size,
-      U2n = T + *(p2 + 1) + 2;
-      (U1 < U1n) && (U2 < U2n) && (*U1 == *U2);
-      ++U1, ++U2) {
+  saidx_t k;
+
+  U1 = T + depth + *p1;
+  U2 = T + depth + *p2;
+  U1n = T + size;
+  U2n = T + *(p2 + 1) + 2;
+  if((U1 < U1n) && (U2 < U2n)) {
+    k = ss_lcp(U1, U2, MIN(U1n - U1, U2n - U2));
+    workbudget_charge(work, k);
+    U1 += k, U2 += k;
   }
 
   if(U1 < U1n) { return (U2 < U2n) ? *U1 - *U2 : 1; }
   else if(U2 == U2n) { return 1; }
 
-  for(U1 = T + (U1 - T) % size, U1n = T + PA[0] + 2;
-      (U1 < U1n) && (U2 < U2n) && (*U1 == *U2);
-      ++U1, ++U2) {
+  U1 = T + (U1 - T) % size;
+  U1n = T + PA[0] + 2;
+  if((U1 < U1n) && (U2 < U2n)) {
+    k = ss_lcp(U1, U2, MIN(U1n - U1, U2n - U2));
+    U1 += k, U2 += k;
   }
 
   return U1 < U1n ?
@@ -269,13 +350,14 @@ ss_compare_last(const sauchar_t *T, const saidx_t *PA,
 static
 void
 ss_insertionsort(const sauchar_t *T, const saidx_t *PA,
-                 saidx_t *first, saidx_t *last, saidx_t depth) {
+                 saidx_t *first, saidx_t *last, saidx_t depth,
+                 workbudget_t *work) {
   saidx_t *i, *j;
   saidx_t t;
   saint_t r;
 
   for(i = last - 2; first <= i; --i) {
-    for(t = *i, j = i + 1; 0 < (r = ss_compare(T, PA + t, PA + *j, depth));) {
+    for(t = *i, j = i + 1; 0 < (r = ss_compare(T, PA + t, PA + *j, depth, work));) {
       do { *(j - 1) = *j; } while((++j < last) && (*j < 0));
       if(last <= j) { break; }
     }
@@ -413,7 +495,7 @@ static
 void
 ss_mintrosort(const sauchar_t *T, const saidx_t *PA,
               saidx_t *first, saidx_t *last,
-              saidx_t depth) {
+              saidx_t depth, workbudget_t *work) {
 #define STACK_SIZE SS_MISORT_STACKSIZE
   struct { saidx_t *a, *b, c; saint_t d; } stack[STACK_SIZE];
   const sauchar_t *Td;
@@ -427,12 +509,13 @@ ss_mintrosort(const sauchar_t *T, const saidx_t *PA,
 
     if((last - first) <= SS_INSERTIONSORT_THRESHOLD) {
 #if 1 < SS_INSERTIONSORT_THRESHOLD
-      if(1 < (last - first)) { ss_insertionsort(T, PA, first, last, depth); }
+      if(1 < (last - first)) { ss_insertionsort(T, PA, first, last, depth, work); }
 #endif
       STACK_POP(first, last, depth, limit);
       continue;
     }
 
+    workbudget_charge(work, last - first);
     Td = T + depth;
     if(limit-- == 0) { ss_heapsort(Td, PA, first, last - first); }
     if(limit < 0) {
@@ -605,7 +688,7 @@ static
 void
 ss_inplacemerge(const sauchar_t *T, const saidx_t *PA,
                 saidx_t *first, saidx_t *middle, saidx_t *last,
-                saidx_t depth) {
+                saidx_t depth, workbudget_t *work) {
   const saidx_t *p;
   saidx_t *a, *b;
   saidx_t len, half;
@@ -619,7 +702,7 @@ ss_inplacemerge(const sauchar_t *T, const saidx_t *PA,
         0 < len;
         len = half, half >>= 1) {
       b = a + half;
-      q = ss_compare(T, PA + getidx(b), p, depth);
+      q = ss_compare(T, PA + getidx(b), p, depth, work);
       if(q < 0) {
         a = b + 1;
         half -= (len & 1) ^ 1;
@@ -648,7 +731,7 @@ static
 void
 ss_mergeforward(const sauchar_t *T, const saidx_t *PA,
                 saidx_t *first, saidx_t *middle, saidx_t *last,
-                saidx_t *buf, saidx_t depth) {
+                saidx_t *buf, saidx_t depth, workbudget_t *work) {
   saidx_t *a, *b, *c, *bufend;
   saidx_t t;
   saint_t r;
@@ -657,7 +740,7 @@ ss_mergeforward(const sauchar_t *T, const saidx_t *PA,
   ss_blockswap(buf, first, middle - first);
 
   for(t = *(a = first), b = buf, c = middle;;) {
-    r = ss_compare(T, PA + *b, PA + *c, depth);
+    r = ss_compare(T, PA + *b, PA + *c, depth, work);
     if(r < 0) {
       do {
         *a++ = *b;
@@ -698,7 +781,7 @@ static
 void
 ss_mergebackward(const sauchar_t *T, const saidx_t *PA,
                  saidx_t *first, saidx_t *middle, saidx_t *last,
-                 saidx_t *buf, saidx_t depth) {
+                 saidx_t *buf, saidx_t depth, workbudget_t *work) {
   const saidx_t *p1, *p2;
   saidx_t *a, *b, *c, *bufend;
   saidx_t t;
@@ -714,7 +797,7 @@ ss_mergebackward(const sauchar_t *T, const saidx_t *PA,
   if(*(middle - 1) < 0) { p2 = PA + ~*(middle - 1); x |= 2; }
   else                  { p2 = PA +  *(middle - 1); }
   for(t = *(a = last - 1), b = bufend, c = middle - 1;;) {
-    r = ss_compare(T, p1, p2, depth);
+    r = ss_compare(T, p1, p2, depth, work);
     if(0 < r) {
       if(x & 1) { do { *a-- = *b, *b-- = *a; } while(*b < 0); x ^= 1; }
       *a-- = *b;
@@ -756,12 +839,12 @@ static
 void
 merge_check(const sauchar_t *T, const saidx_t *PA,
             saidx_t *first, saidx_t *last,
-            saint_t check, saidx_t depth) {
+            saint_t check, saidx_t depth, workbudget_t *work) {
   if((check & 1) ||
-     ((check & 2) && (ss_compare(T, PA + getidx(first - 1), PA + *first, depth) == 0))) {
+     ((check & 2) && (ss_compare(T, PA + getidx(first - 1), PA + *first, depth, work) == 0))) {
     *first = ~*first;
   }
-  if((check & 4) && ((ss_compare(T, PA + getidx(last - 1), PA + *last, depth) == 0))) {
+  if((check & 4) && ((ss_compare(T, PA + getidx(last - 1), PA + *last, depth, work) == 0))) {
     *last = ~*last;
   }
 }
@@ -771,7 +854,8 @@ static
 void
 ss_swapmerge(const sauchar_t *T, const saidx_t *PA,
              saidx_t *first, saidx_t *middle, saidx_t *last,
-             saidx_t *buf, saidx_t bufsize, saidx_t depth) {
+             saidx_t *buf, saidx_t bufsize, saidx_t depth,
+             workbudget_t *work) {
 #define STACK_SIZE SS_SMERGE_STACKSIZE
   struct { saidx_t *a, *b, *c; saint_t d; } stack[STACK_SIZE];
   saidx_t *l, *r, *lm, *rm;
@@ -782,18 +866,18 @@ ss_swapmerge(const sauchar_t *T, const saidx_t *PA,
   for(check = 0, ssize = 0;;) {
     if((last - middle) <= bufsize) {
       if((first < middle) && (middle < last)) {
-        ss_mergebackward(T, PA, first, middle, last, buf, depth);
+        ss_mergebackward(T, PA, first, middle, last, buf, depth, work);
       }
-      merge_check(T, PA, first, last, check, depth);
+      merge_check(T, PA, first, last, check, depth, work);
       STACK_POP(first, middle, last, check);
       continue;
     }
 
     if((middle - first) <= bufsize) {
       if(first < middle) {
-        ss_mergeforward(T, PA, first, middle, last, buf, depth);
+        ss_mergeforward(T, PA, first, middle, last, buf, depth, work);
       }
-      merge_check(T, PA, first, last, check, depth);
+      merge_check(T, PA, first, last, check, depth, work);
       STACK_POP(first, middle, last, check);
       continue;
     }
@@ -802,7 +886,7 @@ ss_swapmerge(const sauchar_t *T, const saidx_t *PA,
         0 < len;
         len = half, half >>= 1) {
       if(ss_compare(T, PA + getidx(middle + m + half),
-                       PA + getidx(middle - m - half - 1), depth) < 0) {
+                       PA + getidx(middle - m - half - 1), depth, work) < 0) {
         m += half + 1;
         half -= (len & 1) ^ 1;
       }
@@ -832,10 +916,10 @@ ss_swapmerge(const sauchar_t *T, const saidx_t *PA,
         first = r, middle = rm, check = (next & 3) | (check & 4);
       }
     } else {
-      if(ss_compare(T, PA + getidx(middle - 1), PA + *middle, depth) == 0) {
+      if(ss_compare(T, PA + getidx(middle - 1), PA + *middle, depth, work) == 0) {
         *middle = ~*middle;
       }
-      merge_check(T, PA, first, last, check, depth);
+      merge_check(T, PA, first, last, check, depth, work);
       STACK_POP(first, middle, last, check);
     }
   }
@@ -855,7 +939,7 @@ void
 sssort(const sauchar_t *T, const saidx_t *PA,
        saidx_t *first, saidx_t *last,
        saidx_t *buf, saidx_t bufsize,
-       saidx_t depth, saidx_t n, saint_t lastsuffix) {
+       saidx_t depth, saidx_t n, saint_t lastsuffix, workbudget_t *work) {
   saidx_t *a;
 #if SS_BLOCKSIZE != 0
   saidx_t *b, *middle, *curbuf;
@@ -866,7 +950,7 @@ sssort(const sauchar_t *T, const saidx_t *PA,
   if(lastsuffix != 0) { ++first; }
 
 #if SS_BLOCKSIZE == 0
-  ss_mintrosort(T, PA, first, last, depth);
+  ss_mintrosort(T, PA, first, last, depth, work);
 #else
   if((bufsize < SS_BLOCKSIZE) &&
       (bufsize < (last - first)) &&
@@ -878,35 +962,35 @@ sssort(const sauchar_t *T, const saidx_t *PA,
   }
   for(a = first, i = 0; SS_BLOCKSIZE < (middle - a); a += SS_BLOCKSIZE, ++i) {
 #if SS_INSERTIONSORT_THRESHOLD < SS_BLOCKSIZE
-    ss_mintrosort(T, PA, a, a + SS_BLOCKSIZE, depth);
+    ss_mintrosort(T, PA, a, a + SS_BLOCKSIZE, depth, work);
 #elif 1 < SS_BLOCKSIZE
-    ss_insertionsort(T, PA, a, a + SS_BLOCKSIZE, depth);
+    ss_insertionsort(T, PA, a, a + SS_BLOCKSIZE, depth, work);
 #endif
     curbufsize = last - (a + SS_BLOCKSIZE);
     curbuf = a + SS_BLOCKSIZE;
     if(curbufsize <= bufsize) { curbufsize = bufsize, curbuf = buf; }
     for(b = a, k = SS_BLOCKSIZE, j = i; j & 1; b -= k, k <<= 1, j >>= 1) {
-      ss_swapmerge(T, PA, b - k, b, b + k, curbuf, curbufsize, depth);
+      ss_swapmerge(T, PA, b - k, b, b + k, curbuf, curbufsize, depth, work);
     }
   }
 #if SS_INSERTIONSORT_THRESHOLD < SS_BLOCKSIZE
-  ss_mintrosort(T, PA, a, middle, depth);
+  ss_mintrosort(T, PA, a, middle, depth, work);
 #elif 1 < SS_BLOCKSIZE
-  ss_insertionsort(T, PA, a, middle, depth);
+  ss_insertionsort(T, PA, a, middle, depth, work);
 #endif
   for(k = SS_BLOCKSIZE; i != 0; k <<= 1, i >>= 1) {
     if(i & 1) {
-      ss_swapmerge(T, PA, a - k, a, middle, buf, bufsize, depth);
+      ss_swapmerge(T, PA, a - k, a, middle, buf, bufsize, depth, work);
       a -= k;
     }
   }
   if(limit != 0) {
 #if SS_INSERTIONSORT_THRESHOLD < SS_BLOCKSIZE
-    ss_mintrosort(T, PA, middle, last, depth);
+    ss_mintrosort(T, PA, middle, last, depth, work);
 #elif 1 < SS_BLOCKSIZE
-    ss_insertionsort(T, PA, middle, last, depth);
+    ss_insertionsort(T, PA, middle, last, depth, work);
 #endif
-    ss_inplacemerge(T, PA, first, middle, last, depth);
+    ss_inplacemerge(T, PA, first, middle, last, depth, work);
   }
 #endif
 
@@ -914,7 +998,7 @@ sssort(const sauchar_t *T, const saidx_t *PA,
     /* Insert last type B* suffix. */
     saint_t r;
     for(a = first, i = *(first - 1), r = 1;
-        (a < last) && ((*a < 0) || (0 < (r = ss_compare_last(T, PA, PA + i, PA + *a, depth, n))));
+        (a < last) && ((*a < 0) || (0 < (r = ss_compare_last(T, PA, PA + i, PA + *a, depth, n, work))));
         ++a) {
       *(a - 1) = *a;
     }
@@ -924,6 +1008,76 @@ sssort(const sauchar_t *T, const saidx_t *PA,
 }
 
 
+/*
+  Radix sort for small alphabets.  Substrings in a group are first sorted by
+  packed codes of their next few characters, so that sssort() is left with
+  much smaller groups, starting at a greater depth.  Characters are mapped to
+  codes from 1 up, and code 0 marks end of substring, which makes shorter
+  substrings precede longer ones, as in ss_compare().  Returns 0 if there is
+  not enough buffer space, in which case nothing is done.
+*/
+static
+saint_t
+ss_radixsort(const sauchar_t *T, const saidx_t *PA,
+             saidx_t *first, saidx_t *last,
+             saidx_t *buf, saidx_t bufsize,
+             const sauchar_t *cmap, saint_t bits,
+             saidx_t depth, saidx_t n, workbudget_t *work) {
+  saidx_t *a, *b, *c, *keys, *tmp, *cnt;
+  saidx_t i, p, e, s, t, size;
+  saint_t q, d, nk, k;
+
+  q = SS_RADIX_KEYBITS / bits;
+  nk = 1 << (q * bits);
+  size = last - first;
+  if(bufsize < nk + 2 * size) { return 0; }
+  keys = buf, tmp = buf + size, cnt = buf + bufsize - nk;
+
+  /* Compute keys and count them. */
+  memset(cnt, 0, nk * sizeof(saidx_t));
+  for(a = first, i = 0; a < last; ++a, ++i) {
+    p = PA[*a] + depth, e = PA[*a + 1] + 2;
+    for(d = 0, k = 0; d < q; ++d, ++p) {
+      k = (k << bits) | ((p < e) ? cmap[T[p]] + 1 : 0);
+    }
+    keys[i] = k;
+    ++cnt[k];
+  }
+  workbudget_charge(work, size * q);
+
+  /* Distribute. */
+  for(k = 0, s = 0; k < nk; ++k) { t = cnt[k]; cnt[k] = s; s += t; }
+  for(i = 0; i < size; ++i) { tmp[cnt[keys[i]]++] = first[i]; }
+  memcpy(first, tmp, size * sizeof(saidx_t));
+
+  /* Sort groups of equal keys.  If a key contains end of substring then all
+     substrings in its group are equal.  Otherwise substrings which end right
+     after the key are equal too and precede the rest of the group, which is
+     left to sssort().  They must be split off here, as ss_mintrosort() only
+     detects end of substring when its last character is at current depth. */
+  for(k = 0, a = first; k < nk; ++k, a = b) {
+    b = first + cnt[k];
+    if(1 < (b - a)) {
+      if((k & ((1 << bits) - 1)) == 0) {
+        for(i = 1; i < (b - a); ++i) { a[i] = ~a[i]; }
+        continue;
+      }
+      for(c = a, i = 0; i < (b - a); ++i) {
+        s = a[i];
+        if((PA[s] + depth + q) >= (PA[s + 1] + 2)) {
+          a[i] = *c, *c = (c == a) ? s : ~s, ++c;
+        }
+      }
+      if(1 < (b - c)) {
+        sssort(T, PA, c, b, buf, bufsize - nk, depth + q, n, 0, work);
+      }
+    }
+  }
+
+  return 1;
+}
+
+
 /*---- trsort ----*/
 
 /*- Private Functions -*/
@@ -1206,7 +1360,7 @@ static
 void
 tr_introsort(saidx_t *ISA, const saidx_t *ISAd, const saidx_t *ISAn,
              saidx_t *SA, saidx_t *first, saidx_t *last,
-             trbudget_t *budget) {
+             trbudget_t *budget, workbudget_t *work) {
 #define STACK_SIZE TR_STACKSIZE
   struct { const saidx_t *a; saidx_t *b, *c; saint_t d, e; }stack[STACK_SIZE];
   saidx_t *a, *b, *c;
@@ -1218,6 +1372,7 @@ tr_introsort(saidx_t *ISA, const saidx_t *ISAd, const saidx_t *ISAn,
 
   for(ssize = 0, limit = tr_ilg(last - first);;) {
     assert((ISAd < ISAn) || (limit == -3));
+    workbudget_charge(work, last - first);
 
     if(limit < 0) {
       if(limit == -1) {
@@ -1434,7 +1589,8 @@ tr_introsort(saidx_t *ISA, const saidx_t *ISAd, const saidx_t *ISAn,
 /* Tandem repeat sort */
 static
 void
-trsort(saidx_t *ISA, saidx_t *SA, saidx_t n, saidx_t depth) {
+trsort(saidx_t *ISA, saidx_t *SA, saidx_t n, saidx_t depth,
+       workbudget_t *work) {
   saidx_t *ISAd;
   saidx_t *first, *last, *a;
   trbudget_t budget;
@@ -1454,7 +1610,7 @@ trsort(saidx_t *ISA, saidx_t *SA, saidx_t n, saidx_t depth) {
         last = SA + ISA[t] + 1;
         if(1 < (last - first)) {
           budget.count = 0;
-          tr_introsort(ISA, ISAd, ISA + n, SA, first, last, &budget);
+          tr_introsort(ISA, ISAd, ISA + n, SA, first, last, &budget, work);
           if(budget.count != 0) { unsorted += budget.count; }
           else { skip = first - last; }
         } else if((last - first) == 1) {
@@ -1488,7 +1644,8 @@ trsort(saidx_t *ISA, saidx_t *SA, saidx_t n, saidx_t depth) {
 static
 saidx_t
 sort_typeBstar(const sauchar_t *T, saidx_t *SA,
-               saidx_t *bucket, saidx_t n) {
+               saidx_t *bucket, saidx_t n,
+               const sauchar_t *cmap, saint_t bits, workbudget_t *work) {
   saidx_t *PAb, *ISAb, *buf;
   saidx_t i, j, k, t, m, bufsize;
   saint_t c0, c1;
@@ -1561,8 +1718,13 @@ note:
     for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
       i = BUCKET_BSTAR(c0, c1);
       if(1 < (j - i)) {
-        sssort(T, PAb, SA + i, SA + j,
-                buf, bufsize, 2, n, *(SA + i) == (m - 1));
+        if((bits == 0) || ((j - i) < SS_RADIX_THRESHOLD) ||
+           (*(SA + i) == (m - 1)) ||
+           !ss_radixsort(T, PAb, SA + i, SA + j,
+                         buf, bufsize, cmap, bits, 2, n, work)) {
+          sssort(T, PAb, SA + i, SA + j,
+                  buf, bufsize, 2, n, *(SA + i) == (m - 1), work);
+        }
       }
     }
   }
@@ -1581,7 +1743,7 @@ note:
   }
 
   /* Construct the inverse suffix array of type B* suffixes using trsort. */
-  trsort(ISAb, SA, m, 1);
+  trsort(ISAb, SA, m, 1, work);
 
   /* Set the sorted order of type B* suffixes. */
   i = n - 1, j = m, c0 = T[n - 1], c1 = T[0];
@@ -1703,18 +1865,27 @@ construct_BWT(const sauchar_t *T, saidx_t *SA,
 
 /*- Function -*/
 
+static
 saidx_t
-divbwt(sauchar_t *T, saidx_t *SA, saidx_t *bucket, saidx_t n) {
+bwt(sauchar_t *T, saidx_t *SA, saidx_t *bucket, saidx_t n,
+    const sauchar_t *cmap, saint_t bits) {
+  workbudget_t work;
   saidx_t m, pidx, i;
 
   /* Check arguments. */
   assert(n > 0);
   if(n == 1) { SA[0] = T[0]; return 0; }
 
+  /* Make the block cyclic, and pad it for word-at-a-time comparisons. */
   T[n] = T[0];
+  memset(T + n + 1, 0, BWT_PAD - 1);
+
+  /* Give up if sorting takes too long. */
+  work.remain = (int64_t)n * WORK_BUDGET_FACTOR;
+  if(setjmp(work.overrun) != 0) { return -1; }
 
   /* Burrows-Wheeler Transform. */
-  m = sort_typeBstar(T, SA, bucket, n);
+  m = sort_typeBstar(T, SA, bucket, n, cmap, bits, &work);
   if(0 < m) {
     pidx = construct_BWT(T, SA, bucket, n);
   } else {
@@ -1724,3 +1895,23 @@ divbwt(sauchar_t *T, saidx_t *SA, saidx_t *bucket, saidx_t n) {
 
   return pidx;
 }
+
+saidx_t
+divbwt(sauchar_t *T, saidx_t *SA, saidx_t *bucket, saidx_t n) {
+  return bwt(T, SA, bucket, n, NULL, 0);
+}
+
+/* Variant for blocks made of at most MAX_SMALL_ALPHA distinct characters.
+   cmap maps characters in use to consecutive integers from 0 to as-1,
+   preserving their order. */
+saidx_t
+divbwt_small(sauchar_t *T, saidx_t *SA, saidx_t *bucket, saidx_t n,
+             const sauchar_t *cmap, saint_t as) {
+  saint_t bits;
+
+  assert(0 < as && as <= MAX_SMALL_ALPHA);
+
+  /* One more code is needed for end of substring. */
+  for(bits = 1; (1 << bits) <= as; ++bits) { }
+  return bwt(T, SA, bucket, n, cmap, bits);
+}
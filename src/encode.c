@@ -59,6 +59,27 @@
 #define MAX_HUFF_CODE_LENGTH 30
 
 
+/*
+  BLOCK SORTING ENGINE SELECTION
+
+  divbwt() is fast on typical data, but blocks made of few distinct long
+  substrings (generated sequences, fixtures, images with repeated patterns)
+  make its running time grow well above average.  saisbwt() sorts in linear
+  time regardless of input, but its constant factor is higher.  divbwt() also
+  gives up on blocks for which it exceeds its work budget, and these are
+  sorted with SA-IS as well.
+
+  In automatic mode collect() hashes every KGRAM_ORDER-character window of
+  the block and records the fingerprint in a bitmap.  The number of distinct
+  fingerprints approximates the number of distinct k-grams, which is small
+  when the block is highly repetitive.  Such blocks are sorted with SA-IS.
+*/
+#define KGRAM_ORDER 16
+#define KGRAM_LOG 16
+#define KGRAM_BITS (1u << KGRAM_LOG)
+#define KGRAM_THRESH 2048
+
+
 struct encoder_state {
   bool cmap[256];
   int rle_state;
@@ -75,6 +96,10 @@ struct encoder_state {
   uint32_t max_block_size;
   uint32_t cluster_factor;
 
+  int engine;                   /* BWT_DIVSUFSORT, BWT_SAIS or BWT_AUTO */
+  uint32_t kgram_hash;          /* hash of the last KGRAM_ORDER characters */
+  uint32_t kgram_seen[KGRAM_BITS / 32];  /* fingerprints seen in the block */
+
   union {
     struct {
       uint8_t selector[18000 + 1 + 1];
@@ -109,21 +134,27 @@ encoder_alloc_size(unsigned long max_block_size)
 {
   return (sizeof(struct encoder_state) +
           (max_block_size + GROUP_SIZE) * sizeof(uint32_t) +
-          max_block_size + 1);
+          max_block_size + BWT_PAD);
 }
 
 
 void
 encoder_init(struct encoder_state *s, unsigned long max_block_size,
-             unsigned cluster_factor)
+             unsigned cluster_factor, int engine)
 {
   assert(s != 0);
   assert(max_block_size > 0 && max_block_size <= MAX_BLOCK_SIZE);
   assert(cluster_factor > 0 && cluster_factor <= 65535);
+  assert(engine == BWT_DIVSUFSORT || engine == BWT_SAIS || engine == BWT_AUTO);
 
   s->max_block_size = max_block_size;
   s->cluster_factor = cluster_factor;
 
+  s->engine = engine;
+  s->kgram_hash = 0;
+  if (engine == BWT_AUTO)
+    memset(s->kgram_seen, 0, sizeof(s->kgram_seen));
+
   memset(s->cmap, 0, 256u * sizeof(bool));
   s->rle_state = 0;
   s->block_crc = -1;
@@ -131,6 +162,42 @@ encoder_init(struct encoder_state *s, unsigned long max_block_size,
 }
 
 
+/* Record fingerprints of k-grams ending in characters [first, last). */
+static void
+sample_kgrams(struct encoder_state *s, const uint8_t *first,
+              const uint8_t *last)
+{
+  uint32_t h = s->kgram_hash;
+  uint32_t fp;
+
+  /* Each character is shifted out of the 32-bit hash after KGRAM_ORDER
+     steps, so the hash depends on the last KGRAM_ORDER characters only. */
+  while (first < last) {
+    h = (h << (32 / KGRAM_ORDER)) ^ *first++;
+    fp = (h * 0x9E3779B1u) >> (32 - KGRAM_LOG);
+    s->kgram_seen[fp >> 5] |= (uint32_t)1 << (fp & 31);
+  }
+
+  s->kgram_hash = h;
+}
+
+
+/* Count distinct k-gram fingerprints recorded in the block. */
+static unsigned
+count_kgrams(const struct encoder_state *s)
+{
+  unsigned i, n;
+  uint32_t w;
+
+  n = 0;
+  for (i = 0; i < KGRAM_BITS / 32; i++)
+    for (w = s->kgram_seen[i]; w != 0; w &= w - 1)
+      n++;
+
+  return n;
+}
+
+
 int
 collect(struct encoder_state *s, const uint8_t *inbuf, size_t *buf_sz)
 {
@@ -328,6 +395,8 @@ finish_run:
   goto finish_run;
 
 done:
+  if (s->engine == BWT_AUTO)
+    sample_kgrams(s, block + s->nblock, q);
   s->nblock = q - block;
   s->block_crc = crc;
   *buf_sz -= p - inbuf;
@@ -335,6 +404,127 @@ done:
 }
 
 
+void
+scan_init(struct scan_state *s, unsigned long max_block_size)
+{
+  assert(max_block_size > 0 && max_block_size <= MAX_BLOCK_SIZE);
+
+  s->max_block_size = max_block_size;
+  s->nblock = 0;
+  s->run = 0;
+  s->ch = 0;
+}
+
+
+/* Nonzero iff any byte of x is zero. */
+#define HAS_ZERO_BYTE(x) (((x) - UINT64_C(0x0101010101010101)) & ~(x) & \
+                          UINT64_C(0x8080808080808080))
+
+/*
+  Find where collect() would end the block, without actually building it.
+  Only length of the block is tracked, so this is several times faster than
+  collect(), which also computes CRC and stores characters.  Return value and
+  buf_sz have the same meaning as in collect(): when the block is full
+  scan_block() consumes exactly the same characters as collect() would.
+
+  Runs are encoded as in collect(): the 4th character of a run reserves space
+  for the run length, which is only counted when the run ends.  A run of 3 is
+  not extended if the block has room for one more character only.
+*/
+int
+scan_block(struct scan_state *s, const uint8_t *inbuf, size_t *buf_sz)
+{
+  const uint8_t *p = inbuf;
+  const uint8_t *pLim = p + *buf_sz;
+  uint32_t n = s->nblock;
+  uint32_t max = s->max_block_size;
+  unsigned run = s->run;
+  unsigned ch = s->ch;
+  uint64_t x, y;
+  bool full;
+
+  for (;;) {
+    if (n >= max || (run == 3 && n + 1 >= max && p < pLim && *p == ch)) {
+      full = true;
+      break;
+    }
+    if (p == pLim) {
+      full = false;
+      break;
+    }
+
+    /* Skip 8 characters at a time when none of them repeats the previous
+       one, which is the common case in data without runs. */
+    if (run == 1 && p > inbuf) {
+      while (pLim - p >= 8 && n + 8 < max) {
+        memcpy(&x, p, 8);
+        memcpy(&y, p - 1, 8);
+        x = HAS_ZERO_BYTE(x ^ y);
+        if (x != 0) {
+#ifndef WORDS_BIGENDIAN
+          /* The lowest marked byte is exact, higher ones may not be. */
+# if GNUC_VERSION >= 30406
+          x = __builtin_ctzll(x) / 8;
+# else
+          for (y = 0; (x & 0xFF) == 0; y++)
+            x >>= 8;
+          x = y;
+# endif
+          p += x;
+          n += x;
+#endif
+          break;
+        }
+        p += 8;
+        n += 8;
+      }
+      ch = p[-1];
+      if (p == pLim)
+        continue;
+    }
+
+    /* Likewise, skip long runs 8 characters at a time. */
+    if (run >= 4) {
+      y = ch * UINT64_C(0x0101010101010101);
+      while (pLim - p >= 8 && run + 8 < MAX_RUN_LENGTH) {
+        memcpy(&x, p, 8);
+        if (x != y)
+          break;
+        p += 8;
+        run += 8;
+      }
+      if (p == pLim)
+        continue;
+    }
+
+    if (run != 0 && *p == ch) {
+      p++;
+      if (run < 4)
+        n++;
+      if (++run == MAX_RUN_LENGTH) {
+        n++;
+        run = 0;
+      }
+    }
+    else if (run >= 4) {
+      n++;
+      run = 0;
+    }
+    else {
+      ch = *p++;
+      n++;
+      run = 1;
+    }
+  }
+
+  s->nblock = n;
+  s->run = run;
+  s->ch = ch;
+  *buf_sz -= p - inbuf;
+  return full;
+}
+
+
 /* return ninuse */
 static unsigned
 make_map_e(uint8_t *cmap, const bool *inuse)
@@ -424,8 +614,9 @@ do_mtf(int32_t *bwt, uint32_t *mtffreq, uint8_t *cmap, int32_t nblock,
 }
 
 size_t
-encode(struct encoder_state *s, uint32_t *crc)
+encode(struct encoder_state *s, uint32_t *crc, bool *sort_fallback)
 {
+  int32_t idx;
   uint32_t cost;
   uint32_t pk;
   uint32_t i;
@@ -453,7 +644,31 @@ encode(struct encoder_state *s, uint32_t *crc)
   /* Sort block. */
   assert(s->nblock > 0);
 
-  s->bwt_idx = divbwt(block, s->SA, s->u.bucket, s->nblock);
+  *sort_fallback = false;
+  if (s->engine == BWT_SAIS) {
+    idx = saisbwt(block, s->SA, s->u.bucket, s->nblock, false);
+  }
+  else if (s->engine == BWT_AUTO && count_kgrams(s) < KGRAM_THRESH) {
+    /* Automatic choice of engine doesn't change output. */
+    idx = saisbwt(block, s->SA, s->u.bucket, s->nblock, true);
+  }
+  else {
+    if (EOB - 1 <= MAX_SMALL_ALPHA)
+      idx = divbwt_small(block, s->SA, s->u.bucket, s->nblock, cmap, EOB - 1);
+    else
+      idx = divbwt(block, s->SA, s->u.bucket, s->nblock);
+
+    /* divbwt() gives up on blocks which would take too long to sort.  It
+       would give up again on a periodic block, so don't retry it. */
+    if (idx < 0) {
+      *sort_fallback = true;
+      idx = saisbwt(block, s->SA, s->u.bucket, s->nblock, false);
+    }
+  }
+  /* saisbwt() fails only when memory is exhausted. */
+  if (idx < 0)
+    return 0;
+  s->bwt_idx = idx;
   s->nmtf = do_mtf(s->SA, s->u.s.code[0], cmap, s->nblock, EOB);
 
   cost = 48    /* header */
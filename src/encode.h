@@ -23,16 +23,52 @@
 #define HEADER_SIZE     4u
 #define TRAILER_SIZE    10u
 
+/* Number of bytes which must be available past the end of a block passed to
+   divbwt() or saisbwt(). */
+#define BWT_PAD         8u
+
+/* Block sorting engines. */
+enum {
+  BWT_DIVSUFSORT,               /* divbwt(), the default */
+  BWT_SAIS,                     /* saisbwt() */
+  BWT_AUTO,                     /* chosen per block */
+};
+
 
 struct encoder_state;
 
+/* Block boundary scanner state. */
+struct scan_state {
+  uint32_t nblock;              /* length of the block scanned so far */
+  uint32_t max_block_size;
+  unsigned run;                 /* length of the current run, 0 if none */
+  unsigned ch;                  /* character the current run is made of */
+};
+
 size_t encoder_alloc_size(unsigned long mbs);
-void encoder_init(struct encoder_state *e, unsigned long mbs, unsigned cf);
+void encoder_init(struct encoder_state *e, unsigned long mbs, unsigned cf,
+                  int engine);
 int collect(struct encoder_state *e, const uint8_t *buf, size_t *buf_sz);
-size_t encode(struct encoder_state *e, uint32_t *crc);
+void scan_init(struct scan_state *s, unsigned long mbs);
+int scan_block(struct scan_state *s, const uint8_t *buf, size_t *buf_sz);
+/* Return the size of encoded block, or 0 if memory needed for sorting
+   could not be allocated. */
+size_t encode(struct encoder_state *e, uint32_t *crc, bool *sort_fallback);
 void *transmit(struct encoder_state *e, void *buf);
 unsigned generate_prefix_code(struct encoder_state *s);
 
+/* Blocks with at most this many distinct characters are sorted with
+   divbwt_small(). */
+#define MAX_SMALL_ALPHA 31
+
+/* Return the primary index, or -1 if sorting was abandoned. */
 int32_t divbwt(uint8_t *T, int32_t *SA, int32_t *bucket, int32_t n);
+int32_t divbwt_small(uint8_t *T, int32_t *SA, int32_t *bucket, int32_t n,
+                     const uint8_t *cmap, int_fast32_t as);
+/* Return the primary index, or -1 if memory was exhausted, in which case
+   T is left rotated.  If periodic_divbwt is true, periodic blocks are sorted
+   with divbwt() if it succeeds, so that their primary index is the same. */
+int32_t saisbwt(uint8_t *T, int32_t *SA, int32_t *bucket, int32_t n,
+                bool periodic_divbwt);
 
 #define combine_crc(cc,c) (((cc) << 1) ^ ((cc) >> 31) ^ (c) ^ -1)
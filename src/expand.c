@@ -22,10 +22,11 @@
 #include "common.h"
 
 #include "decode.h"             /* decode() */
-#include "main.h"               /* bs100k */
+#include "main.h"               /* bs100k, print_cctrs */
 #include "process.h"            /* struct process */
+#include "index.h"              /* index_add() */
 
-#include <string.h>             /* memset() */
+#include <string.h>             /* memset(), memmove() */
 
 
 /*
@@ -128,11 +129,15 @@ struct emit_blk {
   struct decoder_state *ds;
   int status;
   uintmax_t end_offset;
+  unsigned seg_next;            /* next IBWT segment to walk */
+  unsigned seg_left;            /* IBWT segments not walked yet */
+  bool walking;                 /* IBWT list is being walked */
 };
 
 struct head_blk {
   struct position base;
   struct header hdr;
+  uint64_t start;               /* bit offset of block header in file */
 };
 
 struct out_blk {
@@ -140,6 +145,10 @@ struct out_blk {
   size_t size;
   uint32_t crc;
   uint32_t blk_sz;
+  uint32_t num_codes;
+  uint32_t slow_codes;
+  uint32_t num_trees;
+  uint32_t cached_trees;
   int status;
   uintmax_t end_offset;
 };
@@ -152,6 +161,7 @@ static uintmax_t head_offs;
 static uintmax_t tail_offs;
 
 static struct pqueue(struct retr_blk *) retr_q;
+static struct pqueue(struct emit_blk *) unroll_q;
 static struct pqueue(struct emit_blk *) emit_q;
 static struct pqueue(struct out_blk *) reord_q;
 static struct deque(struct head_blk) order_q;
@@ -160,6 +170,24 @@ static bool parse_token;
 static bool parsing_done;
 static struct pqueue(struct detached_bitstream *) scan_q;
 static uintmax_t reord_offs;
+static uintmax_t out_offs;      /* uncompressed bytes reordered so far */
+static uintmax_t block_offs;    /* uncompressed offset of current block */
+static uintmax_t blocks_left;   /* blocks still to be parsed, --range only */
+static uintmax_t out_skip;      /* output bytes still to be dropped */
+static uintmax_t out_left;      /* output bytes still to be written */
+static uintmax_t num_codes;     /* prefix codes decoded, for -S */
+static uintmax_t slow_codes;    /* codes not decoded by table lookup */
+static uintmax_t num_trees;     /* prefix trees used, for -S */
+static uintmax_t cached_trees;  /* prefix trees found in cache */
+static uintmax_t scan_hits;     /* new block headers found by scanners */
+static uintmax_t scan_rejects;  /* scanner hits rejected by retrieve_check() */
+static unsigned scan_bs100k;    /* block size limit of current stream */
+
+/* Prefix tree caches not used by any retriever.  There are never more
+   retrievers running than worker threads, so caches are effectively
+   private to workers, without any extra locking. */
+static struct tree_cache **tree_caches;
+static unsigned num_tree_caches;
 
 static struct detached_bitstream parser_bs;
 static struct parser_state par;
@@ -251,6 +279,10 @@ can_attach(struct detached_bitstream bs)
   return bs.offset < tail_offs || (eof && bs.offset == tail_offs);
 }
 
+/* Attach a bitstream to input blocks, taking a reference to the block it
+   starts in.  The scheduler lock is released, so that the caller can read
+   the bitstream without blocking other threads.  detach() takes the lock
+   again and drops the reference. */
 static struct bitstream
 attach(struct detached_bitstream dbs)
 {
@@ -397,15 +429,27 @@ do_parse(void)
   struct head_blk head_blk;
   struct bitstream true_bitstream;
   unsigned garbage;
+  bool cut;
 
   Trace(("Parser running at {%lu}",
          32ul + 32ul * parser_bs.offset - parser_bs.live));
 
   parse_token = 0;
   --work_units;
-  true_bitstream = attach(parser_bs);
-  rv = parse(&par, &head_blk.hdr, &true_bitstream, &garbage);
-  advance(detach(true_bitstream));
+
+  /* Once all blocks covering requested range have been found, the rest of
+     input is of no interest, so pretend that end of file was reached. */
+  cut = (partial.enabled && blocks_left == 0u);
+  if (cut) {
+    garbage = 0u;
+    rv = FINISH;
+  }
+  else {
+    true_bitstream = attach(parser_bs);
+    rv = parse(&par, &head_blk.hdr, &true_bitstream, &garbage);
+    advance(detach(true_bitstream));
+    scan_bs100k = par.bs100k;
+  }
   check_invariants();
 
   Trace(("Parser advancved to {%lu}",
@@ -423,16 +467,18 @@ do_parse(void)
     parse_token = true;
     parsing_done = true;
 
-    assert(garbage <= 32);
-    assert(parser_bs.live < 32);
-    assert(parser_bs.offset <= tail_offs);
-    parser_bs.live += garbage;
-    if (parser_bs.live >= 32) {
-      parser_bs.live -= 32;
-      parser_bs.offset--;
-    }
-    if (parser_bs.offset == tail_offs && parser_bs.live < 8 * eof_missing) {
-      failf(&ispec, "compressed data error: %s", err2str(ERR_EOF));
+    if (!cut) {
+      assert(garbage <= 32);
+      assert(parser_bs.live < 32);
+      assert(parser_bs.offset <= tail_offs);
+      parser_bs.live += garbage;
+      if (parser_bs.live >= 32) {
+        parser_bs.live -= 32;
+        parser_bs.offset--;
+      }
+      if (parser_bs.offset == tail_offs && parser_bs.live < 8 * eof_missing) {
+        failf(&ispec, "compressed data error: %s", err2str(ERR_EOF));
+      }
     }
 
     Trace(("Parser encountered End-Of-File at {%lu}",
@@ -491,8 +537,13 @@ do_parse(void)
     failf(&ispec, "compressed data error: %s", err2str(rv));
   }
 
+  /* Parser is now just past 48-bit block magic and 32-bit block CRC.  First
+     32 bits of file are stream header, which was consumed earlier. */
   head_blk.base = parser_bs.pos;
+  head_blk.start = 32u + 32u * parser_bs.offset - parser_bs.live - 80u;
   push(order_q, head_blk);
+  if (partial.enabled)
+    blocks_left--;
 
   while (!empty(unord_q) && pos_lt(peek(unord_q)->base, parser_bs.pos)) {
     struct unord_blk *ublk = dequeue(unord_q);
@@ -556,15 +607,26 @@ do_retrieve(void)
   struct retr_blk *rb;
   struct emit_blk *eb;
   struct bitstream true_bitstream;
+  unsigned segs;
   int rv;
 
   assert(!parsing_done);
   rb = dequeue(retr_q);
 
+  if (num_tree_caches > 0)
+    rb->ds->tree_cache = tree_caches[--num_tree_caches];
+  else {
+    rb->ds->tree_cache = xmalloc(tree_cache_alloc_size());
+    tree_cache_init(rb->ds->tree_cache);
+  }
+
   true_bitstream = attach(rb->curr_pos);
   rv = retrieve(rb->ds, &true_bitstream);
   rb->curr_pos = detach(true_bitstream);
 
+  tree_caches[num_tree_caches++] = rb->ds->tree_cache;
+  rb->ds->tree_cache = NULL;
+
   if (parsing_done) {
     free(rb->ds);
     free(rb);
@@ -620,21 +682,72 @@ do_retrieve(void)
     /* Parser knows about us, unord block is no longer needed. */
     free(rb->unord_link);
   }
+  /* Idle work units mean that there are fewer blocks than threads to
+     decode them, so the IBWT of this block may be split among them. */
+  segs = work_units + 1u;
   check_invariants();
   sched_unlock();
 
-  if (rv == OK)
+  if (rv == OK) {
     decode(rb->ds);
+    segs = decode_split(rb->ds, segs);
+  }
+  else
+    segs = 0;
 
   eb = XMALLOC(struct emit_blk);
 
   eb->ds = rb->ds;
   eb->base = rb->base;
   eb->end_offset = rb->curr_pos.offset;
+  eb->seg_next = 0;
+  eb->seg_left = segs;
+  eb->walking = false;
   free(rb);
 
   eb->status = rv;
 
+  sched_lock();
+  if (segs > 0)
+    enqueue(unroll_q, eb);
+  else
+    enqueue(emit_q, eb);
+  check_invariants();
+}
+
+
+static bool
+can_unroll(void)
+{
+  return !empty(unroll_q);
+}
+
+/* Walk one IBWT segment of a block.  The task which walks the last one
+   joins the segments and passes the block on to be emitted. */
+static void
+do_unroll(void)
+{
+  struct emit_blk *eb;
+  unsigned seg;
+
+  eb = peek(unroll_q);
+  seg = eb->seg_next++;
+  if (eb->seg_next == eb->ds->num_segs)
+    (void)dequeue(unroll_q);
+  check_invariants();
+  sched_unlock();
+
+  decode_segment(eb->ds, seg);
+
+  sched_lock();
+  if (--eb->seg_left > 0) {
+    check_invariants();
+    return;
+  }
+  sched_unlock();
+
+  decode_join(eb->ds);
+
   sched_lock();
   enqueue(emit_q, eb);
   check_invariants();
@@ -644,12 +757,81 @@ do_retrieve(void)
 static bool
 can_emit(void)
 {
-  return (!empty(emit_q) &&
+  return (!empty(emit_q) && !peek(emit_q)->walking &&
           (out_slots > EMIT_THRESH
            || (out_slots > 0 && !empty(order_q)
                && pos_eq(peek(emit_q)->base, dq_get(order_q, 0).base))));
 }
 
+/* Return true iff IBWT list of block eb can be walked by decode_walk(). */
+static bool
+can_walk(const struct emit_blk *eb)
+{
+  return (eb->status == OK && !eb->walking && !eb->ds->linear &&
+          eb->ds->rle_avail == eb->ds->block_size);
+}
+
+/* Collect up to MAX_WALKS blocks from emit_q whose IBWT lists can be
+   walked by decode_walk().  Return their number.  The block at the head
+   of emit_q is emitted next, and the one at the head of order_q is the
+   next to be written, so neither is taken: their emission would have to
+   wait for the slowest list of the walk. */
+static unsigned
+find_walks(struct emit_blk **eb)
+{
+  unsigned i, k;
+
+  k = 0;
+  for (i = 1; i < size(emit_q) && k < MAX_WALKS; i++)
+    if (can_walk(emit_q.root[i])
+        && (empty(order_q)
+            || !pos_eq(emit_q.root[i]->base, dq_get(order_q, 0).base)))
+      eb[k++] = emit_q.root[i];
+
+  return k;
+}
+
+/* Idle work units are better spent emitting blocks one by one, or walking
+   IBWT segments of new blocks.  Lockstep walks pay off only if there are
+   more blocks waiting than work units to take them. */
+static bool
+can_lockstep(void)
+{
+  struct emit_blk *eb[MAX_WALKS];
+
+  return (size(emit_q) > work_units && find_walks(eb) >= 2u);
+}
+
+/* Emitting a block is bound by latency of walking its IBWT list.  If
+   several blocks are waiting to be emitted, their lists are walked in
+   lockstep in a single task.  The blocks stay in emit_q, and are then
+   emitted in order as usual, only faster.  Emitting takes precedence over
+   this task, so it runs mostly when output is stalled. */
+static void
+do_lockstep(void)
+{
+  struct decoder_state *ds[MAX_WALKS];
+  struct emit_blk *eb[MAX_WALKS];
+  unsigned i, k;
+
+  k = find_walks(eb);
+  assert(k >= 2u);
+
+  for (i = 0; i < k; i++) {
+    eb[i]->walking = true;
+    ds[i] = eb[i]->ds;
+  }
+  check_invariants();
+  sched_unlock();
+
+  decode_walk(ds, k);
+
+  sched_lock();
+  for (i = 0; i < k; i++)
+    eb[i]->walking = false;
+  check_invariants();
+}
+
 static void
 do_emit(void)
 {
@@ -681,6 +863,10 @@ do_emit(void)
   else {
     oblk->end_offset = eb->end_offset;
     oblk->crc = eb->ds->crc;
+    oblk->num_codes = eb->ds->num_codes;
+    oblk->slow_codes = eb->ds->slow_codes;
+    oblk->num_trees = eb->ds->num_trees;
+    oblk->cached_trees = eb->ds->cached_trees;
     free(eb->ds);
     free(eb);
     sched_lock();
@@ -692,6 +878,25 @@ do_emit(void)
 }
 
 
+/* Drop output outside of the range requested with --range.  Whatever is
+   left is moved to the beginning of the buffer, which happens at most once
+   per range. */
+static void
+trim_output(struct out_blk *oblk)
+{
+  char *buffer = (char *)(oblk + 1);
+  size_t skip;
+
+  skip = min(oblk->size, out_skip);
+  out_skip -= skip;
+  oblk->size = min(oblk->size - skip, out_left);
+  out_left -= oblk->size;
+
+  if (skip > 0u && oblk->size > 0u)
+    memmove(buffer, buffer + skip, oblk->size);
+}
+
+
 static bool
 can_reorder(void)
 {
@@ -734,7 +939,20 @@ do_reorder(void)
       oblk->status = ERR_BLKCRC;
     if (oblk->status != OK)
       failf(&ispec, "compressed data error: %s", err2str(oblk->status));
+    num_codes += oblk->num_codes;
+    slow_codes += oblk->slow_codes;
+    num_trees += oblk->num_trees;
+    cached_trees += oblk->cached_trees;
+  }
+
+  out_offs += oblk->size;
+  if (oblk->status != MORE) {
+    if (make_index)
+      index_add(ord.start, block_offs, ord.hdr.crc, ord.hdr.bs100k);
+    block_offs = out_offs;
   }
+  if (partial.enabled)
+    trim_output(oblk);
 
   sink_write_buffer(oblk + 1, oblk->size, 4 * offs_incr);
   check_invariants();
@@ -754,6 +972,8 @@ do_scan(void)
   struct detached_bitstream *bs;
   int scan_result;
   unsigned skip;
+  unsigned max_size;
+  bool plausible;
   struct bitstream true_bitstream;
 
   assert(!parsing_done);
@@ -767,8 +987,18 @@ do_scan(void)
     skip = (parser_bs.pos.minor - bs->pos.minor) >> 27;
   }
 
+  /* Blocks found by scanners most likely belong to the stream being
+     parsed.  If they don't, and the next stream has larger blocks, they
+     may be rejected below, but the parser will find them anyway. */
+  max_size = scan_bs100k * 100000u;
+
+  /* Both scanning and checking the block header found are done without
+     holding the scheduler lock, like retrieve() in do_retrieve().  Parsing
+     may have finished in the meantime. */
   true_bitstream = attach(*bs);
   scan_result = scan(&true_bitstream, skip);
+  plausible = (scan_result != OK ||
+               retrieve_check(true_bitstream, max_size));
   *bs = detach(true_bitstream);
 
   if (scan_result != OK || parsing_done) {
@@ -783,10 +1013,19 @@ do_scan(void)
            32ul + 32ul * bs->offset - bs->live));
     work_units++;
   }
+  else if (!plausible) {
+    /* Don't waste a decoder on a block which can't be retrieved. */
+    Trace(("Scanner rejected a match at {%lu}",
+           32ul + 32ul * bs->offset - bs->live));
+    scan_hits++;
+    scan_rejects++;
+    work_units++;
+  }
   else {
     struct unord_blk *ub;
     struct retr_blk *rb;
 
+    scan_hits++;
     Trace(("Scanner found a unique match at {%lu}",
            32ul + 32ul * bs->offset - bs->live));
 
@@ -884,6 +1123,7 @@ init(void)
   deque_init(input_q, in_slots);
   pqueue_init(scan_q, in_slots);
   pqueue_init(retr_q, work_units);
+  pqueue_init(unroll_q, work_units);
   pqueue_init(emit_q, work_units);
   pqueue_init(unord_q, (work_units + out_slots > UNORD_THRESH ?
                         work_units + out_slots - UNORD_THRESH : 0));
@@ -896,9 +1136,26 @@ init(void)
   parsing_done = false;
   parse_token = true;
   reord_offs = 0;
+  out_offs = 0;
+  block_offs = 0;
+  index_reset();
+  blocks_left = partial.num_blocks;
+  out_skip = partial.skip;
+  out_left = partial.length;
+  num_codes = 0;
+  slow_codes = 0;
+  num_trees = 0;
+  cached_trees = 0;
+  scan_hits = 0;
+  scan_rejects = 0;
+  scan_bs100k = bs100k;
+  tree_caches = XNMALLOC(num_worker, struct tree_cache *);
+  num_tree_caches = 0;
 
   parser_bs = bits_init(0);
   parser_init(&par, bs100k, 0);
+  if (partial.enabled)
+    parser_resume(&par, partial.skip_bits);
 }
 
 
@@ -909,11 +1166,25 @@ uninit(void)
   assert(head_offs == tail_offs);
   assert(parse_token);
 
+  if (print_cctrs) {
+    info("%ju of %ju prefix code(s) decoded without lookup table", slow_codes,
+         num_codes);
+    info("%ju of %ju prefix tree(s) found in cache", cached_trees,
+         num_trees);
+    info("%ju of %ju scanner hit(s) rejected before retrieval",
+         scan_rejects, scan_hits);
+  }
+
+  while (num_tree_caches > 0)
+    free(tree_caches[--num_tree_caches]);
+  free(tree_caches);
+
   pqueue_uninit(scan_q);
   pqueue_uninit(unord_q);
   deque_uninit(order_q);
   pqueue_uninit(reord_q);
   pqueue_uninit(emit_q);
+  pqueue_uninit(unroll_q);
   pqueue_uninit(retr_q);
   deque_uninit(input_q);
 }
@@ -923,6 +1194,8 @@ static const struct task task_list[] = {
   { "reorder",  can_reorder,  do_reorder  },
   { "parse",    can_parse,    do_parse    },
   { "emit",     can_emit,     do_emit     },
+  { "lockstep", can_lockstep, do_lockstep },
+  { "unroll",   can_unroll,   do_unroll   },
   { "retrieve", can_retrieve, do_retrieve },
   { "scan",     can_scan,     do_scan     },
   { NULL,       NULL,         NULL        },
@@ -936,3 +1209,120 @@ const struct process expansion = {
   on_input_avail,
   on_write_complete,
 };
+
+
+/*
+  LOCATING BLOCKS
+
+  Decompression with --from-offset starts at an arbitrary byte of input,
+  without any index.  The first block following that point is found with
+  the same scanner as used by scan tasks.  As the scanner alone can find
+  bit patterns which only look like block headers, each candidate is
+  validated by retrieving the whole block.  Candidates are examined
+  sequentially, before any decompression is started.
+*/
+
+#define LOCATE_WORDS (256u * 1024u)
+
+
+/* Read more input to the end of buffer.  Returns false at end of file. */
+static bool
+locate_fill(uint32_t **buffer, size_t *words, size_t *max_words)
+{
+  size_t vacant, avail;
+
+  if (*max_words - *words < LOCATE_WORDS) {
+    *max_words = *words + LOCATE_WORDS;
+    *buffer = xnrealloc(*buffer, *max_words, sizeof(uint32_t));
+  }
+
+  vacant = 4u * LOCATE_WORDS;
+  avail = vacant;
+  xread(*buffer + *words, &vacant);
+  avail -= vacant;
+
+  memset((char *)(*buffer + *words) + avail, 0, (4u - avail % 4u) % 4u);
+  *words += (avail + 3u) / 4u;
+
+  return vacant == 0u;
+}
+
+
+bool
+locate_block(uintmax_t *bit_offset)
+{
+  uint32_t *buffer;
+  size_t words, max_words;
+  uintmax_t base;               /* number of words dropped from buffer */
+  size_t scan_pos;              /* scanner position within buffer */
+  unsigned scan_live;
+  uint64_t scan_buff;
+  struct decoder_state *ds;
+  bool more, found;
+
+  buffer = NULL;
+  words = 0u;
+  max_words = 0u;
+  base = 0u;
+  scan_pos = 0u;
+  scan_live = 0u;
+  scan_buff = 0u;
+  more = locate_fill(&buffer, &words, &max_words);
+  ds = xmalloc(decoder_alloc_size());
+  found = false;
+
+  for (;;) {
+    struct bitstream bs;
+    size_t pos;
+    int rv;
+
+    bs.live = scan_live;
+    bs.buff = scan_buff;
+    bs.block = NULL;
+    bs.data = buffer + scan_pos;
+    bs.limit = buffer + words;
+    bs.eof = !more;
+
+    if (OK != scan(&bs, 0u)) {
+      if (!more)
+        break;
+
+      /* Keep the last two words, as block magic may cross the boundary of
+         what has been read so far. */
+      pos = min(words, 2u);
+      memmove(buffer, buffer + words - pos, 4u * pos);
+      base += words - pos;
+      words = pos;
+      scan_pos = 0u;
+      scan_live = 0u;
+      scan_buff = 0u;
+      more = locate_fill(&buffer, &words, &max_words);
+      continue;
+    }
+
+    /* Scanner stopped just past 48-bit block magic and 32-bit block CRC. */
+    scan_pos = bs.data - buffer;
+    scan_live = bs.live;
+    scan_buff = bs.buff;
+
+    decoder_init(ds);
+    while (MORE == (rv = retrieve(ds, &bs)) && more) {
+      pos = bs.data - buffer;
+      more = locate_fill(&buffer, &words, &max_words);
+      bs.data = buffer + pos;
+      bs.limit = buffer + words;
+      bs.eof = !more;
+    }
+
+    if (OK == rv) {
+      *bit_offset = 32u * (base + scan_pos) - scan_live - 80u;
+      found = true;
+      break;
+    }
+  }
+
+  free(ds);
+  free(buffer);
+
+  return found;
+}
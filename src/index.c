@@ -0,0 +1,309 @@
+/*-
+  index.c -- block index
+
+  Copyright (C) 2012, 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include <string.h>             /* memcpy() */
+#include <sys/stat.h>           /* fstat() */
+#include <unistd.h>             /* write() */
+
+#include "xalloc.h"             /* x2nrealloc() */
+#include "main.h"               /* struct filespec */
+
+#include "index.h"
+
+
+/*
+  The index lists every block of a bzip2 file together with its position in
+  both compressed and uncompressed data, so that any part of the file can be
+  decompressed by decoding only the blocks covering it.  lbzip2 byte-aligns
+  the blocks it produces, but other compressors don't, hence bit offsets.
+
+  Entries are added in stream order by reorder tasks, while the scheduler
+  lock is held, and written out after the whole file has been processed.
+  With --range an index is read back and looked up to find which blocks
+  need to be decompressed.
+*/
+
+bool make_index;
+
+static struct index_entry *entries;
+static size_t num_entries;
+static size_t max_entries;
+static uint64_t total_size;     /* uncompressed size of indexed file */
+
+
+void
+index_reset(void)
+{
+  num_entries = 0;
+}
+
+
+void
+index_add(uint64_t bit_offset, uint64_t offset, uint32_t crc,
+          unsigned stream_bs100k)
+{
+  struct index_entry *e;
+
+  if (num_entries == max_entries)
+    entries = x2nrealloc(entries, &max_entries, sizeof(*entries));
+
+  e = &entries[num_entries++];
+  e->bit_offset = bit_offset;
+  e->offset = offset;
+  e->crc = crc;
+  e->bs100k = stream_bs100k;
+}
+
+
+static uint8_t *
+put_uint64(uint8_t *p, uint64_t x)
+{
+  unsigned i;
+
+  for (i = 0; i < 8; i++)
+    p[i] = x >> (56 - 8 * i);
+
+  return p + 8;
+}
+
+
+static uint8_t *
+put_uint32(uint8_t *p, uint32_t x)
+{
+  p[0] = x >> 24;
+  p[1] = (x >> 16) & 0xFF;
+  p[2] = (x >> 8) & 0xFF;
+  p[3] = x & 0xFF;
+
+  return p + 4;
+}
+
+
+/* Write the index to given file.  size is the total size of uncompressed
+   data. */
+void
+index_write(const struct filespec *spec, uint64_t size)
+{
+  uint8_t *buffer, *p;
+  size_t i, left;
+
+  left = INDEX_HEADER_SIZE + num_entries * INDEX_RECORD_SIZE;
+  buffer = xmalloc(left);
+
+  memcpy(buffer, INDEX_MAGIC, 8);
+  p = put_uint64(buffer + 8, num_entries);
+  p = put_uint64(p, size);
+
+  for (i = 0; i < num_entries; i++) {
+    p = put_uint64(p, entries[i].bit_offset);
+    p = put_uint64(p, entries[i].offset);
+    p = put_uint32(p, entries[i].crc);
+    p = put_uint32(p, entries[i].bs100k);
+  }
+
+  p = buffer;
+  while (left > 0) {
+    ssize_t wr;
+
+    wr = write(spec->fd, p, left > (size_t)SSIZE_MAX ?
+               (size_t)SSIZE_MAX : left);
+    if (-1 == wr)
+      failfx(spec, errno, "write()");
+
+    left -= (size_t)wr;
+    p += (size_t)wr;
+  }
+
+  free(buffer);
+}
+
+
+static uint64_t
+get_uint64(const uint8_t *p)
+{
+  uint64_t x = 0;
+  unsigned i;
+
+  for (i = 0; i < 8; i++)
+    x = (x << 8) | p[i];
+
+  return x;
+}
+
+
+static uint32_t
+get_uint32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+      ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+/* Read exactly size bytes.  Returns false on premature end of file. */
+static bool
+read_fully(const struct filespec *spec, void *vbuf, size_t size)
+{
+  char *buffer = vbuf;
+
+  while (size > 0) {
+    ssize_t rd;
+
+    rd = read(spec->fd, buffer, size > (size_t)SSIZE_MAX ?
+              (size_t)SSIZE_MAX : size);
+    if (-1 == rd)
+      failfx(spec, errno, "read()");
+    if (0 == rd)
+      return false;
+
+    size -= (size_t)rd;
+    buffer += (size_t)rd;
+  }
+
+  return true;
+}
+
+
+/* Read an index written by index_write(), replacing current entries.
+   Returns false if the file is not a valid index. */
+bool
+index_read(const struct filespec *spec)
+{
+  uint8_t header[INDEX_HEADER_SIZE];
+  uint8_t *buffer, *p;
+  uint64_t count;
+  size_t i, size;
+  struct stat st;
+  bool valid;
+
+  index_reset();
+
+  if (!read_fully(spec, header, INDEX_HEADER_SIZE) ||
+      0 != memcmp(header, INDEX_MAGIC, 8))
+    return false;
+
+  count = get_uint64(header + 8);
+  total_size = get_uint64(header + 16);
+
+  /* Check the record count against file size before trusting it with
+     memory allocation. */
+  if (-1 == fstat(spec->fd, &st))
+    failfx(spec, errno, "fstat()");
+  if (count > (SIZE_MAX - INDEX_HEADER_SIZE) / INDEX_RECORD_SIZE ||
+      (uintmax_t)st.st_size != INDEX_HEADER_SIZE + count * INDEX_RECORD_SIZE)
+    return false;
+
+  size = count * INDEX_RECORD_SIZE;
+  buffer = xmalloc(size + 1);
+  valid = read_fully(spec, buffer, size);
+
+  /* Blocks are never empty, so both offsets must strictly increase. */
+  for (i = 0, p = buffer; valid && i < count; i++, p += INDEX_RECORD_SIZE) {
+    uint64_t bit_offset = get_uint64(p);
+    uint64_t offset = get_uint64(p + 8);
+    uint32_t bs = get_uint32(p + 20);
+
+    if (bs < 1 || bs > 9 || offset >= total_size ||
+        (0 == i && 0 != offset) ||
+        (0 != i && (bit_offset <= entries[i - 1].bit_offset ||
+                    offset <= entries[i - 1].offset)))
+      valid = false;
+    else
+      index_add(bit_offset, offset, get_uint32(p + 16), bs);
+  }
+
+  free(buffer);
+  return valid;
+}
+
+
+/* Return the last entry at or after first whose block starts at or before
+   given uncompressed offset. */
+static size_t
+find_block(size_t first, uint64_t offset)
+{
+  size_t lo = first, hi = num_entries;
+
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (entries[mid].offset <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+
+/* Find blocks holding length bytes of uncompressed data starting at offset
+   and describe them in *p.  *bit_offset is set to the position of the first
+   of them in compressed file.  Returns false if there is nothing to
+   decompress. */
+bool
+index_lookup(uintmax_t offset, uintmax_t length, struct partial *p,
+             uint64_t *bit_offset)
+{
+  size_t first, last;
+  uint64_t end;
+
+  if (0 == num_entries || 0 == length || offset >= total_size)
+    return false;
+
+  end = (total_size - offset < length ? total_size : offset + length);
+  first = find_block(0, offset);
+  last = find_block(first, end - 1);
+
+  p->bs100k = entries[first].bs100k;
+  p->num_blocks = last - first + 1;
+  p->skip = offset - entries[first].offset;
+  p->length = end - offset;
+  *bit_offset = entries[first].bit_offset;
+
+  return true;
+}
+
+
+/* Find the block whose header starts at given bit offset and store block
+   size of its stream in *size100k.  Returns false if the index doesn't list
+   such block. */
+bool
+index_block_size(uint64_t bit_offset, unsigned *size100k)
+{
+  size_t lo = 0, hi = num_entries;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (entries[mid].bit_offset < bit_offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == num_entries || entries[lo].bit_offset != bit_offset)
+    return false;
+
+  *size100k = entries[lo].bs100k;
+  return true;
+}
@@ -0,0 +1,56 @@
+/*-
+  index.h -- block index header
+
+  Copyright (C) 2012, 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+  Block index file format.  All integers are big-endian.
+
+    8 bytes       magic "LBZIDX1\n"
+    8 bytes       number of blocks N
+    8 bytes       total uncompressed size
+    N * 24 bytes  block records, in stream order:
+      8 bytes       bit offset of block header magic in compressed file
+      8 bytes       offset of block contents in uncompressed data
+      4 bytes       block CRC
+      4 bytes       block size of containing stream, in units of 100 kB
+*/
+#define INDEX_MAGIC "LBZIDX1\n"
+#define INDEX_HEADER_SIZE 24u
+#define INDEX_RECORD_SIZE 24u
+
+struct index_entry {
+  uint64_t bit_offset;
+  uint64_t offset;
+  uint32_t crc;
+  unsigned bs100k;
+};
+
+
+extern bool make_index;         /* --index, --build-index */
+
+void index_reset(void);
+void index_add(uint64_t bit_offset, uint64_t offset, uint32_t crc,
+               unsigned stream_bs100k);
+void index_write(const struct filespec *spec, uint64_t size);
+bool index_read(const struct filespec *spec);
+bool index_lookup(uintmax_t offset, uintmax_t length, struct partial *p,
+                  uint64_t *bit_offset);
+bool index_block_size(uint64_t bit_offset, unsigned *size100k);
@@ -0,0 +1,117 @@
+/*-
+  lbzip2.h -- public interface of liblbzip2
+
+  Copyright (C) 2012, 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LBZIP2_H
+#define LBZIP2_H
+
+#include <stddef.h>             /* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+  liblbzip2 runs the same parallel compressor and decompressor as lbzip2
+  program, but reads input from and writes output to user-supplied callbacks
+  or memory buffers instead of files.
+
+  All parameters are kept in a context object, which can be used by one
+  thread at a time.  The engine itself keeps its state in process-wide
+  variables, so calls which actually (de)compress data are serialized
+  internally: while one of them runs, such calls made from other threads
+  block, whatever context they use.  Each call creates its own threads and
+  joins them before returning.
+
+  Link with the flags given by `pkg-config --libs liblbzip2'.
+
+  Callbacks are invoked from threads created by the library, but never
+  concurrently with each other.  They must not call back into the library.
+*/
+
+
+/* Return codes.  All failures are negative. */
+#define LBZIP2_OK             0
+#define LBZIP2_PARAM_ERROR   -1  /* invalid argument */
+#define LBZIP2_MEM_ERROR     -2  /* memory allocation failed */
+#define LBZIP2_DATA_ERROR    -3  /* input is not valid bzip2 data */
+#define LBZIP2_READ_ERROR    -4  /* read callback failed */
+#define LBZIP2_WRITE_ERROR   -5  /* write callback failed */
+#define LBZIP2_OUTBUF_FULL   -6  /* output does not fit in given buffer */
+#define LBZIP2_SYSTEM_ERROR  -7  /* thread creation failed etc. */
+
+
+struct lbzip2;
+
+/* Read callback.  Store up to size bytes in buf and return the number of
+   bytes stored, 0 at end of input or (size_t)-1 on error. */
+typedef size_t (*lbzip2_read_fn)(void *opaque, void *buf, size_t size);
+
+/* Write callback.  Consume size bytes from buf and return 0 on success or
+   any other value on error. */
+typedef int (*lbzip2_write_fn)(void *opaque, const void *buf, size_t size);
+
+
+/* Allocate a new context with default parameters: one worker per online
+   processor, 900k blocks and parallel block splitting.  Returns NULL if
+   there is not enough memory. */
+struct lbzip2 *lbzip2_new(void);
+
+/* Release a context.  NULL is accepted. */
+void lbzip2_free(struct lbzip2 *lz);
+
+/* Set the number of worker threads.  0 selects the number of online
+   processors. */
+int lbzip2_set_workers(struct lbzip2 *lz, unsigned workers);
+
+/* Set compression block size in units of 100k, from 1 to 9. */
+int lbzip2_set_block_size(struct lbzip2 *lz, int size100k);
+
+/* Find block boundaries sequentially, like the -u option of lbzip2. */
+int lbzip2_set_sequential(struct lbzip2 *lz, int sequential);
+
+
+/* Compress or decompress a whole stream, reading input with read and
+   writing output with write.  Decompression accepts concatenated bzip2
+   streams. */
+int lbzip2_compress(struct lbzip2 *lz, lbzip2_read_fn read,
+                    lbzip2_write_fn write, void *opaque);
+int lbzip2_decompress(struct lbzip2 *lz, lbzip2_read_fn read,
+                      lbzip2_write_fn write, void *opaque);
+
+/* Compress or decompress in_size bytes at in to the buffer at out.  On entry
+   *out_size is the size of output buffer, on successful return it is the
+   number of bytes stored. */
+int lbzip2_compress_buffer(struct lbzip2 *lz, const void *in, size_t in_size,
+                           void *out, size_t *out_size);
+int lbzip2_decompress_buffer(struct lbzip2 *lz, const void *in,
+                             size_t in_size, void *out, size_t *out_size);
+
+/* Describe the failure of the last call made with given context.  Returns
+   empty string if it succeeded. */
+const char *lbzip2_error(const struct lbzip2 *lz);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LBZIP2_H */
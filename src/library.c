@@ -0,0 +1,572 @@
+/*-
+  library.c -- liblbzip2 interface
+
+  Copyright (C) 2012, 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include <pthread.h>            /* pthread_mutex_t */
+#include <stdarg.h>             /* va_list */
+#include <stdio.h>              /* vsnprintf() */
+#include <string.h>             /* strerror() */
+#include <unistd.h>             /* sysconf() */
+
+#include "encode.h"             /* BWT_DIVSUFSORT */
+#include "main.h"               /* work() */
+#include "process.h"            /* run_protected() */
+
+#include "lbzip2.h"
+
+
+/*
+  The engine is driven by the same global variables as in the program.  They
+  are set from the context at the beginning of each call, and the engine
+  mutex makes sure that only one call uses them at a time, which makes the
+  library thread-safe, but not reentrant.  The engine
+  reports failures by calling fail() and friends, which here record the
+  error in the current context and unwind all threads.
+*/
+
+unsigned num_worker;
+bool decompress;
+unsigned bs100k;
+bool force;
+bool verbose;
+bool print_cctrs;
+bool small;
+bool ultra;
+int bwt_engine = BWT_DIVSUFSORT;
+struct partial partial;
+struct filespec ispec;
+struct filespec ospec;
+
+struct lbzip2 {
+  unsigned num_worker;          /* 0 means one per online processor */
+  unsigned bs100k;
+  bool ultra;
+  char error[256];
+};
+
+#define xlock(m)   ((void)(pthread_mutex_lock(m)   && (abort(), 0)))
+#define xunlock(m) ((void)(pthread_mutex_unlock(m) && (abort(), 0)))
+
+static pthread_mutex_t engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* State of the call in progress, protected by engine_mutex. */
+static struct lbzip2 *context;
+static lbzip2_read_fn read_fn;
+static lbzip2_write_fn write_fn;
+static void *opaque_arg;
+static int status;              /* code of the first failure, under
+                                   status_mutex */
+
+
+/* Logging utilities.  Output produced by the engine is discarded, except
+   failure messages, which are made available through lbzip2_error(). */
+
+void
+info(const char *fmt, ...)
+{
+  (void)fmt;
+}
+
+
+void
+display(const char *fmt, ...)
+{
+  (void)fmt;
+}
+
+
+static _Noreturn void fail_generic(int rc, const struct filespec *fs, int x,
+  const char *fmt, va_list args) __attribute__((format(printf, 4, 0)));
+
+static _Noreturn void
+fail_generic(int rc, const struct filespec *fs, int x, const char *fmt,
+  va_list args)
+{
+  xlock(&status_mutex);
+  if (status == LBZIP2_OK) {
+    char *msg = context->error;
+    size_t size = sizeof(context->error);
+    int len = 0;
+
+    status = rc;
+    if (fs != NULL)
+      len = snprintf(msg, size, "%s: ", fs->fmt);
+    if (len >= 0 && (size_t)len < size)
+      len += vsnprintf(msg + len, size - len, fmt, args);
+    if (x != 0 && len >= 0 && (size_t)len < size)
+      snprintf(msg + len, size - len, ": %s", strerror(x));
+  }
+  xunlock(&status_mutex);
+
+  unwind();
+}
+
+
+#define DEF(proto, rc, f, x)                    \
+  _Noreturn void proto                          \
+  {                                             \
+    va_list args;                               \
+                                                \
+    va_start(args, fmt);                        \
+    fail_generic(rc, f, x, fmt, args);          \
+  }
+
+DEF(fail   (                                 const char *fmt, ...),
+    LBZIP2_SYSTEM_ERROR, 0, 0)
+DEF(failf  (const struct filespec *f,        const char *fmt, ...),
+    LBZIP2_DATA_ERROR, f, 0)
+DEF(failx  (                          int x, const char *fmt, ...),
+    LBZIP2_SYSTEM_ERROR, 0, x)
+DEF(failfx (const struct filespec *f, int x, const char *fmt, ...),
+    LBZIP2_SYSTEM_ERROR, f, x)
+
+#undef DEF
+
+
+static _Noreturn void
+fail_rc(int rc, const char *msg)
+{
+  xlock(&status_mutex);
+  if (status == LBZIP2_OK) {
+    status = rc;
+    snprintf(context->error, sizeof(context->error), "%s", msg);
+  }
+  xunlock(&status_mutex);
+
+  unwind();
+}
+
+
+void
+xalloc_die(void)
+{
+  fail_rc(LBZIP2_MEM_ERROR, "memory exhausted");
+}
+
+
+/*
+  Memory tracking.  Every block allocated by the engine is preceded by a
+  chunk header, which links it into a list of live blocks.  After a failed
+  call the engine may still hold some blocks, which are then released all at
+  once.  The real allocation functions are called with their names in
+  parentheses, as common.h redirects them here.
+*/
+
+union chunk {
+  struct {
+    union chunk *prev;
+    union chunk *next;
+  } link;
+  long double align_ld;         /* keep alignment of returned memory */
+  uintmax_t align_u;
+  void *align_p;
+};
+
+static pthread_mutex_t chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static union chunk chunks = { { &chunks, &chunks } };
+
+
+static void
+link_chunk(union chunk *c)
+{
+  xlock(&chunk_mutex);
+  c->link.prev = &chunks;
+  c->link.next = chunks.link.next;
+  chunks.link.next->link.prev = c;
+  chunks.link.next = c;
+  xunlock(&chunk_mutex);
+}
+
+
+static void
+unlink_chunk(union chunk *c)
+{
+  xlock(&chunk_mutex);
+  c->link.prev->link.next = c->link.next;
+  c->link.next->link.prev = c->link.prev;
+  xunlock(&chunk_mutex);
+}
+
+
+/* Like realloc(), but for tracked blocks. */
+static void *
+track_realloc(void *ptr, size_t size)
+{
+  union chunk *c = NULL;
+  union chunk *n;
+
+  if (size > SIZE_MAX - sizeof(union chunk))
+    return NULL;
+
+  if (ptr != NULL) {
+    c = (union chunk *)ptr - 1;
+    unlink_chunk(c);
+  }
+
+  n = (realloc)(c, sizeof(union chunk) + size);
+  if (n == NULL) {
+    /* The old block, if any, is left intact. */
+    if (c != NULL)
+      link_chunk(c);
+    return NULL;
+  }
+
+  link_chunk(n);
+  return n + 1;
+}
+
+
+void *
+track_malloc(size_t size)
+{
+  return track_realloc(NULL, size);
+}
+
+
+void
+track_free(void *ptr)
+{
+  if (ptr != NULL) {
+    union chunk *c = (union chunk *)ptr - 1;
+
+    unlink_chunk(c);
+    (free)(c);
+  }
+}
+
+
+void *
+track_xnrealloc(void *ptr, size_t n, size_t size)
+{
+  if (size != 0 && n > SIZE_MAX / size)
+    xalloc_die();
+
+  ptr = track_realloc(ptr, n * size);
+  if (ptr == NULL)
+    xalloc_die();
+
+  return ptr;
+}
+
+
+/* Grow an array by about 50%, like x2nrealloc() from gnulib. */
+void *
+track_x2nrealloc(void *ptr, size_t *pn, size_t size)
+{
+  size_t n = *pn;
+
+  if (ptr == NULL && n == 0)
+    n = 64u / size + 1u;
+  else if (n > SIZE_MAX / 3u)
+    xalloc_die();
+  else
+    n += n / 2u + 1u;
+
+  ptr = track_xnrealloc(ptr, n, size);
+  *pn = n;
+
+  return ptr;
+}
+
+
+/* Release all blocks left behind by the engine.  All engine threads must
+   have been joined. */
+static void
+release_chunks(void)
+{
+  while (chunks.link.next != &chunks) {
+    union chunk *c = chunks.link.next;
+
+    chunks.link.next = c->link.next;
+    (free)(c);
+  }
+  chunks.link.prev = &chunks;
+}
+
+
+/* I/O through user callbacks. */
+
+void
+xread(void *vbuf, size_t *vacant)
+{
+  char *buffer = vbuf;
+
+  assert(*vacant > 0);
+
+  do {
+    size_t rd = read_fn(opaque_arg, buffer, *vacant);
+
+    if (rd == 0)
+      break;
+    if (rd > *vacant)
+      fail_rc(LBZIP2_READ_ERROR, "read callback failed");
+
+    *vacant -= rd;
+    buffer += rd;
+    ispec.total += rd;
+  }
+  while (*vacant > 0);
+}
+
+
+void
+xwrite(const void *vbuf, size_t size)
+{
+  if (size > 0) {
+    if (write_fn(opaque_arg, vbuf, size) != 0)
+      fail_rc(LBZIP2_WRITE_ERROR, "write callback failed");
+    ospec.total += size;
+  }
+}
+
+
+static void
+init_spec(struct filespec *spec, const char *fmt)
+{
+  spec->fd = -1;
+  spec->sep = "";
+  spec->fmt = fmt;
+  spec->total = 0;
+  spec->size = 0;
+}
+
+
+static int
+run(struct lbzip2 *lz, bool expand, lbzip2_read_fn read,
+    lbzip2_write_fn write, void *opaque)
+{
+  int rc;
+
+  if (lz == NULL || read == NULL || write == NULL)
+    return LBZIP2_PARAM_ERROR;
+
+  xlock(&engine_mutex);
+
+  context = lz;
+  read_fn = read;
+  write_fn = write;
+  opaque_arg = opaque;
+  status = LBZIP2_OK;
+  lz->error[0] = '\0';
+
+  num_worker = lz->num_worker;
+  if (num_worker == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long num_online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    num_worker = num_online > 0 ? min(num_online, UINT_MAX) : 1;
+#else
+    num_worker = 1;
+#endif
+  }
+  decompress = expand;
+  bs100k = lz->bs100k;
+  ultra = lz->ultra;
+  force = false;
+  verbose = false;
+  print_cctrs = false;
+  small = false;
+  init_spec(&ispec, "(input)");
+  init_spec(&ospec, "(output)");
+
+  /* A failure in another thread is noticed only after all threads have been
+     joined, so look at status rather than the value returned. */
+  (void)run_protected(work);
+  rc = status;
+
+  /* After failure some blocks may still be held in queues of the engine or
+     may have been dropped by unwound threads. */
+  if (rc != LBZIP2_OK)
+    release_chunks();
+
+  xunlock(&engine_mutex);
+
+  return rc;
+}
+
+
+struct lbzip2 *
+lbzip2_new(void)
+{
+  struct lbzip2 *lz = (malloc)(sizeof(struct lbzip2));
+
+  if (lz != NULL) {
+    lz->num_worker = 0;
+    lz->bs100k = 9;
+    lz->ultra = false;
+    lz->error[0] = '\0';
+  }
+
+  return lz;
+}
+
+
+void
+lbzip2_free(struct lbzip2 *lz)
+{
+  (free)(lz);
+}
+
+
+int
+lbzip2_set_workers(struct lbzip2 *lz, unsigned workers)
+{
+  if (lz == NULL)
+    return LBZIP2_PARAM_ERROR;
+
+  lz->num_worker = workers;
+  return LBZIP2_OK;
+}
+
+
+int
+lbzip2_set_block_size(struct lbzip2 *lz, int size100k)
+{
+  if (lz == NULL || size100k < 1 || size100k > 9)
+    return LBZIP2_PARAM_ERROR;
+
+  lz->bs100k = size100k;
+  return LBZIP2_OK;
+}
+
+
+int
+lbzip2_set_sequential(struct lbzip2 *lz, int sequential)
+{
+  if (lz == NULL)
+    return LBZIP2_PARAM_ERROR;
+
+  lz->ultra = (sequential != 0);
+  return LBZIP2_OK;
+}
+
+
+int
+lbzip2_compress(struct lbzip2 *lz, lbzip2_read_fn read,
+                lbzip2_write_fn write, void *opaque)
+{
+  return run(lz, false, read, write, opaque);
+}
+
+
+int
+lbzip2_decompress(struct lbzip2 *lz, lbzip2_read_fn read,
+                  lbzip2_write_fn write, void *opaque)
+{
+  return run(lz, true, read, write, opaque);
+}
+
+
+/* Memory buffers used by lbzip2_compress_buffer() and friend. */
+struct membuf {
+  const char *in;
+  size_t in_left;
+  char *out;
+  size_t out_left;
+  bool overflow;
+};
+
+
+static size_t
+read_mem(void *opaque, void *buf, size_t size)
+{
+  struct membuf *mb = opaque;
+
+  size = min(size, mb->in_left);
+  memcpy(buf, mb->in, size);
+  mb->in += size;
+  mb->in_left -= size;
+
+  return size;
+}
+
+
+static int
+write_mem(void *opaque, const void *buf, size_t size)
+{
+  struct membuf *mb = opaque;
+
+  if (size > mb->out_left) {
+    mb->overflow = true;
+    return -1;
+  }
+
+  memcpy(mb->out, buf, size);
+  mb->out += size;
+  mb->out_left -= size;
+
+  return 0;
+}
+
+
+static int
+run_mem(struct lbzip2 *lz, bool expand, const void *in, size_t in_size,
+        void *out, size_t *out_size)
+{
+  struct membuf mb;
+  int rc;
+
+  if (lz == NULL || (in == NULL && in_size > 0) || out_size == NULL ||
+      (out == NULL && *out_size > 0))
+    return LBZIP2_PARAM_ERROR;
+
+  mb.in = in;
+  mb.in_left = in_size;
+  mb.out = out;
+  mb.out_left = *out_size;
+  mb.overflow = false;
+
+  rc = run(lz, expand, read_mem, write_mem, &mb);
+
+  if (rc == LBZIP2_WRITE_ERROR && mb.overflow) {
+    rc = LBZIP2_OUTBUF_FULL;
+    snprintf(lz->error, sizeof(lz->error), "output buffer too small");
+  }
+  if (rc == LBZIP2_OK)
+    *out_size -= mb.out_left;
+
+  return rc;
+}
+
+
+int
+lbzip2_compress_buffer(struct lbzip2 *lz, const void *in, size_t in_size,
+                       void *out, size_t *out_size)
+{
+  return run_mem(lz, false, in, in_size, out, out_size);
+}
+
+
+int
+lbzip2_decompress_buffer(struct lbzip2 *lz, const void *in, size_t in_size,
+                         void *out, size_t *out_size)
+{
+  return run_mem(lz, true, in, in_size, out, out_size);
+}
+
+
+const char *
+lbzip2_error(const struct lbzip2 *lz)
+{
+  return lz != NULL ? lz->error : "invalid context";
+}
@@ -35,7 +35,10 @@
 #include "xalloc.h"             /* XMALLOC() */
 
 #include "signals.h"            /* setup_signals() */
+#include "encode.h"             /* BWT_DIVSUFSORT */
 #include "main.h"               /* pname */
+#include "index.h"              /* index_write() */
+#include "process.h"            /* xread() */
 
 
 unsigned num_worker;            /* -n */
@@ -48,6 +51,9 @@ bool verbose;                   /* -v */
 bool print_cctrs;               /* -S */
 bool small;                     /* -s */
 bool ultra;                     /* -u */
+int bwt_engine = BWT_DIVSUFSORT; /* --bwt */
+unsigned flush_interval;        /* --flush-interval */
+struct partial partial;         /* --range, --from-offset */
 struct filespec ispec;
 struct filespec ospec;
 
@@ -57,6 +63,12 @@ struct filespec ospec;
 static char *opathn;
 static const char *pname;
 static bool warned;
+static bool build_index;        /* --build-index */
+static bool range_given;        /* --range */
+static uintmax_t range_offset;
+static uintmax_t range_length;
+static bool offset_given;       /* --from-offset */
+static uintmax_t from_offset;
 
 
 /* Called just before abnormal program termination. */
@@ -199,47 +211,76 @@ xstrtol(const char *str, int source, uintmax_t lower, uintmax_t upper)
   To alter the message, simply edit and run pretty-usage.pl. It will patch
   the macro definition automatically.
 */
-#define USAGE_STRING "%s%s%s%s%s%s", "Usage:\n1. PROG [-n WTHRS] [-k|-c|-t] [-\
-d|-z] [-1 .. -9] [-f] [-v] [-S] {FILE}\n2. PROG -h|-V\n\nRecognized PROG names\
-:\n\n  bunzip2, lbunzip2  : Decompress. Forceable with `-d'.\n  bzcat, lbzcat \
-     : Decompress to stdout. Forceable with `-cd'.\n  <otherwise>        : Com\
-press. Forceable with `-z'.\n\nEnvironment variables:\n\n  LBZIP2, BZIP2,\n  B\
-ZIP               : Insert arguments between PROG and the rest of the\n       \
-                command line. Tokens are separated by spaces and tabs;\n      \
-                ", " no escaping.\n\nOptions:\n\n  -n WTHRS           : Set th\
-e number of (de)compressor threads to WTHRS, where\n                       WTH\
-RS is a positive integer.\n  -k, --keep         : Don't remove FILE operands. \
-Open regular input files\n                       with more than one link.\n  -\
-c, --stdout       : Write output to stdout even with FILE operands. Implies\n \
-                      `-k'. Incompatible with `-t'.\n  -t, --test         : Te\
-st decompression; discard output instead of writing it\n                ", "  \
-     to files or stdout. Implies `-k'. Incompatible with\n                    \
-   `-c'.\n  -d, --decompress   : Force decompression over the selection by PRO\
-G.\n  -z, --compress     : Force compression over the selection by PROG.\n  -1\
- .. -9           : Set the compression block size to 100K .. 900K.\n  --fast  \
-           : Alias for `-1'.\n  --best             : Alias for `-9'. This is t\
-he default.\n  -f, --force        : Open non-regular input files. Open input f\
-iles with more\n                       than one", " link. Try to remove each o\
-utput file before\n                       opening it. With `-cd' copy files no\
-t in bzip2 format.\n  -s, --small        : Reduce memory usage at cost of perf\
-ormance.\n  -u, --sequential   : Perform splitting input blocks sequentially. \
-This may\n                       improve compression ratio and decrease CPU us\
-age, but\n                       will degrade scalability.\n  -v, --verbose   \
-   : Log each (de)compression start to stderr. Display\n                      \
- compression ratio an", "d space savings. Display progress\n                  \
-     information if stderr is connected to a terminal.\n  -S                 :\
- Print condition variable statistics to stderr.\n  -q, --quiet,\n  --repetitiv\
-e-fast,\n  --repetitive-best,\n  --exponential      : Accepted for compatibili\
-ty, otherwise ignored.\n  -h, --help         : Print this help to stdout and e\
-xit.\n  -L, --license, -V,\n  --version          : Print version information t\
-o stdout and exit.\n\nOperands:\n\n  FILE               : Specify files to com\
-p", "ress or decompress. If no FILE is\n                       given, work as \
-a filter. FILEs with `.bz2', `.tbz',\n                       `.tbz2' and `.tz2\
-' name suffixes will be skipped when\n                       compressing. When\
- decompressing, `.bz2' suffixes will be\n                       removed in out\
-put filenames; `.tbz', `.tbz2' and `.tz2'\n                       suffixes wil\
-l be replaced by `.tar'; other filenames\n                       will be suffi\
-xed with `.out'.\n"
+#define USAGE_STRING "%s%s%s%s%s%s%s%s%s%s%s", "Usage:\n1. PROG [-n WTHRS] [-k\
+|-c|-t] [-d|-z] [-1 .. -9] [-f] [-v] [-S]\n   [--bwt=ENGINE] [--flush-interval\
+=MS] [--index] {FILE}\n2. PROG --build-index {FILE}\n3. PROG [-n WTHRS] [-t] -\
+-range=OFFSET:LENGTH|--from-offset=OFFSET FILE\n   {FILE}\n4. PROG -h|-V\n\nRe\
+cognized PROG names:\n\n  bunzip2, lbunzip2  : Decompress. Forceable with `-d'\
+.\n  bzcat, lbzcat      : Decompress to stdout. Forceable with `-cd'.\n  <othe\
+rwise>        : Compress. Forceable with `-z'.\n\nEnvironment variables:\n\n  \
+LBZIP2, BZIP2,\n  BZIP      ", "         : Insert arguments between PROG and t\
+he rest of the\n                       command line. Tokens are separated by s\
+paces and tabs;\n                       no escaping.\n\nOptions:\n\n  -n WTHRS\
+           : Set the number of (de)compressor threads to WTHRS, where\n       \
+                WTHRS is a positive integer.\n  -k, --keep         : Don't rem\
+ove FILE operands. Open regular input files\n                       with more \
+than one link.\n  -c, --stdout       : Write output to stdout even with FILE o\
+peran", "ds. Implies\n                       `-k'. Incompatible with `-t'.\n  \
+-t, --test         : Test decompression; discard output instead of writing it\
+\n                       to files or stdout. Implies `-k'. Incompatible with\n\
+                       `-c'.\n  -d, --decompress   : Force decompression over \
+the selection by PROG.\n  -z, --compress     : Force compression over the sele\
+ction by PROG.\n  -1 .. -9           : Set the compression block size to 100K \
+.. 900K.\n  --fast             : Alias for `-1'.\n  --best  ", "           : A\
+lias for `-9'. This is the default.\n  -f, --force        : Open non-regular i\
+nput files. Open input files with more\n                       than one link. \
+Try to remove each output file before\n                       opening it. With\
+ `-cd' copy files not in bzip2 format.\n  -s, --small        : Reduce memory u\
+sage at cost of performance.\n  -u, --sequential   : Perform splitting input b\
+locks sequentially. This may\n                       improve compression ratio\
+ and decrease CPU usage. Only\n   ", "                    finding block bounda\
+ries is done sequentially, so\n                       scalability is degraded \
+only slightly.\n  --bwt=ENGINE       : Select the block sorting engine used fo\
+r compression.\n                       ENGINE is one of `divsufsort' (the defa\
+ult), `sais'\n                       (linear time induced sorting, slower on a\
+verage but not\n                       susceptible to highly repetitive input)\
+ or `auto'\n                       (choose per block, with the same output as\
+\n       ", "                `divsufsort').\n  --flush-interval=M\n  S        \
+          : When compressing, end a block early if it was not filled\n        \
+               within MS milliseconds of reading its first byte. This\n       \
+                bounds the delay of compressed output when input is\n         \
+              slow. 0 (the default) disables flushing.\n  --index            :\
+ When compressing FILE operands, also write a block index\n                   \
+    for each compressed file to a file named like it with\n   ", "            \
+        `.idx' appended. The index allows extracting parts of\n               \
+        the file without decompressing all of it.\n  --build-index      : Buil\
+d block indexes for existing bzip2 files. Each FILE\n                       is\
+ decompressed, discarding output, and its index is\n                       wri\
+tten to FILE with `.idx' appended. Without FILE\n                       operan\
+ds the index of stdin is written to stdout.\n  --range=OFFSET:LEN\n  GTH      \
+          : Decompress LENGTH bytes ", "of data starting at OFFSET from\n     \
+                  each FILE to stdout, using the index written by\n           \
+            `--index' or `--build-index'. Only blocks covering the\n          \
+             range are read and decompressed.\n  --from-offset=OFFS\n  ET     \
+            : Decompress each FILE to stdout starting from the first\n        \
+               block found after byte OFFSET of compressed data. No\n         \
+              index is needed. Stream CRC of the first stream can't be\n      \
+           ", "      verified, which is warned about.\n  -v, --verbose      : \
+Log each (de)compression start to stderr. Display\n                       comp\
+ression ratio and space savings. Display progress\n                       info\
+rmation if stderr is connected to a terminal.\n  -S                 : Print in\
+ternal statistics to stderr.\n  -q, --quiet,\n  --repetitive-fast,\n  --repeti\
+tive-best,\n  --exponential      : Accepted for compatibility, otherwise ignor\
+ed.\n  -h, --help         : Print this help to stdout and exit.\n ", " -L, --l\
+icense, -V,\n  --version          : Print version information to stdout and ex\
+it.\n\nOperands:\n\n  FILE               : Specify files to compress or decomp\
+ress. If no FILE is\n                       given, work as a filter. FILEs wit\
+h `.bz2', `.tbz',\n                       `.tbz2' and `.tz2' name suffixes wil\
+l be skipped when\n                       compressing. When decompressing, `.b\
+z2' suffixes will be\n                       removed in output filenames; `.tb\
+z', `.tbz2' and `.tz2'\n                   ", "    suffixes will be replaced b\
+y `.tar'; other filenames\n                       will be suffixed with `.out'\
+.\n"
 
 #define HELP_STRING "%s version %s\n%s\n\n%s%s",                        \
     PACKAGE_NAME, PACKAGE_VERSION, "http://lbzip2.org/",                \
@@ -444,6 +485,67 @@ opts_setup(struct arg **operands, size_t argc, char **argv)
           else if (0 == strcmp("sequential", argscan)) {
             ultra = 1;
           }
+          else if (0 == strncmp("bwt=", argscan, 4)) {
+            if (0 == strcmp("divsufsort", argscan + 4))
+              bwt_engine = BWT_DIVSUFSORT;
+            else if (0 == strcmp("sais", argscan + 4))
+              bwt_engine = BWT_SAIS;
+            else if (0 == strcmp("auto", argscan + 4))
+              bwt_engine = BWT_AUTO;
+            else
+              fail("invalid block sorting engine \"%s\", specify \"-h\""
+                   " for help", argscan + 4);
+          }
+          else if (0 == strncmp("flush-interval=", argscan, 15)) {
+            const char *val = argscan + 15;
+            char *endptr;
+            unsigned long ms;
+
+            errno = 0;
+            ms = strtoul(val, &endptr, 10);
+            if (*val < '0' || *val > '9' || *endptr != '\0' || 0 != errno ||
+                ms > 86400000ul)
+              fail("invalid flush interval \"%s\", specify \"-h\""
+                   " for help", val);
+            flush_interval = ms;
+          }
+          else if (0 == strcmp("index", argscan)) {
+            make_index = 1;
+          }
+          else if (0 == strcmp("build-index", argscan)) {
+            make_index = 1;
+            build_index = 1;
+          }
+          else if (0 == strncmp("range=", argscan, 6)) {
+            const char *val = argscan + 6;
+            char *endptr;
+            bool valid;
+
+            errno = 0;
+            range_offset = strtoumax(val, &endptr, 10);
+            valid = (*val >= '0' && *val <= '9' && ':' == *endptr);
+            if (valid) {
+              val = endptr + 1;
+              range_length = strtoumax(val, &endptr, 10);
+              valid = (*val >= '0' && *val <= '9' && '\0' == *endptr &&
+                       0 == errno);
+            }
+            if (!valid)
+              fail("invalid range \"%s\", specify \"-h\" for help",
+                   argscan + 6);
+            range_given = 1;
+          }
+          else if (0 == strncmp("from-offset=", argscan, 12)) {
+            const char *val = argscan + 12;
+            char *endptr;
+
+            errno = 0;
+            from_offset = strtoumax(val, &endptr, 10);
+            if (*val < '0' || *val > '9' || *endptr != '\0' || 0 != errno ||
+                from_offset > UINTMAX_MAX / 8u)
+              fail("invalid offset \"%s\", specify \"-h\" for help", val);
+            offset_given = 1;
+          }
           else if (0 == strcmp("verbose", argscan)) {
             verbose = 1;
           }
@@ -592,6 +694,45 @@ opts_setup(struct arg **operands, size_t argc, char **argv)
 
 
   /* Finalize options. */
+  if (range_given || offset_given) {
+    const char *opt = range_given ? "--range" : "--from-offset";
+
+    /* Input is positioned in FILE operands and output is written to stdout,
+       unless testing. */
+    if (range_given && offset_given) {
+      fail("\"--range\" and \"--from-offset\" are incompatible, specify"
+           " \"-h\" for help");
+    }
+    if (make_index) {
+      fail("\"%s\" and \"--index\" are incompatible, specify \"-h\""
+           " for help", opt);
+    }
+    if (0 == *operands) {
+      fail("\"%s\" requires FILE operands, specify \"-h\" for help", opt);
+    }
+    decompress = 1;
+    if (OM_REGF == outmode) {
+      outmode = OM_STDOUT;
+    }
+  }
+  else if (build_index) {
+    /* Index is built by decompressing files and discarding output. */
+    if (OM_STDOUT == outmode) {
+      fail("\"--build-index\" and \"-c\" are incompatible, specify \"-h\""
+           " for help");
+    }
+    outmode = OM_DISCARD;
+    decompress = 1;
+    if (0 == *operands && isatty(STDOUT_FILENO)) {
+      fail("won't write index to a terminal, specify \"-h\" for help");
+    }
+  }
+  else if (make_index && (decompress || OM_REGF != outmode ||
+                          0 == *operands)) {
+    fail("\"--index\" requires compressing FILE operands to files, specify"
+         " \"-h\" for help");
+  }
+
   if (OM_REGF == outmode && 0 == *operands) {
     outmode = OM_STDOUT;
   }
@@ -863,6 +1004,264 @@ output_init(const struct arg *operand, const struct stat *sbuf)
 }
 
 
+/* Return the name of index file of compressed file "cpathn". */
+static char *
+index_pathn(const char *cpathn)
+{
+  char *tmp;
+  size_t len;
+
+  len = strlen(cpathn);
+  if (SIZE_MAX - sizeof ".idx" < len) {
+    fail("\"%s\": size_t overflow in index_pathn\n", cpathn);
+  }
+  tmp = xmalloc(len + sizeof ".idx");
+  (void)memcpy(tmp, cpathn, len);
+  (void)strcpy(tmp + len, ".idx");
+
+  return tmp;
+}
+
+
+/*
+  Write the block index collected while processing the current operand.  It
+  is stored next to the compressed file, whose name is "cpathn", with ".idx"
+  appended, or written to stdout if "cpathn" is NULL.
+*/
+static void
+index_output(const char *cpathn, uintmax_t size)
+{
+  struct filespec spec;
+  char *tmp;
+
+  if (0 == cpathn) {
+    spec.fd = STDOUT_FILENO;
+    spec.sep = "";
+    spec.fmt = "stdout";
+    index_write(&spec, size);
+    return;
+  }
+
+  tmp = index_pathn(cpathn);
+
+  if (force && -1 == unlink(tmp) && ENOENT != errno) {
+    infox(errno, "unlink(\"%s\")", tmp);
+  }
+
+  spec.fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR |
+                 S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  if (-1 == spec.fd) {
+    warnx(errno, "skipping index for \"%s\": open(\"%s\")", cpathn, tmp);
+  }
+  else {
+    spec.sep = "\"";
+    spec.fmt = tmp;
+    index_write(&spec, size);
+    if (-1 == close(spec.fd)) {
+      failx(errno, "close(\"%s\")", tmp);
+    }
+  }
+
+  free(tmp);
+}
+
+
+/*
+  Read the index of the current operand, whose name is "cpathn", from
+  "cpathn" with ".idx" appended.  Unless "quiet", failure to read it is
+  warned about.  Return false if there is no valid index.
+*/
+static bool
+index_input(const char *cpathn, bool quiet)
+{
+  struct filespec spec;
+  char *tmp;
+  bool valid;
+
+  tmp = index_pathn(cpathn);
+  spec.fd = open(tmp, O_RDONLY | O_NOCTTY);
+  if (-1 == spec.fd) {
+    if (!quiet) {
+      warnx(errno, "skipping \"%s\": open(\"%s\")", cpathn, tmp);
+    }
+    free(tmp);
+    return 0;
+  }
+
+  spec.sep = "\"";
+  spec.fmt = tmp;
+  valid = index_read(&spec);
+  if (!valid && !quiet) {
+    warn("skipping \"%s\": \"%s\" is not a valid index", cpathn, tmp);
+  }
+  if (-1 == close(spec.fd)) {
+    failx(errno, "close(\"%s\")", tmp);
+  }
+  free(tmp);
+
+  return valid;
+}
+
+
+/*
+  Prepare decompression of the range given with --range from the current
+  operand, whose name is "cpathn".  The index is read from "cpathn" with
+  ".idx" appended and input is positioned at the first block of the range.
+
+  Return -1 if there is nothing to decompress, either because of an error or
+  because the range lies beyond the end of data.  Otherwise return 0.
+*/
+static int
+range_init(const char *cpathn)
+{
+  uint64_t bit_offset;
+
+  partial.enabled = 0;
+
+  if (!index_input(cpathn, 0) ||
+      !index_lookup(range_offset, range_length, &partial, &bit_offset)) {
+    return -1;
+  }
+
+  if (-1 == lseek(ispec.fd, (off_t)(bit_offset / 8u), SEEK_SET)) {
+    warnx(errno, "skipping \"%s\": lseek()", cpathn);
+    return -1;
+  }
+
+  partial.skip_bits = bit_offset % 8u;
+  partial.enabled = 1;
+  return 0;
+}
+
+
+/* Number of bytes preceding a block found with --from-offset which are
+   searched for the header of its stream. */
+#define HEADER_WINDOW (4u * 1024u * 1024u)
+
+
+/*
+  Search "size" bytes at "buffer" backwards for a stream header immediately
+  followed by block magic, as found at the beginning of every stream.
+  Return the block size of the last such stream, or 0 if there is none.
+*/
+static unsigned
+find_stream_header(const uint8_t *buffer, size_t size)
+{
+  static const uint8_t magic[6] = { 0x31, 0x41, 0x59, 0x26, 0x53, 0x59 };
+  size_t pos;
+
+  for (pos = size; pos >= 10u; pos--) {
+    const uint8_t *p = buffer + pos - 10u;
+
+    if ('B' == p[0] && 'Z' == p[1] && 'h' == p[2] && p[3] >= '1' &&
+        p[3] <= '9' && 0 == memcmp(p + 4, magic, sizeof magic)) {
+      return p[3] - '0';
+    }
+  }
+
+  return 0u;
+}
+
+
+/*
+  Find the block size of the stream containing the block at "bit_offset" of
+  the current operand, whose name is "cpathn".  It is taken from the index
+  of the operand if there is one listing the block.  Otherwise the nearest
+  stream header within HEADER_WINDOW bytes before the block is used, and
+  failing that, the header at the beginning of the file, as streams
+  concatenated into one file are normally compressed alike.
+
+  Return 0 if no stream header was found.
+*/
+static unsigned
+offset_bs100k(const char *cpathn, uintmax_t bit_offset)
+{
+  uint8_t *buffer;
+  uintmax_t start, end;
+  size_t vacant, size;
+  unsigned found;
+
+  if (index_input(cpathn, 1) && index_block_size(bit_offset, &found)) {
+    return found;
+  }
+
+  /* Include block magic of the block itself, which may be the first one of
+     its stream. */
+  end = bit_offset / 8u + 6u;
+  start = (end > HEADER_WINDOW ? end - HEADER_WINDOW : 0u);
+  size = end - start;
+  buffer = xmalloc(size);
+  found = 0u;
+
+  if (-1 != lseek(ispec.fd, (off_t)start, SEEK_SET)) {
+    vacant = size;
+    xread(buffer, &vacant);
+    found = find_stream_header(buffer, size - vacant);
+
+    if (0u == found && 0u != start && -1 != lseek(ispec.fd, 0, SEEK_SET)) {
+      vacant = 10u;
+      xread(buffer, &vacant);
+      found = find_stream_header(buffer, 10u - vacant);
+    }
+  }
+
+  free(buffer);
+  return found;
+}
+
+
+/*
+  Prepare decompression from the first block found after byte "from_offset"
+  of the current operand, whose name is "cpathn", as requested with
+  --from-offset.  Blocks preceding that point are not seen, so the CRC of
+  the stream entered can't be verified, which is warned about.  Its block
+  size is found with offset_bs100k().
+
+  Return -1 if there is nothing to decompress, otherwise return 0.
+*/
+static int
+offset_init(const char *cpathn)
+{
+  uintmax_t bit_offset;
+
+  partial.enabled = 0;
+
+  if (-1 == lseek(ispec.fd, (off_t)from_offset, SEEK_SET)) {
+    warnx(errno, "skipping \"%s\": lseek()", cpathn);
+    return -1;
+  }
+  if (!locate_block(&bit_offset)) {
+    warn("skipping \"%s\": no compressed block found after offset %ju",
+         cpathn, from_offset);
+    return -1;
+  }
+
+  bit_offset += 8u * from_offset;
+  partial.bs100k = offset_bs100k(cpathn, bit_offset);
+  if (0u == partial.bs100k) {
+    warn("skipping \"%s\": no stream header found before block at bit %ju",
+         cpathn, bit_offset);
+    return -1;
+  }
+
+  if (-1 == lseek(ispec.fd, (off_t)(bit_offset / 8u), SEEK_SET)) {
+    warnx(errno, "skipping \"%s\": lseek()", cpathn);
+    return -1;
+  }
+  ispec.total = 0u;
+
+  partial.enabled = 1;
+  partial.skip_bits = bit_offset % 8u;
+  partial.num_blocks = UINTMAX_MAX;
+  partial.skip = 0u;
+  partial.length = UINTMAX_MAX;
+
+  warnf(&ispec, "decompressing from block at bit %ju, stream CRC will not"
+        " be verified", bit_offset);
+  return 0;
+}
+
+
 static void
 output_regf_uninit(int outfd, const struct stat *sbuf)
 {
@@ -930,9 +1329,18 @@ main(int argc, char **argv)
       ret = input_init(operands, &instat);
       if (-1 != ret) {
         cli();
-        if (-1 != output_init(operands, &instat)) {
+        if (-1 != output_init(operands, &instat)
+            && (!range_given || -1 != range_init(operands->val))
+            && (!offset_given || -1 != offset_init(operands->val))) {
           work();
 
+          if (build_index) {
+            index_output(operands != 0 ? operands->val : 0, ospec.total);
+          }
+          else if (make_index) {
+            index_output(opathn, ispec.total);
+          }
+
           if (OM_REGF == outmode) {
             output_regf_uninit(ospec.fd, &instat);
             if (!keep) {
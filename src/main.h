@@ -44,6 +44,22 @@ struct filespec {
 };
 
 
+/*
+  Decompression of a part of the input, as requested by --range or
+  --from-offset.  Input is positioned in the middle of a stream, just before
+  a block header, instead of at the start of a stream.  Output is trimmed to
+  the requested range.
+*/
+struct partial {
+  bool enabled;
+  unsigned skip_bits;           /* bits to skip before first block header */
+  unsigned bs100k;              /* block size of the stream entered */
+  uintmax_t num_blocks;         /* number of blocks to decompress */
+  uintmax_t skip;               /* number of output bytes to drop */
+  uintmax_t length;             /* number of output bytes to keep */
+};
+
+
 extern unsigned num_worker;     /* -n */
 extern size_t max_mem;          /* -m */
 extern bool decompress;         /* -d */
@@ -54,6 +70,9 @@ extern bool verbose;            /* -v */
 extern bool print_cctrs;        /* -S */
 extern bool small;              /* -s */
 extern bool ultra;              /* -u */
+extern int bwt_engine;          /* --bwt */
+extern unsigned flush_interval; /* --flush-interval */
+extern struct partial partial;  /* --range, --from-offset */
 extern struct filespec ispec;
 extern struct filespec ospec;
 
@@ -86,3 +105,9 @@ void display(const char *fmt, ...)
   __attribute__((format(printf, 1, 2)));
 
 void work(void);
+
+/* Find the first compressed block in input stream, reading it from current
+   position.  On success store the offset of block header in bits, relative
+   to the starting position, and return true.  Return false if end of file
+   was reached without finding any block.  Thread-unsafe. */
+bool locate_block(uintmax_t *bit_offset);
@@ -72,6 +72,10 @@
 #include "common.h"             /* OK */
 
 #include <arpa/inet.h>          /* htonl() */
+#include <string.h>             /* memcmp() */
+#ifdef __SSE2__
+#include <emmintrin.h>          /* _mm_cmpeq_epi8() */
+#endif
 
 #include "decode.h"             /* bits_need() */
 
@@ -127,6 +131,20 @@ parser_init(struct parser_state *ps, int bs100k, int stream_mode)
   ps->bs100k = bs100k;
   ps->computed_crc = 0u;
   ps->stream_mode = stream_mode;
+  ps->skip = 0u;
+  ps->partial = false;
+}
+
+
+/* Prepare parser for starting in the middle of a stream, skip bits before
+   the next block header.  Blocks of the current stream preceding that point
+   are never seen, so its CRC can't be verified. */
+void
+parser_resume(struct parser_state *ps, unsigned skip)
+{
+  assert(skip < 32u);
+  ps->skip = skip;
+  ps->partial = true;
 }
 
 
@@ -149,6 +167,15 @@ parse(struct parser_state *restrict ps, struct header *restrict hd,
 {
   assert(ps->state != ACCEPT);
 
+  if (ps->skip > 0u) {
+    int rv = bits_need(bs, ps->skip);
+
+    if (OK != rv)
+      return FINISH == rv ? ERR_EOF : MORE;
+    bits_dump(bs, ps->skip);
+    ps->skip = 0u;
+  }
+
   while (OK == bits_need(bs, 16)) {
     unsigned word = bits_peek(bs, 16);
 
@@ -234,8 +261,9 @@ parse(struct parser_state *restrict ps, struct header *restrict hd,
 
     case EOS_CRC_2:
       ps->stored_crc = (ps->stored_crc << 16) | word;
-      if (ps->stored_crc != ps->computed_crc)
+      if (ps->stored_crc != ps->computed_crc && !ps->partial)
         return ERR_STRMCRC;
+      ps->partial = false;
       if (ps->stream_mode) {
         ps->state = ACCEPT;
         *garbage = 0;
@@ -271,6 +299,70 @@ parse(struct parser_state *restrict ps, struct header *restrict hd,
 }
 
 
+#ifdef __SSE2__
+
+/* Block magic starting at bit k of a byte (k = 0..7) contains two whole
+   bytes, which are given below.  For k = 0 these are the first 2 bytes of
+   the magic, otherwise the 2 bytes following the one in which the magic
+   starts.  All 8 pairs are different.
+*/
+static const uint8_t magic_pair[8][2] = {
+  { 0x31, 0x41 }, { 0xA0, 0xAC }, { 0x50, 0x56 }, { 0x28, 0x2B },
+  { 0x14, 0x15 }, { 0x8A, 0x0A }, { 0xC5, 0x05 }, { 0x62, 0x82 },
+};
+
+static const uint8_t magic_bytes[6] = { 0x31, 0x41, 0x59, 0x26, 0x53, 0x59 };
+
+/* Find the first position in p[0..n) at which any of magic_pair[] begins.
+   All 8 bit alignments are checked in parallel, 64 bytes at a time.
+   Return that position, or the position where search was stopped
+   (at most n) if there is no pair before it. */
+static size_t
+find_pair(const uint8_t *p, size_t n)
+{
+  __m128i a[8], b[8];
+  size_t i;
+  unsigned k;
+
+  for (k = 0; k < 8; k++) {
+    a[k] = _mm_set1_epi8((char)magic_pair[k][0]);
+    b[k] = _mm_set1_epi8((char)magic_pair[k][1]);
+  }
+
+  for (i = 0; i + 65 <= n; i += 64) {
+    unsigned j;
+
+    for (j = 0; j < 64; j += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *)(p + i + j));
+      __m128i y = _mm_loadu_si128((const __m128i *)(p + i + j + 1));
+      __m128i m = _mm_setzero_si128();
+      unsigned mask;
+
+      for (k = 0; k < 8; k++)
+        m = _mm_or_si128(m, _mm_and_si128(_mm_cmpeq_epi8(x, a[k]),
+                                          _mm_cmpeq_epi8(y, b[k])));
+
+      mask = _mm_movemask_epi8(m);
+      if (mask != 0) {
+#if GNUC_VERSION >= 30406
+        return i + j + __builtin_ctz(mask);
+#else
+        unsigned bit;
+
+        for (bit = 0; (mask & 1) == 0; bit++)
+          mask >>= 1;
+        return i + j + bit;
+#endif
+      }
+    }
+  }
+
+  return i;
+}
+
+#endif /* __SSE2__ */
+
+
 /* Scan for magic bit sequence which presence indicates probable start of
    compressed block.
 
@@ -318,8 +410,46 @@ again:
   limit = bs->limit;
 
   while (data < limit) {
-    unsigned bt_state = state;
-    uint32_t word = *data;
+    unsigned bt_state;
+    uint32_t word;
+
+#ifdef __SSE2__
+    /* In state 0 there is no partial match, so any magic found later
+       starts at or after data.  Each one contains a pair of bytes from
+       magic_pair[], starting at most one byte after the magic does.
+       The automaton can resume in state 0 from the word containing
+       the byte preceding the first such pair.  Blocks made by lbzip2
+       are byte-aligned, so if the pair starts the whole magic then the
+       bit position is known exactly and the automaton is not needed. */
+    if (state == 0u) {
+      const uint8_t *p = (const uint8_t *)data;
+      size_t pos = find_pair(p, 4u * (limit - data));
+
+      if (pos + 6u <= 4u * (size_t)(limit - data) &&
+          memcmp(p + pos, magic_bytes, 6) == 0) {
+        pos += 6u;
+        bs->data = data + pos / 4u;
+        bs->buff = 0u;
+        bs->live = 0u;
+        (void)bits_need(bs, 1u);
+        bits_dump(bs, 8u * (pos % 4u));
+        if (bits_need(bs, 32) == OK) {
+          bits_dump(bs, 32);
+          return OK;
+        }
+        else {
+          bits_consume(bs);
+          return MORE;
+        }
+      }
+
+      if (pos > 0u)
+        data += (pos - 1u) / 4u;
+    }
+#endif
+
+    bt_state = state;
+    word = *data;
 
     word = ntohl(word);
     state = big_dfa[state][word >> 24];
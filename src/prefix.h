@@ -0,0 +1,114 @@
+/*-
+  prefix.h -- names of library internals
+
+  Copyright (C) 2012, 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  liblbzip2 is linked into programs which may well have their own globals
+  called verbose, decode or fail.  All external names of the engine are
+  therefore prefixed with "lbzip2__" in the library, so that only names
+  declared in lbzip2.h are left in the user's name space.  When adding an
+  external function or variable to the engine, add it here too.
+*/
+
+#define bs100k                lbzip2__bs100k
+#define bwt_engine            lbzip2__bwt_engine
+#define collect               lbzip2__collect
+#define compression           lbzip2__compression
+#define crc_run_table         lbzip2__crc_run_table
+#define crc_table             lbzip2__crc_table
+#define crc_zero_table        lbzip2__crc_zero_table
+#define decode                lbzip2__decode
+#define decode_join           lbzip2__decode_join
+#define decode_segment        lbzip2__decode_segment
+#define decode_split          lbzip2__decode_split
+#define decode_walk           lbzip2__decode_walk
+#define decoder_alloc_size    lbzip2__decoder_alloc_size
+#define decoder_init          lbzip2__decoder_init
+#define decompress            lbzip2__decompress
+#define display               lbzip2__display
+#define divbwt                lbzip2__divbwt
+#define divbwt_small          lbzip2__divbwt_small
+#define down_heap             lbzip2__down_heap
+#define emit                  lbzip2__emit
+#define encode                lbzip2__encode
+#define encoder_alloc_size    lbzip2__encoder_alloc_size
+#define encoder_init          lbzip2__encoder_init
+#define eof                   lbzip2__eof
+#define expansion             lbzip2__expansion
+#define fail                  lbzip2__fail
+#define failf                 lbzip2__failf
+#define failfx                lbzip2__failfx
+#define failx                 lbzip2__failx
+#define force                 lbzip2__force
+#define generate_prefix_code  lbzip2__generate_prefix_code
+#define in_granul             lbzip2__in_granul
+#define in_slots              lbzip2__in_slots
+#define in_weight             lbzip2__in_weight
+#define index_add             lbzip2__index_add
+#define index_block_size      lbzip2__index_block_size
+#define index_lookup          lbzip2__index_lookup
+#define index_read            lbzip2__index_read
+#define index_reset           lbzip2__index_reset
+#define index_write           lbzip2__index_write
+#define info                  lbzip2__info
+#define ispec                 lbzip2__ispec
+#define locate_block          lbzip2__locate_block
+#define make_index            lbzip2__make_index
+#define num_worker            lbzip2__num_worker
+#define ospec                 lbzip2__ospec
+#define out_granul            lbzip2__out_granul
+#define out_slots             lbzip2__out_slots
+#define parse                 lbzip2__parse
+#define parser_init           lbzip2__parser_init
+#define parser_resume         lbzip2__parser_resume
+#define partial               lbzip2__partial
+#define print_cctrs           lbzip2__print_cctrs
+#define retrieve              lbzip2__retrieve
+#define retrieve_check        lbzip2__retrieve_check
+#define run_protected         lbzip2__run_protected
+#define saisbwt               lbzip2__saisbwt
+#define scan                  lbzip2__scan
+#define scan_block            lbzip2__scan_block
+#define scan_init             lbzip2__scan_init
+#define sched_lock            lbzip2__sched_lock
+#define sched_unlock          lbzip2__sched_unlock
+#define sink_write_buffer     lbzip2__sink_write_buffer
+#define small                 lbzip2__small
+#define source_close          lbzip2__source_close
+#define source_release_buffer lbzip2__source_release_buffer
+#define source_release_slots  lbzip2__source_release_slots
+#define total_in_slots        lbzip2__total_in_slots
+#define total_out_slots       lbzip2__total_out_slots
+#define track_free            lbzip2__track_free
+#define track_malloc          lbzip2__track_malloc
+#define track_x2nrealloc      lbzip2__track_x2nrealloc
+#define track_xnrealloc       lbzip2__track_xnrealloc
+#define transmit              lbzip2__transmit
+#define tree_cache_alloc_size lbzip2__tree_cache_alloc_size
+#define tree_cache_init       lbzip2__tree_cache_init
+#define ultra                 lbzip2__ultra
+#define unwind                lbzip2__unwind
+#define up_heap               lbzip2__up_heap
+#define verbose               lbzip2__verbose
+#define work                  lbzip2__work
+#define work_units            lbzip2__work_units
+#define xalloc_die            lbzip2__xalloc_die
+#define xread                 lbzip2__xread
+#define xwrite                lbzip2__xwrite
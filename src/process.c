@@ -22,7 +22,9 @@
 #include "common.h"
 
 #include <arpa/inet.h>          /* ntohl() */
+#include <poll.h>               /* poll() */
 #include <pthread.h>            /* pthread_t */
+#include <setjmp.h>             /* setjmp() */
 #include <signal.h>             /* SIGUSR2 */
 #include <unistd.h>             /* write() */
 
@@ -30,7 +32,9 @@
 #include "main.h"               /* work() */
 
 #include "process.h"            /* struct process */
+#ifndef LBZIP2_LIBRARY
 #include "signals.h"            /* halt() */
+#endif
 
 
 /*
@@ -76,10 +80,74 @@
 #define xsignal(c)    ((void)(pthread_cond_signal(c)     && (abort(), 0)))
 #define xbroadcast(c) ((void)(pthread_cond_broadcast(c)  && (abort(), 0)))
 
+
+/*
+  FAILURE HANDLING IN LIBRARY
+
+  The program simply exits when it encounters an error, but the library must
+  return to its caller instead.  A failing thread calls unwind(), which asks
+  all other threads to stop and then jumps back to the innermost frame set up
+  by run_protected() in that thread.  Every thread runs its entry function in
+  such a frame.  Tasks which are already running are completed, but no new
+  tasks are scheduled.  Process state is not cleaned up after failure, but
+  the library keeps track of all memory allocated by the engine and releases
+  it once all threads have been joined.
+*/
+#ifdef LBZIP2_LIBRARY
+/* Thread-specific data: the innermost unwind target (jmp_buf *) and whether
+   the thread holds sched_mutex (non-null iff it does). */
+static pthread_once_t keys_once = PTHREAD_ONCE_INIT;
+static pthread_key_t target_key;
+static pthread_key_t owner_key;
+
+static void
+create_keys(void)
+{
+  if (pthread_key_create(&target_key, NULL) != 0 ||
+      pthread_key_create(&owner_key, NULL) != 0)
+    abort();
+}
+
+#define xsetspecific(k, v) ((void)(pthread_setspecific(k, v) && (abort(), 0)))
+#define set_owner(x) xsetspecific(owner_key, (x) ? &owner_key : NULL)
+#else
+#define set_owner(x) ((void)0)
+#endif
+
+static bool aborted;            /* true iff unwind() was called */
+static bool abandon;            /* true iff output should be discarded */
+
+
+bool
+run_protected(void (*entry)(void))
+{
+#ifdef LBZIP2_LIBRARY
+  jmp_buf target;
+  void *saved;
+
+  if (pthread_once(&keys_once, create_keys) != 0)
+    abort();
+
+  saved = pthread_getspecific(target_key);
+  xsetspecific(target_key, &target);
+  if (setjmp(target) != 0) {
+    xsetspecific(target_key, saved);
+    return false;
+  }
+  entry();
+  xsetspecific(target_key, saved);
+#else
+  entry();
+#endif
+
+  return true;
+}
+
+
 static void *
 thread_entry(void *real_entry)
 {
-  ((void (*)(void))real_entry)();
+  run_protected((void (*)(void))real_entry);
   return NULL;
 }
 
@@ -98,6 +166,7 @@ xcreate(void (*entry)(void))
 }
 
 
+#ifndef LBZIP2_LIBRARY
 void
 xread(void *vbuf, size_t *vacant)
 {
@@ -154,6 +223,72 @@ xwrite(const void *vbuf, size_t size)
 }
 
 
+/* Read like xread(), but once flush_interval milliseconds have passed since
+   the first byte was read, return with what has been read so far.  Returns
+   true iff end of file was reached. */
+static bool
+xread_timed(void *vbuf, size_t *vacant)
+{
+  char *buffer = vbuf;
+  size_t size = *vacant;
+  struct timespec deadline;
+
+  assert(*vacant > 0);
+
+  do {
+    ssize_t rd;
+
+    if (*vacant < size) {
+      struct timespec now, left;
+      struct pollfd pfd;
+      int ready;
+
+      gettime(&now);
+      if (timespec_cmp(now, deadline) >= 0)
+        break;
+      left = timespec_sub(deadline, now);
+
+      pfd.fd = ispec.fd;
+      pfd.events = POLLIN;
+      ready = poll(&pfd, 1, left.tv_sec * 1000 +
+                   (left.tv_nsec + 999999) / 1000000);
+      if (-1 == ready)
+        failfx(&ispec, errno, "poll()");
+      if (0 == ready)
+        continue;
+    }
+
+    rd = read(ispec.fd, buffer, *vacant > (size_t)SSIZE_MAX ?
+              (size_t)SSIZE_MAX : *vacant);
+
+    /* End of file. */
+    if (0 == rd)
+      return true;
+
+    /* Read error. */
+    if (-1 == rd) {
+      failfx(&ispec, errno, "read()");
+    }
+
+    /* Start the timer when the first byte arrives. */
+    if (*vacant == size) {
+      gettime(&deadline);
+      deadline = timespec_add(deadline,
+                              make_timespec(flush_interval / 1000u,
+                                            flush_interval % 1000u * 1000000));
+    }
+
+    *vacant -= (size_t)rd;
+    buffer += (size_t)rd;
+    ispec.total += (size_t)rd;
+  }
+  while (*vacant > 0);
+
+  return false;
+}
+#endif /* LBZIP2_LIBRARY */
+
+
 /* Parent and left child indices. */
 #define parent(i) (((i)-1)/2)
 #define left(i) ((i)*2+1)
@@ -225,6 +360,7 @@ static const struct process *process;
 bool eof;
 unsigned work_units;
 unsigned in_slots;
+unsigned in_weight;
 unsigned out_slots;
 unsigned total_in_slots;
 unsigned total_out_slots;
@@ -247,7 +383,7 @@ struct block {
 static struct deque(struct block) output_q;
 static bool finish;
 
-unsigned thread_id;
+static unsigned thread_id;
 /* Highest priority runnable task or NULL if there are no runnable tasks. */
 static const struct task *next_task;
 
@@ -260,9 +396,10 @@ source_thread_proc(void)
   for (;;) {
     void *buffer;
     size_t vacant, avail;
+    bool at_eof;
 
     xlock(&source_mutex);
-    while (in_slots == 0 && !request_close) {
+    while (in_slots < in_weight && !request_close) {
       Trace(("    source: stalled"));
       xwait(&source_cond, &source_mutex);
     }
@@ -274,23 +411,34 @@ source_thread_proc(void)
     }
 
     Trace(("    source: reading data (%u free slots)", in_slots));
-    in_slots--;
+    in_slots -= in_weight;
     xunlock(&source_mutex);
 
     vacant = in_granul;
     avail = vacant;
     buffer = XNMALLOC(vacant, uint8_t);
-    xread(buffer, &vacant);
+#ifndef LBZIP2_LIBRARY
+    /* With --flush-interval short blocks are passed on when input stalls, so
+       that compressed output keeps up with slow input. */
+    if (flush_interval > 0u && !decompress) {
+      at_eof = xread_timed(buffer, &vacant);
+    }
+    else
+#endif
+    {
+      xread(buffer, &vacant);
+      at_eof = (vacant > 0u);
+    }
     avail -= vacant;
 
     Trace(("    source: block of %u bytes read", (unsigned)avail));
 
     if (avail == 0u)
-      source_release_buffer(buffer);
+      source_release_slots(buffer, in_weight);
     else
       process->on_block(buffer, avail);
 
-    if (vacant > 0u)
+    if (at_eof)
       break;
   }
 
@@ -303,24 +451,32 @@ source_thread_proc(void)
 
 
 void
-source_release_buffer(void *buffer)
+source_release_slots(void *buffer, unsigned slots)
 {
   free(buffer);
 
+  /* The reader may be waiting for more than one slot, so signal it on
+     every release. */
   xlock(&source_mutex);
-  if (in_slots++ == 0)
-    xsignal(&source_cond);
+  in_slots += slots;
+  xsignal(&source_cond);
   xunlock(&source_mutex);
 }
 
 
+void
+source_release_buffer(void *buffer)
+{
+  source_release_slots(buffer, 1u);
+}
+
+
 void
 source_close(void)
 {
   xlock(&source_mutex);
   request_close = true;
-  if (in_slots == 0)
-    xsignal(&source_cond);
+  xsignal(&source_cond);
   xunlock(&source_mutex);
 }
 
@@ -341,19 +497,20 @@ sink_write_buffer(void *buffer, size_t size, size_t weight)
 }
 
 
+#ifndef LBZIP2_LIBRARY
+/* Progress info, updated by the sink thread only. */
+static bool progress_enabled;
+static uintmax_t processed;
+static struct timespec start_time;
+static struct timespec next_time;
+static struct timespec update_interval;
+
+
 static void
-sink_thread_proc(void)
+progress_init(void)
 {
-  bool progress_enabled;
-  uintmax_t processed;
-  struct timespec start_time;
-  struct timespec next_time;
-  struct timespec update_interval;
-  struct block block;
   static const double UPDATE_INTERVAL = 0.1;
 
-  Trace(("      sink: spawned"));
-
   /* Progress info is displayed only if all the following conditions are met:
      1) the user has specified -v or --verbose option
      2) stderr is connected to a terminal device
@@ -365,6 +522,49 @@ sink_thread_proc(void)
   gettime(&start_time);
   next_time = start_time;
   update_interval = dtotimespec(UPDATE_INTERVAL);
+}
+
+
+static void
+progress_update(size_t weight)
+{
+  struct timespec time_now;
+  double completed, elapsed;
+
+  if (!progress_enabled)
+    return;
+
+  processed = min(processed + weight, ispec.size);
+
+  gettime(&time_now);
+
+  if (timespec_cmp(time_now, next_time) > 0) {
+    next_time = timespec_add(time_now, update_interval);
+    elapsed = timespectod(timespec_sub(time_now, start_time));
+    completed = (double)processed / ispec.size;
+
+    if (elapsed < 5)
+      display("progress: %.2f%%\r", 100 * completed);
+    else
+      display("progress: %.2f%%, ETA: %.0f s    \r",
+              100 * completed, elapsed * (1 / completed - 1));
+  }
+}
+#else
+/* The library doesn't display progress. */
+#define progress_init() ((void)0)
+#define progress_update(weight) ((void)(weight))
+#endif
+
+
+static void
+sink_thread_proc(void)
+{
+  struct block block;
+
+  Trace(("      sink: spawned"));
+
+  progress_init();
 
   for (;;) {
     xlock(&sink_mutex);
@@ -373,7 +573,7 @@ sink_thread_proc(void)
       xwait(&sink_cond, &sink_mutex);
     }
 
-    if (empty(output_q))
+    if (empty(output_q) || abandon)
       break;
 
     block = shift(output_q);
@@ -384,26 +584,7 @@ sink_thread_proc(void)
     Trace(("      sink: releasing output slot"));
     process->on_written(block.buffer);
 
-    if (progress_enabled) {
-      struct timespec time_now;
-      double completed, elapsed;
-
-      processed = min(processed + block.weight, ispec.size);
-
-      gettime(&time_now);
-
-      if (timespec_cmp(time_now, next_time) > 0) {
-        next_time = timespec_add(time_now, update_interval);
-        elapsed = timespectod(timespec_sub(time_now, start_time));
-        completed = (double)processed / ispec.size;
-
-        if (elapsed < 5)
-          display("progress: %.2f%%\r", 100 * completed);
-        else
-          display("progress: %.2f%%, ETA: %.0f s    \r",
-                  100 * completed, elapsed * (1 / completed - 1));
-      }
-    }
+    progress_update(block.weight);
   }
 
   xunlock(&sink_mutex);
@@ -436,16 +617,17 @@ worker_thread_proc(void)
   (void)id;
 
   xlock(&sched_mutex);
+  set_owner(true);
   Trace(("worker[%2u]: spawned", (id = thread_id++)));
 
   for (;;) {
-    while (next_task != NULL) {
+    while (next_task != NULL && !aborted) {
       Trace(("worker[%2u]: scheduling task '%s'...", id, next_task->name));
       next_task->run();
       select_task();
     }
 
-    if (process->finished())
+    if (aborted || process->finished())
       break;
 
     Trace(("worker[%2u]: stalled", id));
@@ -453,6 +635,7 @@ worker_thread_proc(void)
   }
 
   xbroadcast(&sched_cond);
+  set_owner(false);
   xunlock(&sched_mutex);
 
   Trace(("worker[%2u]: terminating", id));
@@ -464,6 +647,7 @@ void
 sched_lock(void)
 {
   xlock(&sched_mutex);
+  set_owner(true);
 }
 
 
@@ -476,8 +660,36 @@ sched_unlock(void)
   if (next_task != NULL || process->finished())
     xsignal(&sched_cond);
 
+  set_owner(false);
+  xunlock(&sched_mutex);
+}
+
+
+#ifdef LBZIP2_LIBRARY
+_Noreturn void
+unwind(void)
+{
+  jmp_buf *target = pthread_getspecific(target_key);
+
+  if (pthread_getspecific(owner_key) == NULL)
+    xlock(&sched_mutex);
+  aborted = true;
+  xbroadcast(&sched_cond);
+  set_owner(false);
   xunlock(&sched_mutex);
+
+  source_close();
+
+  xlock(&sink_mutex);
+  finish = true;
+  abandon = true;
+  xsignal(&sink_cond);
+  xunlock(&sink_mutex);
+
+  assert(target != NULL);
+  longjmp(*target, 1);
 }
+#endif
 
 
 static void
@@ -485,6 +697,7 @@ init_io(void)
 {
   request_close = false;
   finish = false;
+  abandon = false;
   deque_init(output_q, out_slots);
 
   sink_thread = xcreate(sink_thread_proc);
@@ -503,6 +716,12 @@ uninit_io(void)
   xunlock(&sink_mutex);
 
   xjoin(sink_thread);
+
+  /* Release blocks left behind by the sink after failure. */
+  while (!empty(output_q)) {
+    assert(abandon);
+    process->on_written(shift(output_q).buffer);
+  }
   deque_uninit(output_q);
 }
 
@@ -515,7 +734,9 @@ primary_thread(void)
   thread_id = 0;
 
   eof = false;
+  aborted = false;
   in_slots = total_in_slots;
+  in_weight = 1;
   out_slots = total_out_slots;
   work_units = num_worker;
 
@@ -526,23 +747,30 @@ primary_thread(void)
   for (i = 1u; i < num_worker; ++i)
     worker_thread[i] = xcreate(worker_thread_proc);
 
-  worker_thread_proc();
+  run_protected(worker_thread_proc);
 
   for (i = 1u; i < num_worker; ++i)
     xjoin(worker_thread[i]);
 
   uninit_io();
-  process->uninit();
 
-  assert(eof);
-  assert(in_slots == total_in_slots);
-  assert(out_slots == total_out_slots);
-  assert(work_units == num_worker);
+  /* All other threads are gone, so aborted can be read without locking. */
+  if (!aborted) {
+    process->uninit();
 
+    assert(eof);
+    assert(in_slots == total_in_slots);
+    assert(out_slots == total_out_slots);
+    assert(work_units == num_worker);
+  }
+
+#ifndef LBZIP2_LIBRARY
   xraise(SIGUSR2);
+#endif
 }
 
 
+#ifndef LBZIP2_LIBRARY
 static void
 copy_on_input_avail(void *buffer, size_t size)
 {
@@ -590,6 +818,7 @@ copy(void)
 
   eof = false;
   in_slots = 2;
+  in_weight = 1;
   out_slots = 2;
   total_out_slots = 2;
   in_granul = 65536;
@@ -599,6 +828,7 @@ copy(void)
   halt();
   uninit_io();
 }
+#endif /* LBZIP2_LIBRARY */
 
 
 static void
@@ -608,7 +838,9 @@ schedule(const struct process *proc)
 
   worker_thread = XNMALLOC(num_worker, pthread_t);
   *worker_thread = xcreate(primary_thread);
+#ifndef LBZIP2_LIBRARY
   halt();
+#endif
   xjoin(*worker_thread);
   free(worker_thread);
 }
@@ -653,6 +885,12 @@ work(void)
   if (!decompress) {
     schedule(&compression);
   }
+  else if (partial.enabled) {
+    /* Input was positioned at a block inside a stream whose header has
+       already been looked at. */
+    bs100k = partial.bs100k;
+    schedule(&expansion);
+  }
   else {
     uint32_t header;
     size_t vacant = sizeof(header);
@@ -665,10 +903,12 @@ work(void)
       bs100k = ntohl(header) - MAGIC(0);
       schedule(&expansion);
     }
+#ifndef LBZIP2_LIBRARY
     else if (force && ospec.fd == STDOUT_FILENO) {
       xwrite(&header, sizeof(header) - vacant);
       copy();
     }
+#endif
     else {
       failf(&ispec, "not a valid bzip2 file");
     }
@@ -79,6 +79,7 @@ struct position {
 extern bool eof;                   /* true iff end of input was reached */
 extern unsigned work_units;        /* number of available work units */
 extern unsigned in_slots;          /* number of available input slots */
+extern unsigned in_weight;         /* number of input slots a read takes */
 extern unsigned out_slots;         /* number of available output slots */
 extern unsigned total_work_units;  /* total number of work units */
 extern unsigned total_in_slots;    /* total number of input slots */
@@ -188,11 +189,25 @@ void source_close(void);
    is not needed any longer so that it can be released or reused. */
 void source_release_buffer(void *buffer);
 
+/* Like source_release_buffer(), but for an I/O block which was read while
+   in_weight was `slots'. */
+void source_release_slots(void *buffer, unsigned slots);
+
 /* Send asynchronous mesage to writer thread requesting it to write specified
    I/O block to output stream.  Requests are processed in order of arrival.
    Weight is used only for progress monitoring. */
 void sink_write_buffer(void *buffer, size_t size, size_t weight);
 
+/* Call `entry'.  In the library, return false if it failed, that is called
+   unwind(), and true otherwise.  The program never returns from failure. */
+bool run_protected(void (*entry)(void));
+
+#ifdef LBZIP2_LIBRARY
+/* Stop all threads of the running process, if any, and return from the
+   innermost run_protected() in this thread. */
+_Noreturn void unwind(void);
+#endif
+
 /* Synchronously read from 0 to `*vacant' bytes from input stream.  `vacant' is
    updated to hold number of unused bytes in the buffer.  If uppon return
    `vacant' is non-zero then end of file was reached.  I/O errors are handled
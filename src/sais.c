@@ -0,0 +1,300 @@
+/*-
+  sais.c -- Burrows-Wheeler transformation by induced sorting
+
+  Copyright (C) 2012, 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include <string.h>             /* memset() */
+
+#include "encode.h"
+
+
+/*
+  SA-IS is a suffix sorting algorithm by Nong, Zhang and Chan, which works in
+  linear time regardless of input.  divbwt() is usually faster, but on some
+  highly repetitive inputs its running time grows well above the average, so
+  SA-IS is provided as an alternative engine with a guaranteed worst case.
+
+  bzip2 sorts rotations of the block, not its suffixes.  The two orders are
+  the same for a Lyndon word (a primitive string which is strictly smaller
+  than all its proper rotations), so the block is first rotated so that it
+  starts at its least rotation.
+
+  The result is exactly what divbwt() produces, including the primary index,
+  with one exception.  If the block is a repetition p^k of some string p then
+  k rotations are equal to rotation 0 and any of them can serve as the primary
+  index.  Only p is sorted and each character of its BWT is repeated k times,
+  which is a valid transformation of p^k too, but divbwt() may pick another
+  primary index depending on its internal state.  Callers which need output
+  identical to divbwt() can ask for periodic blocks to be passed to divbwt()
+  first.  This costs little, as divbwt() handles periodic blocks quickly.
+*/
+
+
+/* Bit vector holding suffix types: set for S-type, clear for L-type. */
+#define TSET(i) (type[(i) >> 3] |= 1 << ((i) & 7))
+#define TGET(i) ((type[(i) >> 3] >> ((i) & 7)) & 1)
+#define IS_LMS(i) ((i) > 0 && TGET(i) && !TGET((i) - 1))
+
+/* Input character at given position.  The top level string is made of bytes,
+   strings sorted recursively are made of 32-bit names. */
+#define CHR(i) (cs == 1 ? ((const uint8_t *)T)[i] : ((const int32_t *)T)[i])
+
+
+static void
+get_buckets(const int32_t *C, int32_t *B, int32_t k, bool end)
+{
+  int32_t i, sum;
+
+  sum = 0;
+  for (i = 0; i < k; i++) {
+    sum += C[i];
+    B[i] = end ? sum : sum - C[i];
+  }
+}
+
+
+/* Induce the order of L-type suffixes from sorted LMS suffixes, then the
+   order of S-type suffixes from sorted L-type suffixes. */
+static void
+induce(const void *T, int32_t *SA, const uint8_t *type, const int32_t *C,
+       int32_t *B, int32_t n, int32_t k, int cs)
+{
+  int32_t i, j;
+
+  get_buckets(C, B, k, false);
+  SA[B[CHR(n - 1)]++] = n - 1;
+  for (i = 0; i < n; i++) {
+    j = SA[i] - 1;
+    if (j >= 0 && !TGET(j))
+      SA[B[CHR(j)]++] = j;
+  }
+
+  get_buckets(C, B, k, true);
+  for (i = n - 1; i >= 0; i--) {
+    j = SA[i] - 1;
+    if (j >= 0 && TGET(j))
+      SA[--B[CHR(j)]] = j;
+  }
+}
+
+
+/* Compute suffix array of string T of length n over alphabet [0,k).  Each
+   character occupies cs bytes.  Buckets C and B must hold k elements each.
+   Return false if memory could not be allocated. */
+static bool
+sais_main(const void *T, int32_t *SA, int32_t *C, int32_t *B, int32_t n,
+          int32_t k, int cs)
+{
+  uint8_t *type;
+  int32_t i, j, m, name, prev, pos, d;
+  int32_t *s1;
+
+  assert(n > 0);
+
+  type = malloc(n / 8 + 1);
+  if (type == NULL)
+    return false;
+  memset(type, 0, n / 8 + 1);
+
+  /* Classify suffixes.  The last one is L-type because it is followed by the
+     virtual sentinel, which is smaller than any character. */
+  for (i = n - 2; i >= 0; i--)
+    if (CHR(i) < CHR(i + 1) || (CHR(i) == CHR(i + 1) && TGET(i + 1)))
+      TSET(i);
+
+  /* Stage 1: sort LMS substrings. */
+  for (i = 0; i < k; i++)
+    C[i] = 0;
+  for (i = 0; i < n; i++)
+    C[CHR(i)]++;
+
+  get_buckets(C, B, k, true);
+  for (i = 0; i < n; i++)
+    SA[i] = -1;
+  for (i = 1; i < n; i++)
+    if (IS_LMS(i))
+      SA[--B[CHR(i)]] = i;
+  induce(T, SA, type, C, B, n, k, cs);
+
+  /* Compact all sorted LMS substrings into the first m items of SA.  There
+     are at most n/2 of them. */
+  m = 0;
+  for (i = 0; i < n; i++)
+    if (IS_LMS(SA[i]))
+      SA[m++] = SA[i];
+  assert(m <= n / 2);
+
+  /* Name the LMS substrings.  Names are stored at SA[m + pos/2], which is
+     unambiguous as LMS positions are at least 2 apart. */
+  for (i = m; i < n; i++)
+    SA[i] = -1;
+  name = 0;
+  prev = -1;
+  for (i = 0; i < m; i++) {
+    pos = SA[i];
+    for (d = 0; d < n; d++) {
+      if (prev == -1 || pos + d == n || prev + d == n ||
+          CHR(pos + d) != CHR(prev + d) || TGET(pos + d) != TGET(prev + d)) {
+        name++;
+        prev = pos;
+        break;
+      }
+      if (d > 0 && (IS_LMS(pos + d) || IS_LMS(prev + d)))
+        break;
+    }
+    SA[m + (pos >> 1)] = name - 1;
+  }
+  for (i = n - 1, j = n - 1; i >= m; i--)
+    if (SA[i] >= 0)
+      SA[j--] = SA[i];
+
+  /* Stage 2: sort the reduced string, recursing if names are not unique. */
+  s1 = SA + n - m;
+  if (name < m) {
+    int32_t *C1 = malloc(2 * name * sizeof(int32_t));
+    bool done;
+
+    done = (C1 != NULL &&
+            sais_main(s1, SA, C1, C1 + name, m, name, sizeof(int32_t)));
+    free(C1);
+    if (!done) {
+      free(type);
+      return false;
+    }
+  }
+  else {
+    for (i = 0; i < m; i++)
+      SA[s1[i]] = i;
+  }
+
+  /* Stage 3: induce the final order from sorted LMS suffixes. */
+  for (i = 1, j = 0; i < n; i++)
+    if (IS_LMS(i))
+      s1[j++] = i;
+  for (i = 0; i < m; i++)
+    SA[i] = s1[SA[i]];
+  for (i = m; i < n; i++)
+    SA[i] = -1;
+
+  get_buckets(C, B, k, true);
+  for (i = m - 1; i >= 0; i--) {
+    j = SA[i];
+    SA[i] = -1;
+    SA[--B[CHR(j)]] = j;
+  }
+  induce(T, SA, type, C, B, n, k, cs);
+
+  free(type);
+  return true;
+}
+
+
+static void
+reverse(uint8_t *first, uint8_t *last)
+{
+  uint8_t t;
+
+  while (first < --last) {
+    t = *first;
+    *first++ = *last;
+    *last = t;
+  }
+}
+
+
+/* Find the least rotation of T.  Store the least period of T, treated as
+   a cyclic string, in *period. */
+static int32_t
+least_rotation(const uint8_t *T, int32_t n, int32_t *period)
+{
+  int32_t i, j, k, a, b;
+
+  i = 0;
+  j = 1;
+  k = 0;
+  while (i < n && j < n && k < n) {
+    a = i + k < n ? i + k : i + k - n;
+    b = j + k < n ? j + k : j + k - n;
+    if (T[a] == T[b]) {
+      k++;
+      continue;
+    }
+    if (T[a] > T[b])
+      i += k + 1;
+    else
+      j += k + 1;
+    if (i == j)
+      j++;
+    k = 0;
+  }
+
+  /* If k reached n then rotations i and j are equal, and no rotation
+     in between equals them. */
+  *period = k < n ? n : i < j ? j - i : i - j;
+  return min(i, j);
+}
+
+
+int32_t
+saisbwt(uint8_t *T, int32_t *SA, int32_t *bucket, int32_t n,
+        bool periodic_divbwt)
+{
+  int32_t r, l, k, j, t, u0, orig;
+
+  assert(n > 0);
+  if (n == 1) {
+    SA[0] = T[0];
+    return 0;
+  }
+
+  r = least_rotation(T, n, &l);
+  if (l < n && periodic_divbwt && (orig = divbwt(T, SA, bucket, n)) >= 0)
+    return orig;
+
+  /* Rotate the block so that it becomes a power of a Lyndon word, then sort
+     the Lyndon word. */
+  reverse(T, T + r);
+  reverse(T + r, T + n);
+  reverse(T, T + n);
+  if (!sais_main(T, SA, bucket, bucket + 256, l, 256, 1))
+    return -1;
+
+  /* Compute the BWT and locate the original rotation 0. */
+  u0 = (n - r) % n % l;
+  orig = -1;
+  for (j = 0; j < l; j++) {
+    if (SA[j] == u0)
+      orig = j;
+    SA[j] = T[SA[j] != 0 ? SA[j] - 1 : l - 1];
+  }
+  assert(orig >= 0);
+
+  /* Repeat each character k times if the block is periodic. */
+  k = n / l;
+  if (k > 1) {
+    for (j = l - 1; j >= 0; j--)
+      for (t = 0; t < k; t++)
+        SA[j * k + t] = SA[j];
+    orig *= k;
+  }
+
+  return orig;
+}
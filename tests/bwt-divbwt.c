@@ -0,0 +1,25 @@
+/*-
+  bwt-divbwt.c -- divbwt.c compiled with a small work budget
+
+  Copyright (C) 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Budget small enough for divbwt() to give up on some of the test blocks. */
+#define WORK_BUDGET_FACTOR 6
+
+#include "divbwt.c"
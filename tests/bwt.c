@@ -0,0 +1,237 @@
+/*-
+  bwt.c -- block sorting engine test
+
+  Copyright (C) 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Sorting engines are linked in directly and compared with a naive sort of
+  block rotations.  divbwt.c is compiled with a small work budget (see
+  bwt-divbwt.c), so that divbwt() gives up on some of the blocks.
+*/
+
+#include "common.h"
+
+#include <stdio.h>              /* printf() */
+#include <string.h>             /* memcmp() */
+
+#include "encode.h"
+
+
+#define MAX_SIZE 20000
+
+static uint8_t block[MAX_SIZE + BWT_PAD];
+static uint8_t twice[2 * MAX_SIZE];
+static int32_t rot[MAX_SIZE];
+static uint8_t expect[MAX_SIZE];
+static int32_t SA[MAX_SIZE];
+static int32_t bucket[65536 + 256];
+static int32_t size;
+static int test_id;
+
+
+static void
+ok(int cond, const char *name)
+{
+  ++test_id;
+  printf("%sok %d %s\n", cond ? "" : "not ", test_id, name);
+}
+
+
+static int
+rot_cmp(const void *a, const void *b)
+{
+  return memcmp(twice + *(const int32_t *)a, twice + *(const int32_t *)b,
+                size);
+}
+
+
+/* Sort rotations of the block naively and store its BWT in expect[]. */
+static void
+sort_naive(void)
+{
+  int32_t i;
+
+  memcpy(twice, block, size);
+  memcpy(twice + size, block, size);
+  for (i = 0; i < size; i++)
+    rot[i] = i;
+  qsort(rot, size, sizeof(rot[0]), rot_cmp);
+  for (i = 0; i < size; i++)
+    expect[i] = block[(rot[i] + size - 1) % size];
+}
+
+
+/* Check BWT computed by an engine.  Any rotation equal to rotation 0 can
+   serve as the primary index. */
+static bool
+check(int32_t idx)
+{
+  int32_t i;
+
+  if (idx < 0 || idx >= size || memcmp(twice + rot[idx], block, size) != 0)
+    return false;
+  for (i = 0; i < size; i++)
+    if (SA[i] != expect[i])
+      return false;
+  return true;
+}
+
+
+/* Sort the block with saisbwt(), which may rotate it. */
+static int32_t
+sort_sais(bool periodic_divbwt)
+{
+  static uint8_t copy[MAX_SIZE + BWT_PAD];
+
+  memcpy(copy, block, size);
+  return saisbwt(copy, SA, bucket, size, periodic_divbwt);
+}
+
+
+static int32_t
+sort_divbwt(void)
+{
+  static uint8_t copy[MAX_SIZE + BWT_PAD];
+
+  memcpy(copy, block, size);
+  return divbwt(copy, SA, bucket, size);
+}
+
+
+/* Sort the block with divbwt_small(), mapping characters in use to
+   consecutive integers as encode() does. */
+static int32_t
+sort_divbwt_small(void)
+{
+  static uint8_t copy[MAX_SIZE + BWT_PAD];
+  uint8_t cmap[256];
+  bool inuse[256];
+  int32_t i, as;
+
+  memset(inuse, 0, sizeof(inuse));
+  for (i = 0; i < size; i++)
+    inuse[block[i]] = true;
+  for (as = 0, i = 0; i < 256; i++) {
+    cmap[i] = as;
+    as += inuse[i];
+  }
+
+  memcpy(copy, block, size);
+  return divbwt_small(copy, SA, bucket, size, cmap, as);
+}
+
+
+/* Fill the block with n pseudo-random characters from alphabet of size as. */
+static void
+make_random(int32_t n, unsigned as)
+{
+  static unsigned long seed = 1;
+  int32_t i;
+
+  for (i = 0; i < n; i++) {
+    seed = seed * 1103515245 + 12345;
+    block[i] = 'a' + (seed >> 16) % as;
+  }
+  size = n;
+}
+
+
+/* Repeat the first p characters of the block to fill n characters. */
+static void
+make_periodic(int32_t p, int32_t n)
+{
+  int32_t i;
+
+  for (i = p; i < n; i++)
+    block[i] = block[i - p];
+  size = n;
+}
+
+
+/* Make a Zimin word, which divbwt() sorts slowly. */
+static void
+make_zimin(int32_t n)
+{
+  int32_t i, len;
+
+  block[0] = 'a';
+  for (len = 1, i = 1; 2 * len + 1 <= n; len = 2 * len + 1, i++) {
+    block[len] = 'a' + i;
+    memcpy(block + len + 1, block, len);
+  }
+  size = len;
+}
+
+
+int
+main(void)
+{
+  int32_t idx;
+
+  printf("1..10\n");
+
+  make_random(MAX_SIZE, 256);
+  sort_naive();
+  ok(check(sort_sais(false)), "saisbwt on random block");
+  idx = sort_divbwt();
+  ok(idx >= 0 && check(idx), "divbwt on random block");
+
+  /* Periodic blocks are never passed to divbwt() unless requested, so the
+     primary index may differ from that of divbwt(). */
+  make_random(97, 4);
+  make_periodic(97, 97 * 150);
+  sort_naive();
+  ok(check(sort_sais(false)), "saisbwt on periodic block");
+  idx = sort_divbwt();
+  ok(idx >= 0 && check(idx) && sort_sais(true) == idx,
+     "saisbwt on periodic block, divbwt first");
+
+  /* Blocks divbwt() gives up on are sorted with saisbwt() by encode(). */
+  make_zimin(MAX_SIZE);
+  sort_naive();
+  ok(sort_divbwt() < 0, "divbwt gives up over budget");
+  ok(check(sort_sais(false)), "saisbwt on block divbwt gave up on");
+
+  /* divbwt_small() must give the same result as divbwt(), including the
+     primary index of periodic blocks. */
+  make_random(MAX_SIZE, 2);
+  sort_naive();
+  idx = sort_divbwt_small();
+  ok(idx >= 0 && check(idx), "divbwt_small on binary block");
+
+  make_random(MAX_SIZE, MAX_SMALL_ALPHA);
+  sort_naive();
+  idx = sort_divbwt_small();
+  ok(idx >= 0 && check(idx), "divbwt_small on block of MAX_SMALL_ALPHA "
+     "characters");
+
+  make_random(MAX_SIZE, 1);
+  sort_naive();
+  idx = sort_divbwt_small();
+  ok(idx >= 0 && check(idx), "divbwt_small on run of one character");
+
+  make_random(97, 4);
+  make_periodic(97, 97 * 150);
+  sort_naive();
+  idx = sort_divbwt();
+  ok(idx >= 0 && sort_divbwt_small() == idx && check(idx),
+     "divbwt_small on periodic block");
+
+  return 0;
+}
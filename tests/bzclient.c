@@ -0,0 +1,234 @@
+/*-
+  bzclient.c -- libbz2 replacement test
+
+  Copyright (C) 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A libbz2 client, linked with libbz2.so.1.0 built from src/bzlib.c.  It uses
+  the low-level stream interface only, with input and output buffers of
+  various sizes.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bzlib.h"
+
+
+#define SIZE (1500 * 1000)
+
+static char *orig, *comp, *copy, *multi;
+static size_t comp_size;
+static int test_id;
+
+
+static void
+ok(int cond, const char *name)
+{
+  ++test_id;
+  printf("%sok %d %s\n", cond ? "" : "not ", test_id, name);
+}
+
+
+/* Generate compressible data with some long runs. */
+static void
+generate(char *buf, size_t size)
+{
+  unsigned long seed = 1;
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    if ((seed >> 16) % 1000 == 0) {
+      size_t n = (seed >> 8) % 5000;
+
+      while (n-- > 0 && i < size)
+        buf[i++] = 'x';
+      if (i == size)
+        break;
+    }
+    buf[i] = "abcdefgh \n"[(seed >> 16) % 10];
+  }
+}
+
+
+static size_t
+min_size(size_t a, size_t b)
+{
+  return a < b ? a : b;
+}
+
+
+/* Compress size bytes at in with 100k blocks, passing at most in_step bytes
+   of input and out_step bytes of output space to each call.  Return the
+   compressed size, or 0 on failure. */
+static size_t
+compress(const char *in, size_t size, char *out, size_t out_size,
+         size_t in_step, size_t out_step)
+{
+  bz_stream s;
+  size_t in_pos = 0, out_pos = 0;
+  int action, rv;
+
+  memset(&s, 0, sizeof(s));
+  if (BZ2_bzCompressInit(&s, 1, 0, 0) != BZ_OK)
+    return 0;
+
+  do {
+    s.next_in = (char *)in + in_pos;
+    s.avail_in = min_size(in_step, size - in_pos);
+    s.next_out = out + out_pos;
+    s.avail_out = min_size(out_step, out_size - out_pos);
+    action = (in_pos + s.avail_in == size ? BZ_FINISH : BZ_RUN);
+    rv = BZ2_bzCompress(&s, action);
+    in_pos = s.next_in - in;
+    out_pos = s.next_out - out;
+  }
+  while (rv == BZ_RUN_OK || rv == BZ_FINISH_OK);
+
+  BZ2_bzCompressEnd(&s);
+
+  return rv == BZ_STREAM_END && in_pos == size ? out_pos : 0;
+}
+
+
+/* Decompress one stream from size bytes at in, passing at most in_step bytes
+   of input and out_step bytes of output space to each call.  Store numbers
+   of bytes consumed and produced in *in_used and *out_used.  Return the code
+   returned by BZ2_bzDecompress(), or BZ_UNEXPECTED_EOF or BZ_OUTBUFF_FULL if
+   it stopped making progress. */
+static int
+decompress(const char *in, size_t size, char *out, size_t out_size,
+           size_t in_step, size_t out_step, size_t *in_used,
+           size_t *out_used)
+{
+  bz_stream s;
+  size_t in_pos = 0, out_pos = 0, prev_in, prev_out;
+  int rv;
+
+  memset(&s, 0, sizeof(s));
+  if (BZ2_bzDecompressInit(&s, 0, 0) != BZ_OK)
+    return BZ_MEM_ERROR;
+
+  for (;;) {
+    s.next_in = (char *)in + in_pos;
+    s.avail_in = min_size(in_step, size - in_pos);
+    s.next_out = out + out_pos;
+    s.avail_out = min_size(out_step, out_size - out_pos);
+    prev_in = in_pos;
+    prev_out = out_pos;
+    rv = BZ2_bzDecompress(&s);
+    in_pos = s.next_in - in;
+    out_pos = s.next_out - out;
+    if (rv != BZ_OK)
+      break;
+
+    /* Without progress either input or output space has run out. */
+    if (in_pos == prev_in && out_pos == prev_out) {
+      rv = s.avail_out > 0 ? BZ_UNEXPECTED_EOF : BZ_OUTBUFF_FULL;
+      break;
+    }
+  }
+
+  BZ2_bzDecompressEnd(&s);
+  *in_used = in_pos;
+  *out_used = out_pos;
+
+  return rv;
+}
+
+
+int
+main(void)
+{
+  size_t size, used, size2;
+  int rv;
+
+  printf("1..8\n");
+
+  orig = malloc(SIZE);
+  comp = malloc(2 * SIZE);
+  copy = malloc(SIZE);
+  multi = malloc(4 * SIZE + 3);
+  if (orig == NULL || comp == NULL || copy == NULL || multi == NULL) {
+    printf("Bail out! memory exhausted\n");
+    return 1;
+  }
+  generate(orig, SIZE);
+
+  comp_size = compress(orig, SIZE, comp, 2 * SIZE, SIZE, 2 * SIZE);
+  rv = decompress(comp, comp_size, copy, SIZE, comp_size, SIZE, &used, &size);
+  ok(comp_size > 0 && rv == BZ_STREAM_END && used == comp_size &&
+     size == SIZE && memcmp(orig, copy, SIZE) == 0, "round trip");
+
+  /* Output is the same regardless of buffer sizes. */
+  size = compress(orig, SIZE, multi, 2 * SIZE, 1000, 7);
+  ok(size == comp_size && memcmp(comp, multi, size) == 0,
+     "compression with small avail_out");
+
+  memset(copy, 0, SIZE);
+  rv = decompress(comp, comp_size, copy, SIZE, 1001, 7, &used, &size);
+  ok(rv == BZ_STREAM_END && used == comp_size && size == SIZE &&
+     memcmp(orig, copy, SIZE) == 0, "decompression with small avail_out");
+
+  /* Two streams followed by garbage.  Each call to decompress() must stop
+     exactly at the end of its stream, whether the whole input is available
+     or not. */
+  memcpy(multi, comp, comp_size);
+  memcpy(multi + comp_size, comp, comp_size);
+  memcpy(multi + 2 * comp_size, "xyz", 3);
+  rv = decompress(multi, 2 * comp_size + 3, copy, SIZE, 4 * SIZE, SIZE,
+                  &used, &size);
+  if (rv == BZ_STREAM_END && used == comp_size && size == SIZE)
+    rv = decompress(multi + used, comp_size + 3, copy, SIZE, 999, 4096,
+                    &used, &size2);
+  ok(rv == BZ_STREAM_END && used == comp_size && size2 == SIZE &&
+     memcmp(orig, copy, SIZE) == 0, "multiple streams");
+
+  comp[0] = 'X';
+  rv = decompress(comp, comp_size, copy, SIZE, comp_size, SIZE, &used, &size);
+  ok(rv == BZ_DATA_ERROR_MAGIC, "bad magic");
+  comp[0] = 'B';
+
+  comp[comp_size / 2] ^= 0x10;
+  rv = decompress(comp, comp_size, copy, SIZE, comp_size, SIZE, &used, &size);
+  ok(rv == BZ_DATA_ERROR, "corrupt block");
+  comp[comp_size / 2] ^= 0x10;
+
+  comp[comp_size - 3] ^= 0x01;
+  rv = decompress(comp, comp_size, copy, SIZE, 1000, SIZE, &used, &size);
+  ok(rv == BZ_DATA_ERROR, "bad stream CRC");
+  comp[comp_size - 3] ^= 0x01;
+
+  rv = decompress(comp, comp_size - 20, copy, SIZE, 1000, SIZE, &used,
+                  &size);
+  ok(rv == BZ_UNEXPECTED_EOF, "truncated stream");
+
+  free(orig);
+  free(comp);
+  free(copy);
+  free(multi);
+
+  return 0;
+}
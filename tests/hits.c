@@ -0,0 +1,290 @@
+/*-
+  hits.c -- scanner hit validation test
+
+  Copyright (C) 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Blocks found by scan() are checked with retrieve_check() before the
+  decompressor retrieves them.  Genuine blocks must be accepted, blocks
+  which retrieve() would fail on should be rejected, but no block which
+  retrieve() accepts may ever be rejected.  Data is compressed with the
+  library, and the decoder is linked in from liblbzip2.a.
+*/
+
+#include "common.h"
+
+#include <arpa/inet.h>          /* htonl() */
+#include <stdio.h>              /* printf() */
+#include <string.h>             /* memcpy() */
+
+#include "decode.h"
+#include "lbzip2.h"
+
+
+#define SIZE 1000000
+#define WORDS (SIZE / 4)
+#define TRIALS 1000
+
+static uint32_t comp[WORDS];
+static uint32_t copy[WORDS];
+static size_t comp_words;
+static struct decoder_state *ds;
+static int test_id;
+
+
+static void
+ok(int cond, const char *name)
+{
+  ++test_id;
+  printf("%sok %d %s\n", cond ? "" : "not ", test_id, name);
+}
+
+
+static unsigned long seed = 1;
+
+static unsigned
+next_random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+
+/* Generate compressible data with some long runs. */
+static void
+generate(char *buf, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    unsigned r = next_random();
+
+    if (r % 1000 == 0) {
+      size_t n = r % 5000;
+
+      while (n-- > 0 && i < size)
+        buf[i++] = 'x';
+      if (i == size)
+        break;
+    }
+    buf[i] = "abcdefgh \n"[r % 10];
+  }
+}
+
+
+static void
+attach(struct bitstream *bs, const uint32_t *data, size_t words)
+{
+  bs->live = 0;
+  bs->buff = 0;
+  bs->block = NULL;
+  bs->data = data;
+  bs->limit = data + words;
+  bs->eof = true;
+}
+
+
+/* Return bit position of the bitstream. */
+static unsigned
+position(const struct bitstream *bs, const uint32_t *data)
+{
+  return 32 * (bs->data - data) - bs->live;
+}
+
+
+/* Return n bits found at bit position p. */
+static unsigned
+get_bits(const uint32_t *data, unsigned p, unsigned n)
+{
+  const uint8_t *bytes = (const uint8_t *)data;
+  unsigned x = 0;
+
+  for (; n > 0; n--, p++)
+    x = 2 * x + ((bytes[p / 8] >> (7 - p % 8)) & 1);
+  return x;
+}
+
+
+static void
+flip_bit(uint32_t *data, unsigned p)
+{
+  ((uint8_t *)data)[p / 8] ^= 0x80 >> p % 8;
+}
+
+
+static unsigned put_pos;
+
+/* Append n least significant bits of x to copy[]. */
+static void
+put_bits(unsigned x, unsigned n)
+{
+  uint8_t *bytes = (uint8_t *)copy;
+
+  for (; n > 0; n--, put_pos++) {
+    bytes[put_pos / 8] &= ~(0x80 >> put_pos % 8);
+    bytes[put_pos / 8] |= ((x >> (n - 1)) & 1) << (7 - put_pos % 8);
+  }
+}
+
+
+/* Check a block with two trees and a single selector, made up of one
+   symbol (3 codes with lengths 1, 2 and 2) or no symbols (2 codes of
+   length 1). */
+static bool
+check_header(bool symbol)
+{
+  struct bitstream bs;
+  unsigned t;
+
+  memset(copy, 0, 64);
+  put_pos = 0;
+  put_bits(0x314159, 24);
+  put_bits(0x265359, 24);
+  put_bits(0, 32);              /* CRC */
+  put_bits(0, 1);               /* not randomized */
+  put_bits(0, 24);              /* BWT index */
+  if (symbol) {
+    put_bits(0x8000, 16);
+    put_bits(0x8000, 16);
+  }
+  else {
+    put_bits(0, 16);
+  }
+  put_bits(2, 3);               /* trees */
+  put_bits(1, 15);              /* selectors */
+  put_bits(0, 1);               /* tree 1 */
+  for (t = 0; t < 2; t++) {
+    put_bits(1, 5);
+    put_bits(0, 1);
+    if (symbol) {
+      put_bits(2, 2);           /* length + 1 */
+      put_bits(0, 1);
+    }
+    put_bits(0, 1);
+  }
+
+  attach(&bs, copy, 16);
+  return scan(&bs, 0) == OK && retrieve_check(bs, MAX_BLOCK_SIZE);
+}
+
+
+/* Retrieve the first block of the stream copied to copy[]. */
+static bool
+first_block(bool *plausible)
+{
+  struct bitstream bs;
+
+  attach(&bs, copy, comp_words);
+  if (scan(&bs, 0) != OK)
+    return false;
+  *plausible = retrieve_check(bs, MAX_BLOCK_SIZE);
+  decoder_init(ds);
+  return retrieve(ds, &bs) == OK;
+}
+
+
+int
+main(void)
+{
+  struct lbzip2 *lz;
+  struct bitstream bs;
+  char *orig;
+  size_t size;
+  unsigned hits, accepted, rejected, wrong, i, p, bwt_idx;
+  bool plausible, retrieved;
+
+  printf("1..8\n");
+
+  orig = malloc(SIZE);
+  lz = lbzip2_new();
+  ds = malloc(decoder_alloc_size());
+  if (orig == NULL || lz == NULL || ds == NULL) {
+    printf("Bail out! memory exhausted\n");
+    return 1;
+  }
+
+  generate(orig, SIZE);
+  lbzip2_set_block_size(lz, 1);
+  size = sizeof(comp);
+  if (lbzip2_compress_buffer(lz, orig, SIZE, comp, &size) != LBZIP2_OK) {
+    printf("Bail out! compression failed\n");
+    return 1;
+  }
+  comp_words = (size + 3) / 4;
+
+  hits = 0;
+  accepted = 0;
+  attach(&bs, comp, comp_words);
+  while (scan(&bs, 0) == OK) {
+    hits++;
+    accepted += retrieve_check(bs, 100000);
+  }
+  ok(hits > 1 && accepted == hits, "genuine blocks accepted");
+
+  /* The first block starts right after the stream header. */
+  attach(&bs, comp, comp_words);
+  (void)scan(&bs, 0);
+  p = position(&bs, comp);
+  bwt_idx = get_bits(comp, p + 1, 24);
+  ok(p == 80 + 32 && !retrieve_check(bs, bwt_idx) &&
+     retrieve_check(bs, bwt_idx + 1), "BWT index limit");
+
+  /* Decision is deferred until the tables are complete. */
+  bs.limit = bs.data + 2;
+  ok(retrieve_check(bs, 100000), "truncated block accepted");
+
+  memcpy(copy, comp, sizeof(copy));
+  ok(first_block(&plausible) && plausible, "retrieved block accepted");
+
+  /* The only thing wrong with the second header is its empty bitmap. */
+  ok(check_header(true), "made-up block accepted");
+  ok(!check_header(false), "empty bitmap rejected");
+
+  /* Random bits flipped in block header and coding tables make retrieve()
+     fail in most cases.  Such blocks should be rejected as well, but a
+     block rejected must never be retrievable. */
+  rejected = 0;
+  wrong = 0;
+  for (i = 0; i < TRIALS; i++) {
+    memcpy(copy, comp, sizeof(copy));
+    flip_bit(copy, p + next_random() % 4096);
+    retrieved = first_block(&plausible);
+    rejected += !plausible;
+    wrong += !plausible && retrieved;
+  }
+  ok(wrong == 0 && rejected > TRIALS / 2, "corrupt blocks rejected");
+
+  /* Random data is never a block. */
+  accepted = 0;
+  for (i = 0; i < TRIALS; i++) {
+    for (p = 0; p < 1024; p++)
+      copy[p] = (next_random() << 16) ^ next_random();
+    copy[0] = htonl(0x31415926);
+    copy[1] = htonl(0x53590000 | (copy[1] & 0xFFFF));
+    attach(&bs, copy, 1024);
+    accepted += scan(&bs, 0) == OK && retrieve_check(bs, MAX_BLOCK_SIZE);
+  }
+  ok(accepted == 0, "random data rejected");
+
+  lbzip2_free(lz);
+  free(orig);
+  free(ds);
+
+  return 0;
+}
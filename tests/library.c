@@ -0,0 +1,266 @@
+/*-
+  library.c -- liblbzip2 interface test
+
+  Copyright (C) 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lbzip2.h"
+
+
+#define SIZE (3 * 1000 * 1000)
+
+static char *orig, *comp, *copy;
+static size_t comp_size;
+static int test_id;
+
+
+static void
+ok(int cond, const char *name, struct lbzip2 *lz)
+{
+  ++test_id;
+  if (cond)
+    printf("ok %d %s\n", test_id, name);
+  else
+    printf("not ok %d %s %s\n", test_id, name, lbzip2_error(lz));
+}
+
+
+/* Generate compressible data with some long runs. */
+static void
+generate(char *buf, size_t size)
+{
+  unsigned long seed = 1;
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    if ((seed >> 16) % 1000 == 0) {
+      size_t n = (seed >> 8) % 5000;
+
+      while (n-- > 0 && i < size)
+        buf[i++] = 'x';
+      if (i == size)
+        break;
+    }
+    buf[i] = "abcdefgh \n"[(seed >> 16) % 10];
+  }
+}
+
+
+struct stream {
+  const char *in;
+  size_t in_left;
+  char *out;
+  size_t out_size;
+};
+
+
+static size_t
+read_chunks(void *opaque, void *buf, size_t size)
+{
+  struct stream *s = opaque;
+
+  /* Return short reads to exercise the engine. */
+  if (size > 12345)
+    size = 12345;
+  if (size > s->in_left)
+    size = s->in_left;
+  memcpy(buf, s->in, size);
+  s->in += size;
+  s->in_left -= size;
+  return size;
+}
+
+
+static size_t
+read_error(void *opaque, void *buf, size_t size)
+{
+  (void)opaque;
+  (void)buf;
+  (void)size;
+  return (size_t)-1;
+}
+
+
+static int
+write_chunks(void *opaque, const void *buf, size_t size)
+{
+  struct stream *s = opaque;
+
+  memcpy(s->out + s->out_size, buf, size);
+  s->out_size += size;
+  return 0;
+}
+
+
+struct job {
+  struct lbzip2 *lz;
+  char *comp;
+  char *copy;
+  int rc;
+};
+
+
+/* Compress and decompress orig with the context of given job. */
+static void *
+round_trip(void *arg)
+{
+  struct job *job = arg;
+  size_t comp_len = 2 * SIZE;
+  size_t size = SIZE;
+
+  job->rc = lbzip2_compress_buffer(job->lz, orig, SIZE, job->comp,
+                                   &comp_len);
+  if (job->rc == LBZIP2_OK)
+    job->rc = lbzip2_decompress_buffer(job->lz, job->comp, comp_len,
+                                       job->copy, &size);
+  if (job->rc == LBZIP2_OK && (size != SIZE || memcmp(orig, job->copy, SIZE)))
+    job->rc = LBZIP2_DATA_ERROR;
+  return NULL;
+}
+
+
+/* Run round trips in two threads at the same time, each with its own
+   context. */
+static int
+concurrent(void)
+{
+  struct job jobs[2];
+  pthread_t tid[2];
+  int started[2];
+  int rc = LBZIP2_OK;
+  unsigned i;
+
+  for (i = 0; i < 2; i++) {
+    jobs[i].lz = lbzip2_new();
+    jobs[i].comp = malloc(2 * SIZE);
+    jobs[i].copy = malloc(SIZE);
+    jobs[i].rc = LBZIP2_MEM_ERROR;
+    started[i] = (jobs[i].lz != NULL && jobs[i].comp != NULL &&
+                  jobs[i].copy != NULL &&
+                  pthread_create(&tid[i], NULL, round_trip, &jobs[i]) == 0);
+  }
+  for (i = 0; i < 2; i++) {
+    if (started[i])
+      pthread_join(tid[i], NULL);
+    if (jobs[i].rc != LBZIP2_OK)
+      rc = jobs[i].rc;
+    lbzip2_free(jobs[i].lz);
+    free(jobs[i].comp);
+    free(jobs[i].copy);
+  }
+  return rc;
+}
+
+
+int
+main(void)
+{
+  struct lbzip2 *lz;
+  struct stream s;
+  size_t size;
+  int rc;
+
+  printf("1..9\n");
+
+  orig = malloc(SIZE);
+  comp = malloc(2 * SIZE);
+  copy = malloc(SIZE);
+  lz = lbzip2_new();
+  if (orig == NULL || comp == NULL || copy == NULL || lz == NULL) {
+    printf("Bail out! memory exhausted\n");
+    return 1;
+  }
+  generate(orig, SIZE);
+  lbzip2_set_workers(lz, 4);
+
+  comp_size = 2 * SIZE;
+  rc = lbzip2_compress_buffer(lz, orig, SIZE, comp, &comp_size);
+  size = SIZE;
+  if (rc == LBZIP2_OK)
+    rc = lbzip2_decompress_buffer(lz, comp, comp_size, copy, &size);
+  ok(rc == LBZIP2_OK && size == SIZE && memcmp(orig, copy, SIZE) == 0,
+     "buffer round trip", lz);
+
+  lbzip2_set_block_size(lz, 1);
+  lbzip2_set_sequential(lz, 1);
+  s.in = orig;
+  s.in_left = SIZE;
+  s.out = comp;
+  s.out_size = 0;
+  rc = lbzip2_compress(lz, read_chunks, write_chunks, &s);
+  comp_size = s.out_size;
+  s.in = comp;
+  s.in_left = comp_size;
+  s.out = copy;
+  s.out_size = 0;
+  if (rc == LBZIP2_OK)
+    rc = lbzip2_decompress(lz, read_chunks, write_chunks, &s);
+  ok(rc == LBZIP2_OK && s.out_size == SIZE && memcmp(orig, copy, SIZE) == 0,
+     "streaming round trip", lz);
+
+  size = SIZE;
+  rc = lbzip2_decompress_buffer(lz, orig, SIZE, copy, &size);
+  ok(rc == LBZIP2_DATA_ERROR, "not bzip2 data", lz);
+
+  comp[comp_size / 2] ^= 0x10;
+  size = SIZE;
+  rc = lbzip2_decompress_buffer(lz, comp, comp_size, copy, &size);
+  ok(rc == LBZIP2_DATA_ERROR, "corrupt data", lz);
+  comp[comp_size / 2] ^= 0x10;
+
+  size = SIZE;
+  rc = lbzip2_decompress_buffer(lz, comp, comp_size, copy, &size);
+  ok(rc == LBZIP2_OK && size == SIZE && memcmp(orig, copy, SIZE) == 0,
+     "recovery after failure", lz);
+
+  size = SIZE / 2;
+  rc = lbzip2_decompress_buffer(lz, comp, comp_size, copy, &size);
+  ok(rc == LBZIP2_OUTBUF_FULL, "output buffer too small", lz);
+
+  s.out = comp;
+  s.out_size = 0;
+  rc = lbzip2_compress(lz, read_error, write_chunks, &s);
+  ok(rc == LBZIP2_READ_ERROR, "read error", lz);
+
+  comp_size = 2 * SIZE;
+  rc = lbzip2_compress_buffer(lz, orig, 0, comp, &comp_size);
+  size = SIZE;
+  if (rc == LBZIP2_OK)
+    rc = lbzip2_decompress_buffer(lz, comp, comp_size, copy, &size);
+  ok(rc == LBZIP2_OK && size == 0, "empty input", lz);
+
+  /* Calls made from different threads are serialized. */
+  ok(concurrent() == LBZIP2_OK, "concurrent calls", lz);
+
+  lbzip2_free(lz);
+  free(orig);
+  free(comp);
+  free(copy);
+
+  return 0;
+}
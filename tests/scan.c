@@ -0,0 +1,209 @@
+/*-
+  scan.c -- block magic scanner test
+
+  Copyright (C) 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Block magics followed by CRC are planted at known bit positions in
+  buffers and searched for with scan().  Each one must be found, at any
+  bit alignment and at any position relative to the blocks examined at
+  once, and scan() must stop right after its CRC.  Bytes of the magic
+  which don't form a whole magic must not be taken for one.  The scanner
+  is linked in from liblbzip2.a.
+*/
+
+#include "common.h"
+
+#include <stdio.h>              /* printf() */
+#include <string.h>             /* memset() */
+
+#include "decode.h"
+
+
+#define WORDS 4096
+#define BITS (32 * WORDS)
+
+static uint32_t words[WORDS];
+static uint8_t *const bytes = (uint8_t *)words;
+static int test_id;
+
+
+static void
+ok(int cond, const char *name)
+{
+  ++test_id;
+  printf("%sok %d %s\n", cond ? "" : "not ", test_id, name);
+}
+
+
+/* Fill the buffer with pseudo-random bytes. */
+static void
+make_random(void)
+{
+  static unsigned long seed = 1;
+  unsigned i;
+
+  for (i = 0; i < 4 * WORDS; i++) {
+    seed = seed * 1103515245 + 12345;
+    bytes[i] = seed >> 16;
+  }
+}
+
+
+/* Store n most significant bits of x at bit position p, most significant
+   bit first, the way they appear in a bitstream. */
+static void
+put_bits(unsigned p, uint64_t x, unsigned n)
+{
+  unsigned i;
+
+  for (i = 0; i < n; i++, p++) {
+    unsigned bit = (x >> (63 - i)) & 1;
+
+    bytes[p / 8] &= ~(0x80 >> p % 8);
+    bytes[p / 8] |= bit << (7 - p % 8);
+  }
+}
+
+
+/* Plant block magic and a CRC at bit position p. */
+static void
+plant(unsigned p)
+{
+  put_bits(p, 0x314159265359ull << 16, 48);
+  put_bits(p + 48, 0xDEADBEEFull << 32, 32);
+}
+
+
+static void
+attach(struct bitstream *bs, unsigned words_used)
+{
+  bs->live = 0;
+  bs->buff = 0;
+  bs->block = NULL;
+  bs->data = words;
+  bs->limit = words + words_used;
+  bs->eof = true;
+}
+
+
+/* Return bit position of the bitstream. */
+static unsigned
+position(const struct bitstream *bs)
+{
+  return 32 * (bs->data - words) - bs->live;
+}
+
+
+/* Scan the whole buffer for a single magic planted at bit p. */
+static bool
+find_one(unsigned p)
+{
+  struct bitstream bs;
+
+  attach(&bs, WORDS);
+  return scan(&bs, 0) == OK && position(&bs) == p + 80;
+}
+
+
+int
+main(void)
+{
+  static const unsigned where[] = {
+    0, 1, 2, 3, 4, 13, 14, 15, 16, 17, 47, 48, 61, 62, 63, 64, 65, 66, 127,
+    128, 1000, 4 * WORDS - 16, 4 * WORDS - 11,
+  };
+  static const uint8_t pairs[8][2] = {
+    { 0x31, 0x41 }, { 0xA0, 0xAC }, { 0x50, 0x56 }, { 0x28, 0x2B },
+    { 0x14, 0x15 }, { 0x8A, 0x0A }, { 0xC5, 0x05 }, { 0x62, 0x82 },
+  };
+  unsigned planted[200];
+  struct bitstream bs;
+  unsigned i, k, p;
+  bool pass;
+
+  printf("1..7\n");
+
+  pass = true;
+  for (i = 0; i < sizeof(where) / sizeof(where[0]); i++) {
+    for (k = 0; k < 8; k++) {
+      make_random();
+      plant(8 * where[i] + k);
+      pass &= find_one(8 * where[i] + k);
+    }
+  }
+  ok(pass, "magic at every bit alignment");
+
+  /* Gaps are random, so magics are scattered over all alignments. */
+  make_random();
+  p = 0;
+  for (i = 0; i < 200; i++) {
+    p += 80 + bytes[i] % 256;
+    planted[i] = p;
+    plant(p);
+  }
+  attach(&bs, WORDS);
+  pass = true;
+  for (i = 0; i < 200; i++)
+    pass &= scan(&bs, 0) == OK && position(&bs) == planted[i] + 80;
+  ok(pass && scan(&bs, 0) == MORE, "consecutive magics found in order");
+
+  /* Whole magics contain these pairs of bytes, which aren't magics by
+     themselves.  Neither is a magic with its last bit flipped. */
+  memset(words, 0, sizeof(words));
+  for (i = 0; i < 64; i++) {
+    k = i % 8;
+    bytes[61 * i] = pairs[k][0];
+    bytes[61 * i + 1] = pairs[k][1];
+  }
+  put_bits(8 * 3999 + 5, 0x314159265358ull << 16, 48);
+  attach(&bs, WORDS);
+  ok(scan(&bs, 0) == MORE && bs.data == bs.limit, "no false magics");
+
+  memset(words, 0, sizeof(words));
+  plant(BITS - 80);
+  ok(find_one(BITS - 80), "magic at end of buffer");
+
+  memset(words, 0, sizeof(words));
+  put_bits(BITS - 67, 0x314159265359ull << 16, 48);
+  attach(&bs, WORDS);
+  ok(scan(&bs, 0) == MORE && bs.data == bs.limit, "truncated CRC");
+
+  /* Skipped bits are rounded up to whole words. */
+  make_random();
+  plant(100);
+  plant(5003);
+  attach(&bs, WORDS);
+  ok(scan(&bs, 150) == OK && position(&bs) == 5083, "magic skipped");
+
+  /* Scanning resumes across buffers sharing the same memory, as in
+     locate_block(), which keeps the last two words. */
+  make_random();
+  plant(32 * 1000 - 21);
+  attach(&bs, 1000);
+  pass = scan(&bs, 0) == MORE;
+  bs.data = words + 998;
+  bs.limit = words + WORDS;
+  bs.live = 0;
+  bs.buff = 0;
+  ok(pass && scan(&bs, 0) == OK && position(&bs) == 32 * 1000 + 59,
+     "magic crossing buffer boundary");
+
+  return 0;
+}
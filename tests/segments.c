@@ -0,0 +1,214 @@
+/*-
+  segments.c -- segmented inverse BWT test
+
+  Copyright (C) 2015 Mikolaj Izdebski
+
+  This file is part of lbzip2.
+
+  lbzip2 is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  lbzip2 is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with lbzip2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  IBWT lists built by decode() are split with decode_split(), walked segment
+  by segment with decode_segment() in various orders, and joined with
+  decode_join().  The resulting linear list must spell the block whose BWT
+  was decoded.  The decoder is linked in from liblbzip2.a.
+*/
+
+#include "common.h"
+
+#include <stdio.h>              /* printf() */
+#include <string.h>             /* memcmp() */
+
+#include "decode.h"
+
+
+#define MAX_SIZE 300000
+
+static uint8_t block[MAX_SIZE];
+static uint8_t twice[2 * MAX_SIZE];
+static int32_t rot[MAX_SIZE];
+static uint8_t bwt[MAX_SIZE];
+static uint32_t bwt_idx;
+static int32_t size;
+static struct decoder_state *ds;
+static int test_id;
+
+
+static void
+ok(int cond, const char *name)
+{
+  ++test_id;
+  printf("%sok %d %s\n", cond ? "" : "not ", test_id, name);
+}
+
+
+static int
+rot_cmp(const void *a, const void *b)
+{
+  return memcmp(twice + *(const int32_t *)a, twice + *(const int32_t *)b,
+                size);
+}
+
+
+/* Compute BWT of the first n characters of the block by sorting rotations
+   naively, and repeat it to cover m copies of them, which is BWT of the
+   block repeated m times if it's primitive. */
+static void
+make_bwt(int32_t n, int32_t m)
+{
+  int32_t i, j;
+
+  size = n;
+  memcpy(twice, block, n);
+  memcpy(twice + n, block, n);
+  for (i = 0; i < n; i++)
+    rot[i] = i;
+  qsort(rot, n, sizeof(rot[0]), rot_cmp);
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < m; j++)
+      bwt[i * m + j] = block[(rot[i] + n - 1) % n];
+    if (rot[i] == 0)
+      bwt_idx = i * m;
+  }
+  for (i = n; i < n * m; i++)
+    block[i] = block[i - n];
+  size = n * m;
+}
+
+
+/* Load BWT into the decoder as retrieve() would and build the IBWT list. */
+static void
+load(void)
+{
+  int32_t i;
+
+  decoder_init(ds);
+  memset(ds->ftab, 0, sizeof(ds->ftab));
+  for (i = 0; i < size; i++) {
+    ds->tt[i] = bwt[i];
+    ds->ftab[bwt[i]]++;
+  }
+  ds->rand = false;
+  ds->bwt_idx = bwt_idx;
+  ds->block_size = size;
+  ds->half = 0;
+
+  decode(ds);
+}
+
+
+/* Walk the IBWT list as emit() does. */
+static bool
+check_walk(void)
+{
+  uint32_t p = ds->rle_index;
+  int32_t i;
+
+  for (i = 0; i < size; i++) {
+    p = ds->tt[p >> 8];
+    if ((p & 0xFF) != block[i])
+      return false;
+  }
+  return true;
+}
+
+
+/* Split the list in up to k segments, walk them backwards or forwards and
+   join them.  Return the number of segments, or 0 if the result doesn't
+   spell the block. */
+static unsigned
+split(unsigned k, bool backwards)
+{
+  unsigned i, n;
+  int32_t j;
+
+  n = decode_split(ds, k);
+  if (n < 2)
+    return 0;
+  for (i = 0; i < n; i++)
+    decode_segment(ds, backwards ? n - 1 - i : i);
+  decode_join(ds);
+
+  if (!ds->linear || ds->rle_index != 0)
+    return 0;
+  for (j = 0; j < size; j++)
+    if (ds->tt[j] != (((uint32_t)j + 1) << 8) + block[j])
+      return 0;
+  return n;
+}
+
+
+/* Fill the block with n pseudo-random characters from alphabet of size as. */
+static void
+make_random(int32_t n, unsigned as)
+{
+  static unsigned long seed = 1;
+  int32_t i;
+
+  for (i = 0; i < n; i++) {
+    seed = seed * 1103515245 + 12345;
+    block[i] = 'a' + (seed >> 16) % as;
+  }
+}
+
+
+int
+main(void)
+{
+  unsigned n;
+
+  printf("1..8\n");
+
+  ds = xmalloc(decoder_alloc_size());
+
+  make_random(MAX_SIZE, 256);
+  make_bwt(MAX_SIZE, 1);
+  load();
+  ok(check_walk(), "IBWT list of random block");
+
+  ok(decode_split(ds, 1) == 0, "no split into one segment");
+
+  ok(split(2, false) == 2, "two segments");
+
+  load();
+  ok(split(4, true) == 4, "four segments walked backwards");
+
+  /* Segments average at least 64k characters. */
+  load();
+  n = split(100, false);
+  ok(n >= 2 && n <= MAX_SIZE / 65536, "segment count limited by block size");
+
+  make_random(100000, 256);
+  make_bwt(100000, 1);
+  load();
+  ok(decode_split(ds, 4) == 0, "small block not split");
+
+  /* The list of a repeated string has a cycle for each repetition, and
+     samples land on several of them. */
+  make_random(97, 4);
+  make_bwt(97, MAX_SIZE / 97);
+  load();
+  ok(split(4, true) == 4, "periodic block");
+
+  make_random(1, 1);
+  make_bwt(1, MAX_SIZE);
+  load();
+  ok(split(3, false) == 3, "run of one character");
+
+  free(ds);
+
+  return 0;
+}